@@ -0,0 +1,147 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Compares an index of diff paths and all their ancestors kept as strings,
+ * as the dependency dag used to, with path_trie.h, in heap bytes and in
+ * paths/sec for interning and for parent and subtree queries.
+ *
+ * Usage : path-bench [paths] [depth]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <stdlib.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "../path_trie.h"
+
+using namespace std;
+
+// Bytes requested from the heap by the whole process
+static atomic<unsigned long long> heapBytes{0};
+
+__attribute__((noinline)) void *
+operator new(size_t size)
+{
+   heapBytes += size;
+   if (void *p = malloc(size > 0 ? size : 1)) {
+      return p;
+   }
+   throw bad_alloc();
+}
+
+// Neither is inlined, so that frees are not matched against the news
+__attribute__((noinline)) void
+operator delete(void *p) noexcept
+{
+   free(p);
+}
+
+// Paths under a few deep directories, like a diff of one busy subtree
+static vector<string>
+MakePaths(size_t numPaths, unsigned depth)
+{
+   vector<string> paths;
+
+   paths.reserve(numPaths);
+   for (size_t i = 0; i < numPaths; ++i) {
+      string path = "volume";
+
+      for (unsigned d = 1; d < depth; ++d) {
+         path += "/directory" + to_string((i >> (2 * d)) % 4);
+      }
+      path += "/file" + to_string(i) + ".dat";
+      paths.push_back(std::move(path));
+   }
+   return paths;
+}
+
+template <class F>
+static void
+Run(const char *name, size_t numPaths, F f)
+{
+   unsigned long long bytes = heapBytes;
+   auto start = chrono::steady_clock::now();
+   size_t checksum = f();
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+   cout << name << ": " << (size_t)(numPaths / elapsed.count()) << " paths/sec, "
+        << (heapBytes - bytes) / numPaths << " heap bytes/path (checksum "
+        << checksum << ")" << endl;
+}
+
+int main(int argc, char** argv)
+{
+   size_t numPaths = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+   unsigned depth = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+
+   if (numPaths == 0 || depth == 0) {
+      cerr << "Usage : " << argv[0] << " [paths] [depth]" << endl;
+      return 1;
+   }
+
+   vector<string> paths = MakePaths(numPaths, depth);
+
+   {
+      unordered_set<string> index;
+
+      Run("strings, intern", numPaths, [&] {
+         for (const string& path : paths) {
+            index.insert(path);
+            for (size_t slash = path.find('/'); slash != string::npos;
+                 slash = path.find('/', slash + 1)) {
+               index.insert(path.substr(0, slash));
+            }
+         }
+         return index.size();
+      });
+      Run("strings, parents", numPaths, [&] {
+         size_t found = 0;
+
+         for (const string& path : paths) {
+            found += index.count(path.substr(0, path.rfind('/')));
+         }
+         return found;
+      });
+   }
+
+   {
+      PathTrie trie;
+      vector<PathNode> nodes;
+
+      nodes.reserve(numPaths);
+      Run("trie,    intern", numPaths, [&] {
+         for (const string& path : paths) {
+            nodes.push_back(trie.Intern(path.data(), path.size()));
+         }
+         return trie.NumNodes();
+      });
+      Run("trie,    parents", numPaths, [&] {
+         size_t found = 0;
+
+         for (PathNode node : nodes) {
+            found += trie.Parent(node) != PATH_ROOT;
+         }
+         return found;
+      });
+      Run("trie,    subtree", numPaths, [&] {
+         PathNode subtree = trie.Find("volume/directory1", 17);
+         size_t found = 0;
+
+         for (PathNode node : nodes) {
+            found += trie.IsUnder(node, subtree);
+         }
+         return found;
+      });
+      cout << "trie: " << trie.NumNodes() << " nodes in " << trie.MemoryBytes()
+           << " bytes" << endl;
+   }
+   return 0;
+}
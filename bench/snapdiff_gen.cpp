@@ -0,0 +1,80 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Writes a synthetic snapdiff, as generated by snapdiff_gen.h, to disk so
+ * that snapshot-diff can be run against it without a VDFS mount:
+ *
+ *    <root>/.snap/diff/s1^s2^<cookie>   the snapdiff pages
+ *    <root>/...                         the entries of the second snapshot
+ *
+ * Usage : snapdiff-gen [--pages=N] [--entries=N] [--depth=N] [--seed=N] <root>
+ * then    snapshot-diff <root>/.snap/diff s1 s2 <result dir>
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+
+#include "snapdiff_gen.h"
+
+using namespace std;
+
+static bool
+ParseOption(const string& arg, const char *name, unsigned *val)
+{
+   string prefix = string("--") + name + "=";
+   char *end;
+
+   if (arg.compare(0, prefix.size(), prefix) != 0) {
+      return false;
+   }
+   *val = (unsigned)strtoul(arg.c_str() + prefix.size(), &end, 10);
+   return *end == '\0';
+}
+
+int main(int argc, char** argv)
+{
+   SnapDiffGenOptions opts;
+   SnapDiffGen gen;
+   string root;
+
+   for (int i = 1; i < argc; ++i) {
+      string arg = argv[i];
+
+      if (ParseOption(arg, "pages", &opts.pages) ||
+          ParseOption(arg, "entries", &opts.entriesPerPage) ||
+          ParseOption(arg, "depth", &opts.maxDepth) ||
+          ParseOption(arg, "seed", &opts.seed)) {
+         continue;
+      }
+      if (arg.compare(0, 2, "--") == 0 || !root.empty()) {
+         root.clear();
+         break;
+      }
+      root = arg;
+   }
+
+   if (root.empty() || opts.pages == 0 || opts.entriesPerPage == 0 ||
+       opts.maxDepth == 0) {
+      cerr << "Usage : " << argv[0] << " [--pages=N] [--entries=N] [--depth=N]"
+           << " [--seed=N] <root>" << endl;
+      return 1;
+   }
+
+   GenerateSnapDiff(opts, gen);
+
+   string snapDir = root + "/.snap/diff";
+
+   if (!WriteSnapDiffPages(gen, snapDir, "s1", "s2") ||
+       !WriteSnapDiffTree(gen, root)) {
+      cerr << "Could not write snapdiff to " << root << endl;
+      return 1;
+   }
+
+   cout << gen.pages.size() << " pages, " << gen.numEntries << " entries, "
+        << gen.numBytes << " bytes in " << snapDir << endl;
+   return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __SNAPDIFF_GEN_H__
+#define __SNAPDIFF_GEN_H__
+
+#include <errno.h>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/*
+ * Synthetic snapdiff generator for the benchmarks. It produces the pages
+ * VDFS serves as <snapdir>/<snap1>^<snap2>^<cookie> for a random tree
+ * change, one "level objId OP path [extra]" line per entry and each page
+ * terminated by "level objId EOB", the last one by EOF. The cookie of a
+ * page is the objId of the last entry of the page before it, "0" for the
+ * first.
+ *
+ * Levels follow the ordering VDFS uses: the .vdfs staging directory is
+ * created at the lowest level (-513) and deleted at the highest (513),
+ * deletes happen deepest first at negative levels, entries are created
+ * parents first at their depth, and renames that have to wait for other
+ * entries go through .vdfs/<n> (-512 and 512). Renamed directories stay
+ * within their top-level subtree, so that a diff filtered to a subtree
+ * moves some of them through .vdfs within the selection. Within a page
+ * the levels are mixed as in real diffs.
+ *
+ * The generator also lists the entries of the second snapshot, so that a
+ * matching tree can be created for the stat step of the json output,
+ * which looks up entries in <snapdir>/../../<path>.
+ */
+struct SnapDiffGenOptions {
+   unsigned pages = 30;
+   unsigned entriesPerPage = 2500;
+   unsigned fanout = 8;           // subdirectories per directory
+   unsigned maxDepth = 4;
+   unsigned deletePercent = 10;
+   unsigned renamePercent = 5;    // half of them staged through .vdfs
+   unsigned symlinkPercent = 5;
+   unsigned seed = 1;
+};
+
+// An entry of the second snapshot: 'f'ile, 'd'irectory or 'l'ink
+struct SnapDiffGenEntry {
+   char        type;
+   std::string path;
+   size_t      size;
+   std::string target;
+};
+
+struct SnapDiffGen {
+   std::vector<std::pair<std::string, std::string>> pages;   // cookie, page
+   std::vector<SnapDiffGenEntry>                    tree;
+   size_t                                           numEntries = 0;
+   size_t                                           numBytes = 0;
+};
+
+
+/*
+ * Builds a random path of depth levels below the root, e.g. d3/d0/d5/f17
+ * for a file at depth 4.
+ */
+static inline std::string
+SnapDiffGenPath(std::mt19937& rng, const SnapDiffGenOptions& opts,
+                unsigned depth, const char *leaf, unsigned long long objId)
+{
+   std::string path;
+
+   for (unsigned d = 1; d < depth; ++d) {
+      path += "d" + std::to_string(rng() % opts.fanout) + "/";
+   }
+   return path + leaf + std::to_string(objId);
+}
+
+
+static inline void
+GenerateSnapDiff(const SnapDiffGenOptions& opts, SnapDiffGen& gen)
+{
+   static const char *changeOps[] = { "CMS", "MS", "M", "S", "X", "CS" };
+   std::mt19937 rng(opts.seed);
+   unsigned long long objId = 100;
+   unsigned long long numStaged = 0;
+   unsigned long long total = (unsigned long long)opts.pages * opts.entriesPerPage;
+   std::ostringstream page;
+   std::string cookie = "0";
+   unsigned pageEntries = 0;
+   auto percent = [&rng](unsigned p) { return rng() % 100 < p; };
+
+   gen = SnapDiffGen();
+
+   auto addLine = [&](int level, const std::string& entry) {
+      page << level << ' ' << ++objId << ' ' << entry << '\n';
+      ++gen.numEntries;
+      if (++pageEntries >= opts.entriesPerPage || gen.numEntries >= total) {
+         bool last = gen.numEntries >= total;
+
+         page << 0 << ' ' << objId + 1 << (last ? " EOF" : " EOB") << '\n';
+         gen.numBytes += page.str().size();
+         gen.pages.emplace_back(cookie, page.str());
+         cookie = std::to_string(objId);
+         page.str(std::string());
+         pageEntries = 0;
+      }
+   };
+
+   // Staging directory for renames, deleted again as the last entry
+   bool staging = opts.renamePercent > 0 && total > 2;
+
+   if (staging) {
+      addLine(-513, "DIR_C .vdfs");
+   }
+
+   while (gen.numEntries < total - (staging ? 1 : 0)) {
+      unsigned depth = 1 + rng() % opts.maxDepth;
+
+      if (percent(opts.deletePercent)) {
+         const char *type = percent(20) ? "DIR" : "FILE";
+         addLine(-(int)depth, std::string(type) + "_DELETE " +
+                 SnapDiffGenPath(rng, opts, depth, type[0] == 'D' ? "d" : "f", objId));
+      } else if (percent(opts.renamePercent)) {
+         // Directories are moved within their top-level subtree
+         bool dir = percent(20);
+         std::string from = SnapDiffGenPath(rng, opts, depth, dir ? "d" : "f", objId);
+         std::string to = SnapDiffGenPath(rng, opts, 1 + rng() % opts.maxDepth, "r", objId);
+         std::string op = dir ? "DIR_RENAME " : "FILE_RENAME ";
+
+         if (dir && from.find('/') != std::string::npos) {
+            to = from.substr(0, from.find('/') + 1) + to;
+         }
+         if (numStaged % 2 == 0 && gen.numEntries + 2 < total) {
+            std::string stage = ".vdfs/" + std::to_string(numStaged);
+
+            addLine(-512, op + from + '\t' + stage);
+            addLine(512, op + stage + '\t' + to);
+         } else {
+            addLine(0, op + from + '\t' + to);
+         }
+         ++numStaged;
+         gen.tree.push_back({dir ? 'd' : 'f', to, dir ? 0 : (size_t)(rng() % 65536),
+                             std::string()});
+      } else if (percent(opts.symlinkPercent)) {
+         std::string path = SnapDiffGenPath(rng, opts, depth, "l", objId);
+         std::string target = "target" + std::to_string(objId);
+
+         addLine(depth, "SYM_CS " + path + '\t' + target);
+         gen.tree.push_back({'l', path, 0, target});
+      } else if (percent(10)) {
+         std::string path = SnapDiffGenPath(rng, opts, depth, "d", objId);
+
+         addLine(depth, std::string("DIR_") + changeOps[rng() % 6] + ' ' + path);
+         gen.tree.push_back({'d', path, 0, std::string()});
+      } else {
+         std::string path = SnapDiffGenPath(rng, opts, depth, "f", objId);
+
+         addLine(percent(50) ? depth : 0,
+                 std::string("FILE_") + changeOps[rng() % 6] + ' ' + path);
+         gen.tree.push_back({'f', path, (size_t)(rng() % 65536), std::string()});
+      }
+   }
+
+   if (staging) {
+      addLine(513, "DIR_DELETE .vdfs");
+   }
+}
+
+
+// Creates dirPath and its missing parents
+static inline bool
+SnapDiffGenMkDirs(const std::string& dirPath)
+{
+   for (size_t pos = dirPath.find('/', 1); ; pos = dirPath.find('/', pos + 1)) {
+      std::string dir = dirPath.substr(0, pos);
+
+      if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+         return false;
+      }
+      if (pos == std::string::npos) {
+         return true;
+      }
+   }
+}
+
+
+/*
+ * Writes the pages into snapDir as <snap1>^<snap2>^<cookie> files, as
+ * served by VDFS.
+ */
+static inline bool
+WriteSnapDiffPages(const SnapDiffGen& gen, const std::string& snapDir,
+                   const std::string& snap1, const std::string& snap2)
+{
+   if (!SnapDiffGenMkDirs(snapDir)) {
+      return false;
+   }
+   for (const auto& page : gen.pages) {
+      std::ofstream file{snapDir + "/" + snap1 + "^" + snap2 + "^" + page.first};
+
+      if (!(file << page.second) || (file.close(), !file)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ * Creates the entries of the second snapshot below root, files as sparse
+ * files of their size.
+ */
+static inline bool
+WriteSnapDiffTree(const SnapDiffGen& gen, const std::string& root)
+{
+   for (const SnapDiffGenEntry& entry : gen.tree) {
+      std::string path = root + "/" + entry.path;
+      size_t slash = path.rfind('/');
+
+      if (!SnapDiffGenMkDirs(path.substr(0, slash))) {
+         return false;
+      }
+
+      if (entry.type == 'd') {
+         if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) {
+            return false;
+         }
+      } else if (entry.type == 'l') {
+         if (symlink(entry.target.c_str(), path.c_str()) != 0 && errno != EEXIST) {
+            return false;
+         }
+      } else {
+         std::ofstream file{path};
+
+         if (!file.is_open() || (file.close(), !file) ||
+             truncate(path.c_str(), entry.size) != 0) {
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+#endif /* __SNAPDIFF_GEN_H__ */
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __SNAPDIFF_STANDIN_H__
+#define __SNAPDIFF_STANDIN_H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <string>
+#include <thread>
+
+#include "../snapdiff_file.h"
+#include "snapdiff_gen.h"
+
+/*
+ * Local stand-in for the snapdiff files of VDFS, serving generated pages
+ * from memory with the behavior seen on NFS mounts: every open and every
+ * read takes a configurable latency, a page may fail to open with ENOENT
+ * a number of times before it appears, reads may fail with EIO in the
+ * middle of a page, and reads of more than maxReadSize bytes fail with
+ * EINVAL, as VDFS does for buffers it cannot serve. Seeking is supported,
+ * as by regular files.
+ */
+struct SnapDiffStandinOptions {
+   unsigned openLatencyUs = 0;
+   unsigned readLatencyUs = 0;    // per read
+   size_t   maxReadSize = 0;      // 0 for no limit
+   bool     reportSize = true;    // pages report their size, as local files do
+   unsigned enoentOpens = 0;      // failed opens of each page before it appears
+   unsigned badReadEvery = 0;     // every n-th page read goes bad halfway, 0 never
+};
+
+class SnapDiffStandinFile : public SnapDiffFile {
+public:
+   SnapDiffStandinFile(const std::string& data, const SnapDiffStandinOptions& opts,
+                       size_t failAt, std::atomic<unsigned>& sizeFailures)
+      : data_(data), opts_(opts), pos_(0), failAt_(failAt),
+        sizeFailures_(sizeFailures)
+   {}
+
+   long long Read(char *buf, size_t len) override {
+      if (opts_.readLatencyUs > 0) {
+         std::this_thread::sleep_for(std::chrono::microseconds(opts_.readLatencyUs));
+      }
+      if (opts_.maxReadSize > 0 && len > opts_.maxReadSize) {
+         ++sizeFailures_;
+         errno = EINVAL;
+         return -1;
+      }
+      if (pos_ >= data_.size()) {
+         return 0;
+      }
+      if (pos_ >= failAt_) {
+         failAt_ = std::string::npos;
+         errno = EIO;
+         return -1;
+      }
+
+      size_t end = std::min(data_.size(), failAt_);
+
+      len = std::min(len, end - pos_);
+      memcpy(buf, data_.data() + pos_, len);
+      pos_ += len;
+      return len;
+   }
+
+   bool Seek(unsigned long long offset) override {
+      if (offset > data_.size()) {
+         return false;
+      }
+      pos_ = offset;
+      return true;
+   }
+
+   long long Size() override {
+      return opts_.reportSize ? (long long)data_.size() : -1;
+   }
+
+private:
+   const std::string&            data_;
+   const SnapDiffStandinOptions& opts_;
+   size_t                        pos_;
+   size_t                        failAt_;
+   std::atomic<unsigned>&        sizeFailures_;
+};
+
+class SnapDiffStandin {
+public:
+   SnapDiffStandin(const SnapDiffGen& gen, const SnapDiffStandinOptions& opts)
+      : opens(0), reads(0), enoents(0), badReads(0), sizeFailures(0), opts_(opts)
+   {
+      for (const auto& page : gen.pages) {
+         pages_[page.first] = &page.second;
+      }
+   }
+
+   /*
+    * Opens the page of the cookie following the last '^' of fileName. The
+    * pages must stay valid while streams are open.
+    */
+   std::unique_ptr<SnapDiffFile> Open(const std::string& fileName) {
+      std::string cookie = fileName.substr(fileName.rfind('^') + 1);
+      size_t failAt = std::string::npos;
+
+      if (opts_.openLatencyUs > 0) {
+         std::this_thread::sleep_for(std::chrono::microseconds(opts_.openLatencyUs));
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto page = pages_.find(cookie);
+      unsigned numOpens = ++openCounts_[cookie];
+
+      ++opens;
+      if (page == pages_.end() || numOpens <= opts_.enoentOpens) {
+         ++enoents;
+         errno = ENOENT;
+         return nullptr;
+      }
+      ++reads;
+      if (opts_.badReadEvery > 0 && reads % opts_.badReadEvery == 0) {
+         ++badReads;
+         failAt = page->second->size() / 2;
+      }
+      return std::unique_ptr<SnapDiffFile>(
+         new SnapDiffStandinFile(*page->second, opts_, failAt, sizeFailures));
+   }
+
+   void Reset() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      openCounts_.clear();
+      opens = reads = enoents = badReads = sizeFailures = 0;
+   }
+
+   std::atomic<unsigned> opens;
+   std::atomic<unsigned> reads;
+   std::atomic<unsigned> enoents;
+   std::atomic<unsigned> badReads;
+   std::atomic<unsigned> sizeFailures;
+
+private:
+   SnapDiffStandinOptions                    opts_;
+   std::mutex                                mutex_;
+   std::map<std::string, const std::string*> pages_;
+   std::map<std::string, unsigned>           openCounts_;
+};
+
+#endif /* __SNAPDIFF_STANDIN_H__ */
@@ -0,0 +1,361 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Stage microbenchmarks: times ReadRawDiff, BucketizeDiff, SerializeBuckets
+ * and GenerateJSON on a synthetic snapdiff (snapdiff_gen.h) served by the
+ * local VDFS stand-in (snapdiff_standin.h), in entries/sec, and counts the
+ * heap allocations per entry of each. The library is compiled into the
+ * benchmark to get at its stages. Built with a codec (make COMPRESS=zstd
+ * or COMPRESS=zlib) it also times a whole diff with and without compress
+ * and checks that the compressed outputs read back to the plain ones.
+ *
+ * Usage : stage-bench [pages] [entries per page]
+ */
+
+#include "../snapshot_diff.cpp"
+
+#include <chrono>
+#include <ftw.h>
+#include <iterator>
+#include <new>
+#include <stdlib.h>
+
+#include "snapdiff_gen.h"
+#include "snapdiff_standin.h"
+
+static SnapDiffStandin *standin;
+
+// Heap allocations of the whole process, to tell the per-entry ones
+static atomic<unsigned long long> heapAllocs{0};
+
+void *
+operator new(size_t size)
+{
+   ++heapAllocs;
+   if (void *p = malloc(size > 0 ? size : 1)) {
+      return p;
+   }
+   throw bad_alloc();
+}
+
+// Not inlined, so that frees are not matched against the news they undo
+__attribute__((noinline)) void
+operator delete(void *p) noexcept
+{
+   free(p);
+}
+
+__attribute__((noinline)) void
+operator delete(void *p, size_t) noexcept
+{
+   free(p);
+}
+
+static unique_ptr<SnapDiffFile>
+OpenStandin(const string& fileName)
+{
+   return standin->Open(fileName);
+}
+
+static int
+RemoveEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+   return remove(path);
+}
+
+template <class F>
+static void
+Run(const char *name, size_t numEntries, F stage)
+{
+   unsigned long long allocs = heapAllocs;
+   auto start = chrono::steady_clock::now();
+   bool ok = stage();
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+   allocs = heapAllocs - allocs;
+   if (!ok) {
+      cout << name << ": FAILED" << endl;
+      return;
+   }
+   cout << name << ": " << (size_t)(numEntries / elapsed.count()) << " entries/sec"
+        << " (" << (size_t)(elapsed.count() * 1000) << " ms, "
+        << (double)allocs / numEntries << " allocations/entry)" << endl;
+}
+
+// Reads the whole diff from a stand-in with the given behavior
+static void
+RunRead(const char *name, const SnapDiffGen& gen, const string& snapDir,
+        const SnapDiffStandinOptions& standinOpts, unsigned prefetchPages,
+        size_t readBlockSize, ostream& logFile)
+{
+   SnapDiffStandin readStandin{gen, standinOpts};
+
+   standin = &readStandin;
+   Run(name, gen.numEntries, [&] {
+      return ReadRawDiff(snapDir, "s1", "s2", "", false, prefetchPages, readBlockSize,
+                         nullptr, nullptr, nullptr, logFile) == (int)gen.pages.size();
+   });
+   if (readStandin.enoents > 0 || readStandin.badReads > 0 ||
+       readStandin.sizeFailures > 0) {
+      cout << "   " << readStandin.opens << " opens, " << readStandin.enoents
+           << " ENOENT, " << readStandin.badReads << " bad reads, "
+           << readStandin.sizeFailures << " oversized reads" << endl;
+   }
+}
+
+// Bucketizes the raw pages into a fresh store and serializes it
+static void
+RunBucketize(const string& name, const SnapDiffGen& gen, const string& rawDir,
+             const string& resultDir, unsigned numThreads, ostream& logFile)
+{
+   BucketStore store;
+
+   store.bucketsDir = resultDir + "/parallel_diff";
+   store.memLimit = numeric_limits<size_t>::max();
+   MkDir(resultDir);
+
+   Run(("bucketize, " + name).c_str(), gen.numEntries, [&] {
+      return BucketizeDiff(store, rawDir, gen.pages.size(), numThreads, logFile);
+   });
+   Run(("serialize, " + name).c_str(), gen.numEntries, [&] {
+      return SerializeBuckets(store, resultDir, true, false, false, 0, 0, nullptr,
+                              nullptr, numThreads, logFile);
+   });
+}
+
+// Converts the serialized diff in resultDir to json
+static void
+RunJson(const string& name, const SnapDiffGen& gen, const string& snapDir,
+        const string& resultDir, unsigned jsonThreads, unsigned statThreads,
+        ostream& logFile)
+{
+   SnapshotDiffOptions opts;
+   ArenaCounters arenas;
+   string jsonDir = resultDir + "/json_" + to_string(jsonThreads) + "_" +
+                    to_string(statThreads);
+
+   SnapshotDiffOptionsInit(&opts);
+   opts.jsonThreads = jsonThreads;
+   opts.statThreads = statThreads;
+   MkDir(jsonDir);
+
+   Run(("json, " + name).c_str(), gen.numEntries, [&] {
+      return GenerateJSON(snapDir, jsonDir, resultDir, opts, nullptr, &arenas,
+                          logFile);
+   });
+   cout << "   " << arenas.allocs << " arena allocations in " << arenas.blocks
+        << " blocks of " << arenas.blockBytes << " bytes" << endl;
+}
+
+// Whole content of an output file, decompressed if it is compressed
+static bool
+ReadOutput(const string& fileName, string& content)
+{
+   unique_ptr<istream> file = OpenInputFile(fileName);
+
+   if (!file) {
+      return false;
+   }
+   content.assign(istreambuf_iterator<char>(*file), istreambuf_iterator<char>());
+   return !file->bad();
+}
+
+// Compares the plain files of dir in plainDir with their compressed form
+static bool
+CompareOutputDir(const string& plainDir, const string& packedDir,
+                 const string& dir, size_t& numFiles)
+{
+   DIR *dirp = opendir((plainDir + "/" + dir).c_str());
+   struct dirent *dp;
+   bool same = dirp != NULL;
+
+   while (same && (dp = readdir(dirp)) != NULL) {
+      string name = dir + "/" + dp->d_name;
+      string plain;
+      string unpacked;
+
+      if (dp->d_name[0] == '.') {
+         continue;
+      }
+      same = ReadOutput(plainDir + "/" + name, plain) &&
+             ReadOutput(packedDir + "/" + name + COMPRESSED_SUFFIX, unpacked) &&
+             plain == unpacked;
+      if (!same) {
+         cout << "   " << name << COMPRESSED_SUFFIX << " differs" << endl;
+      }
+      ++numFiles;
+   }
+   if (dirp != NULL) {
+      closedir(dirp);
+   }
+   return same;
+}
+
+/*
+ * Runs the whole diff into resultDir/plain and resultDir/compressed and
+ * reads the compressed raw pages, parallel_diff levels, serialized diff,
+ * each of its levels through the .levels index, and json chunks back.
+ */
+static void
+RunCompress(const SnapDiffGen& gen, const string& snapDir,
+            const string& resultDir, ostream& logFile)
+{
+   SnapshotDiffOptions opts;
+   string plainDir = resultDir + "/plain";
+   string packedDir = resultDir + "/compressed";
+   string serialized = packedDir + "/serialized_diff" COMPRESSED_SUFFIX;
+   size_t numFiles = 0;
+   size_t numLevels = 0;
+   bool same = true;
+
+   SnapshotDiffOptionsInit(&opts);
+   MkDir(resultDir);
+   MkDir(plainDir);
+   MkDir(packedDir);
+
+   Run("diff, uncompressed", gen.numEntries, [&] {
+      return GetSnapshotDiffEx(snapDir.c_str(), "s1", "s2", plainDir.c_str(),
+                               &opts) == 0;
+   });
+   opts.compress = true;
+   Run("diff, compressed", gen.numEntries, [&] {
+      return GetSnapshotDiffEx(snapDir.c_str(), "s1", "s2", packedDir.c_str(),
+                               &opts) == 0;
+   });
+
+   for (const char *dir : { "raw", "parallel_diff", "serialized_json" }) {
+      same = CompareOutputDir(plainDir, packedDir, dir, numFiles) && same;
+   }
+
+   string plain;
+   string unpacked;
+
+   if (!ReadOutput(plainDir + "/serialized_diff", plain) ||
+       !ReadOutput(serialized, unpacked) || plain != unpacked) {
+      cout << "   serialized_diff" COMPRESSED_SUFFIX " differs" << endl;
+      same = false;
+   }
+
+   ifstream index{serialized + ".levels"};
+   int level;
+   unsigned long long offset;
+   unsigned long long length;
+
+   while (index >> level >> offset >> length) {
+      SnapDiffReader *reader = SnapDiffReaderOpenLevel(serialized.c_str(), level);
+      char buf[4096];
+      long long nread = 0;
+
+      unpacked.clear();
+      while (reader != NULL &&
+             (nread = SnapDiffReaderRead(reader, buf, sizeof buf)) > 0) {
+         unpacked.append(buf, nread);
+      }
+      if (reader == NULL || nread < 0 ||
+          !ReadOutput(plainDir + "/parallel_diff/" + to_string(level), plain) ||
+          plain != unpacked) {
+         cout << "   level " << level << " of serialized_diff" COMPRESSED_SUFFIX
+              << " differs" << endl;
+         same = false;
+      }
+      if (reader != NULL) {
+         SnapDiffReaderClose(reader);
+      }
+      ++numLevels;
+   }
+   if (numLevels == 0) {
+      cout << "   serialized_diff" COMPRESSED_SUFFIX ".levels is empty" << endl;
+      same = false;
+   }
+
+   cout << "compressed round trip: " << (same ? "ok" : "FAILED") << ", "
+        << numFiles + 1 << " files, " << numLevels << " levels" << endl;
+}
+
+int main(int argc, char** argv)
+{
+   SnapDiffGenOptions genOpts;
+   SnapDiffGen gen;
+   char tmpDir[] = "/tmp/stage-bench.XXXXXX";
+   ofstream logFile;
+
+   if (argc > 1) {
+      genOpts.pages = strtoul(argv[1], NULL, 10);
+   }
+   if (argc > 2) {
+      genOpts.entriesPerPage = strtoul(argv[2], NULL, 10);
+   }
+   if (genOpts.pages == 0 || genOpts.entriesPerPage == 0 || mkdtemp(tmpDir) == NULL) {
+      cerr << "Usage : " << argv[0] << " [pages] [entries per page]" << endl;
+      return 1;
+   }
+
+   string root = tmpDir;
+   string snapDir = root + "/.snap/diff";
+   string rawDir = root + "/raw";
+
+   GenerateSnapDiff(genOpts, gen);
+   if (!SnapDiffGenMkDirs(snapDir) || !WriteSnapDiffTree(gen, root) ||
+       MkDir(rawDir) != 0) {
+      cerr << "Could not create the snapshot tree in " << root << endl;
+      return 1;
+   }
+   logFile.open(root + "/bench.log");
+   snapDiffOpen = OpenStandin;
+
+   cout << gen.pages.size() << " pages, " << gen.numEntries << " entries, "
+        << gen.numBytes << " bytes" << endl;
+
+   SnapDiffStandinOptions standinOpts;
+
+   RunRead("read, local", gen, snapDir, standinOpts, 0, DEFAULT_READ_BLOCK_SIZE,
+           logFile);
+   standinOpts.openLatencyUs = 2000;
+   standinOpts.readLatencyUs = 200;
+   RunRead("read, 2ms open latency", gen, snapDir, standinOpts, 0,
+           DEFAULT_READ_BLOCK_SIZE, logFile);
+   RunRead("read, 2ms open latency, prefetch 4", gen, snapDir, standinOpts, 4,
+           DEFAULT_READ_BLOCK_SIZE, logFile);
+   standinOpts.reportSize = false;
+   RunRead("read, 2ms open latency, no page size, 16 KiB blocks", gen, snapDir,
+           standinOpts, 0, MIN_READ_BLOCK_SIZE, logFile);
+   RunRead("read, 2ms open latency, no page size, adaptive blocks", gen, snapDir,
+           standinOpts, 0, DEFAULT_READ_BLOCK_SIZE, logFile);
+   standinOpts = SnapDiffStandinOptions();
+   standinOpts.enoentOpens = 2;
+   standinOpts.badReadEvery = 8;
+   RunRead("read, ENOENT twice, every 8th read bad", gen, snapDir, standinOpts,
+           0, DEFAULT_READ_BLOCK_SIZE, logFile);
+   standinOpts = SnapDiffStandinOptions();
+   standinOpts.maxReadSize = 64 << 10;
+   RunRead("read, reads over 64 KiB fail", gen, snapDir, standinOpts, 0,
+           DEFAULT_READ_BLOCK_SIZE, logFile);
+
+   // Pages for the later stages
+   SnapDiffStandin rawStandin{gen, SnapDiffStandinOptions()};
+
+   standin = &rawStandin;
+   if (ReadRawDiff(snapDir, "s1", "s2", rawDir, false, 0, DEFAULT_READ_BLOCK_SIZE,
+                   nullptr, nullptr, nullptr, logFile) != (int)gen.pages.size()) {
+      cerr << "Could not save the raw pages in " << rawDir << endl;
+      return 1;
+   }
+
+   RunBucketize("1 thread", gen, rawDir, root + "/run1", 1, logFile);
+   RunBucketize("4 threads", gen, rawDir, root + "/run4", 4, logFile);
+
+   RunJson("inline", gen, snapDir, root + "/run1", 1, 0, logFile);
+   RunJson("4 threads, 16 stat threads", gen, snapDir, root + "/run1", 4, 16,
+           logFile);
+
+   if (compressionSupported) {
+      RunCompress(gen, snapDir, root + "/compress", logFile);
+   }
+
+   logFile.close();
+   nftw(tmpDir, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+   return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Compares the istringstream based raw diff line parsing BucketizeDiff used
+ * to do with the diff_tokenizer.h one, and the op string matching the
+ * stages used to do with the diff_entry.h op table, in lines/sec.
+ *
+ * Usage : tokenizer-bench [lines]
+ */
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+
+#include "../diff_entry.h"
+#include "../diff_tokenizer.h"
+
+using namespace std;
+
+static string
+MakePage(size_t numLines)
+{
+   static const char *ops[] = { "FILE_CMS", "FILE_MS", "DIR_C", "DIR_DELETE",
+                                "SYM_CS", "FILE_RENAME" };
+   ostringstream page;
+
+   for (size_t i = 0; i < numLines; ++i) {
+      const char *op = ops[i % 6];
+      page << (int)(i % 5) - 1 << ' ' << 1000 + i << ' ' << op
+           << " dir" << i % 97 << "/subdir" << i % 13 << "/file" << i;
+      if (i % 6 == 4 || i % 6 == 5) {
+         page << ' ' << "dir" << i % 89 << "/target" << i;
+      }
+      page << '\n';
+   }
+   return page.str();
+}
+
+static size_t
+ParseIstream(const string& page)
+{
+   istringstream pageStream{page};
+   string diffLine;
+   size_t checksum = 0;
+
+   while (getline(pageStream, diffLine, '\n')) {
+      istringstream lineStream{diffLine};
+      ostringstream outputLine;
+      string s;
+
+      lineStream >> s;
+      int level = stoi(s) + 513;
+      lineStream >> s;
+      lineStream >> s;
+      outputLine << s;
+      while (lineStream >> s) {
+         outputLine << "\t" << s;
+      }
+      checksum += level + outputLine.str().size();
+   }
+   return checksum;
+}
+
+static size_t
+ParseTokenizer(const string& page)
+{
+   const char *pos = page.data();
+   const char *end = pos + page.size();
+   DiffToken diffLine;
+   string joined;
+   size_t checksum = 0;
+
+   while (NextDiffLine(pos, end, diffLine)) {
+      RawDiffLine fields;
+      long long level = 0;
+
+      SplitRawDiffLine(diffLine, fields);
+      // Lines without a valid level are skipped
+      if (fields.numTokens == 0 || !ParseDiffInt(fields.level, level) ||
+          level < INT_MIN || level > INT_MAX - 513) {
+         continue;
+      }
+      level += 513;
+      if (fields.entryIsTabJoined) {
+         checksum += level + fields.entry.len;
+      } else {
+         joined.clear();
+         AppendTabJoined(fields.entry, joined);
+         checksum += level + joined.size();
+      }
+   }
+   return checksum;
+}
+
+// Entry type and op flags by comparing the parts of the op string
+static size_t
+ClassifyStrings(const string& page)
+{
+   const char *pos = page.data();
+   const char *end = pos + page.size();
+   DiffToken diffLine;
+   size_t checksum = 0;
+
+   while (NextDiffLine(pos, end, diffLine)) {
+      RawDiffLine fields;
+
+      SplitRawDiffLine(diffLine, fields);
+
+      const DiffToken& op = fields.op;
+      const char *split = static_cast<const char *>(memchr(op.data, '_', op.len));
+      DiffToken entrytype{op.data, split ? size_t(split - op.data) : op.len};
+      DiffToken optype{split ? split + 1 : op.End(),
+                       split ? size_t(op.End() - split - 1) : 0};
+      unsigned type = entrytype == "FILE" ? 1 : entrytype == "DIR" ? 2 :
+                      entrytype == "SYM" ? 3 : 0;
+      unsigned ops = 0;
+
+      if (optype == "DELETE") {
+         ops = DIFF_OP_DELETE;
+      } else if (optype == "RENAME") {
+         ops = DIFF_OP_RENAME;
+      } else {
+         const char letters[] = { 'C', 'M', 'S', 'X' };
+
+         for (int bit = 0; bit < 4; ++bit) {
+            if (memchr(optype.data, letters[bit], optype.len) != nullptr) {
+               ops |= 1 << bit;
+            }
+         }
+      }
+      checksum += type * 64 + ops;
+   }
+   return checksum;
+}
+
+// Entry type and op bits from the diff_entry.h op table
+static size_t
+ClassifyTable(const string& page)
+{
+   const char *pos = page.data();
+   const char *end = pos + page.size();
+   DiffToken diffLine;
+   size_t checksum = 0;
+
+   while (NextDiffLine(pos, end, diffLine)) {
+      RawDiffLine fields;
+
+      SplitRawDiffLine(diffLine, fields);
+
+      DiffOp op = ParseDiffOp(fields.op);
+
+      checksum += op.type * 64 + op.ops;
+   }
+   return checksum;
+}
+
+template <class F>
+static void
+Run(const char *name, const string& page, size_t numLines, F parse)
+{
+   auto start = chrono::steady_clock::now();
+   size_t checksum = parse(page);
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+   cout << name << ": " << (size_t)(numLines / elapsed.count()) << " lines/sec"
+        << " (checksum " << checksum << ")" << endl;
+}
+
+int main(int argc, char** argv)
+{
+   size_t numLines = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+   string page = MakePage(numLines);
+
+   Run("istringstream", page, numLines, ParseIstream);
+   Run("tokenizer    ", page, numLines, ParseTokenizer);
+   Run("op strings   ", page, numLines, ClassifyStrings);
+   Run("op table     ", page, numLines, ClassifyTable);
+   return 0;
+}
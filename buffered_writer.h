@@ -0,0 +1,274 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __BUFFERED_WRITER_H__
+#define __BUFFERED_WRITER_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif /* _WIN32 */
+
+#include "compressed_file.h"
+
+#define WRITER_BUFSIZE        (1<<20)
+#define WRITER_SMALL_BUFSIZE  (64<<10)
+
+/*
+ * Output file stream with a large user space buffer. Data reaches the file
+ * only when the buffer fills up or on an explicit Flush() or Close():
+ * std::endl and flush() on the stream merely end the line, so per line
+ * flushes cost no syscall. Callers flush at stage boundaries and on error.
+ * Opened with OpenCompressed() the data is compressed on its way out, see
+ * compressed_file.h, and EndFrame() ends a frame.
+ */
+class BufferedWriter : public std::ostream {
+public:
+   explicit BufferedWriter(size_t bufSize = WRITER_BUFSIZE)
+      : std::ostream(nullptr),
+        buf_(bufSize)
+   {
+      rdbuf(&buf_);
+      setstate(std::ios::badbit);
+   }
+
+   ~BufferedWriter() {
+      Close();
+   }
+
+   bool Open(const std::string& fileName, bool append = false) {
+      return OpenFile(fileName, append, false, false);
+   }
+
+   // Opens for binary data, which Windows must not translate newlines in
+   bool OpenBinary(const std::string& fileName) {
+      return OpenFile(fileName, false, true, false);
+   }
+
+   // Opens for compressed data, appending starts a new frame
+   bool OpenCompressed(const std::string& fileName, bool append = false) {
+      return OpenFile(fileName, append, true, true);
+   }
+
+   bool IsOpen() const {
+      return buf_.IsOpen();
+   }
+
+   bool Flush() {
+      if (!buf_.FlushBuffer()) {
+         setstate(std::ios::badbit);
+         return false;
+      }
+      return good();
+   }
+
+   /*
+    * Writes out the data so far as a complete frame of a compressed file,
+    * the same as Flush() otherwise.
+    */
+   bool EndFrame() {
+      if (!buf_.FlushBuffer(true)) {
+         setstate(std::ios::badbit);
+         return false;
+      }
+      return good();
+   }
+
+   // Bytes written to the file since it was opened
+   unsigned long long Offset() const {
+      return buf_.Offset();
+   }
+
+   bool Close() {
+      if (!IsOpen()) {
+         return true;
+      }
+      bool ok = EndFrame();
+      ok = buf_.Close() && ok;
+      setstate(std::ios::badbit);
+      return ok;
+   }
+
+private:
+   bool OpenFile(const std::string& fileName, bool append, bool binary,
+                 bool compress) {
+      Close();
+      if (!buf_.Open(fileName, append, binary, compress)) {
+         return false;
+      }
+      clear();
+      return true;
+   }
+
+   class FileBuf : public std::streambuf {
+   public:
+      explicit FileBuf(size_t bufSize)
+         : fd_(-1),
+           bufSize_(bufSize),
+           offset_(0),
+           emptyFrame_(false)
+      {}
+
+      ~FileBuf() {
+         Close();
+      }
+
+      bool Open(const std::string& fileName, bool append, bool binary,
+                bool compress) {
+#ifdef _WIN32
+         // Text mode unless binary, matching the ofstream output this replaces
+         fd_ = ::_open(fileName.c_str(),
+                       _O_WRONLY | _O_CREAT | (binary ? _O_BINARY : _O_TEXT) |
+                       (append ? _O_APPEND : _O_TRUNC),
+                       _S_IREAD | _S_IWRITE);
+#else
+         (void)binary;
+         fd_ = ::open(fileName.c_str(),
+                      O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+#endif /* _WIN32 */
+         if (fd_ < 0) {
+            return false;
+         }
+         buf_.resize(bufSize_);
+         setp(&buf_[0], &buf_[0] + buf_.size());
+         offset_ = 0;
+         emptyFrame_ = compress && !append;
+         if (compress) {
+            compressor_.reset(new FrameCompressor());
+         }
+         return true;
+      }
+
+      unsigned long long Offset() const {
+         return offset_;
+      }
+
+      bool IsOpen() const {
+         return fd_ >= 0;
+      }
+
+      bool Close() {
+         if (fd_ < 0) {
+            return true;
+         }
+         bool ok = true;
+
+         // A new compressed file holds at least one frame, even if empty
+         if (emptyFrame_ && offset_ == 0) {
+            packed_.clear();
+            ok = compressor_->EmptyFrame(packed_) &&
+                 WriteAll(packed_.data(), packed_.size());
+         }
+#ifdef _WIN32
+         ok = ::_close(fd_) == 0 && ok;
+#else
+         ok = ::close(fd_) == 0 && ok;
+#endif /* _WIN32 */
+         fd_ = -1;
+         setp(nullptr, nullptr);
+         std::vector<char>().swap(buf_);
+         compressor_.reset();
+         std::string().swap(packed_);
+         return ok;
+      }
+
+      bool FlushBuffer(bool endFrame = false) {
+         if (fd_ < 0) {
+            return false;
+         }
+         bool ok = Write(pbase(), pptr() - pbase(), endFrame);
+         setp(&buf_[0], &buf_[0] + buf_.size());
+         return ok;
+      }
+
+   protected:
+      int_type overflow(int_type c) override {
+         if (!FlushBuffer()) {
+            return traits_type::eof();
+         }
+         if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+         }
+         return traits_type::not_eof(c);
+      }
+
+      std::streamsize xsputn(const char *s, std::streamsize n) override {
+         if (n <= epptr() - pptr()) {
+            traits_type::copy(pptr(), s, n);
+            pbump(static_cast<int>(n));
+            return n;
+         }
+         // Larger than the space left: write out what is buffered and
+         // pass big blocks straight through
+         if (!FlushBuffer()) {
+            return 0;
+         }
+         if (static_cast<size_t>(n) >= buf_.size()) {
+            return Write(s, n, false) ? n : 0;
+         }
+         traits_type::copy(pptr(), s, n);
+         pbump(static_cast<int>(n));
+         return n;
+      }
+
+      int sync() override {
+         // Deliberately deferred, see BufferedWriter
+         return 0;
+      }
+
+   private:
+      bool Write(const char *data, size_t len, bool endFrame) {
+         if (!compressor_) {
+            return WriteAll(data, len);
+         }
+         packed_.clear();
+         return compressor_->Compress(data, len, endFrame, packed_) &&
+                WriteAll(packed_.data(), packed_.size());
+      }
+
+      bool WriteAll(const char *data, size_t len) {
+         while (len > 0) {
+#ifdef _WIN32
+            int written = ::_write(fd_, data, static_cast<unsigned>(len));
+#else
+            ssize_t written = ::write(fd_, data, len);
+#endif /* _WIN32 */
+            if (written < 0) {
+               if (errno == EINTR) {
+                  continue;
+               }
+               return false;
+            }
+            data += written;
+            len -= written;
+            offset_ += written;
+         }
+         return true;
+      }
+
+      int                              fd_;
+      size_t                           bufSize_;
+      unsigned long long               offset_;
+      bool                             emptyFrame_;
+      std::vector<char>                buf_;
+      std::unique_ptr<FrameCompressor> compressor_;
+      std::string                      packed_;
+   };
+
+   FileBuf buf_;
+};
+
+#endif /* __BUFFERED_WRITER_H__ */
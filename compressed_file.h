@@ -0,0 +1,372 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __COMPRESSED_FILE_H__
+#define __COMPRESSED_FILE_H__
+
+/*
+ * Frame compression of the outputs, with the codec chosen at build time:
+ * make COMPRESS=zstd defines SNAPDIFF_COMPRESS_ZSTD, COMPRESS=zlib
+ * SNAPDIFF_COMPRESS_ZLIB. A compressed file is a sequence of independent
+ * frames (zstd frames, gzip members), so frames can be decompressed on
+ * their own and files written in several parts can simply be appended to.
+ * Without a codec the outputs can only be written uncompressed.
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif /* _WIN32 */
+
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+#include <zstd.h>
+#define COMPRESSED_SUFFIX ".zst"
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+#include <zlib.h>
+#define COMPRESSED_SUFFIX ".gz"
+#else
+#define COMPRESSED_SUFFIX ""
+#endif
+
+#define COMPRESS_BUFSIZE (64<<10)
+
+#if defined(SNAPDIFF_COMPRESS_ZSTD) || defined(SNAPDIFF_COMPRESS_ZLIB)
+static const bool compressionSupported = true;
+#else
+static const bool compressionSupported = false;
+#endif
+
+/*
+ * Streaming compressor. A frame starts with the first data compressed
+ * after the previous one ended.
+ */
+class FrameCompressor {
+public:
+   FrameCompressor()
+      : inFrame_(false)
+   {
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+      cctx_ = ZSTD_createCCtx();
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+      memset(&z_, 0, sizeof z_);
+#endif
+   }
+
+   ~FrameCompressor() {
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+      ZSTD_freeCCtx(cctx_);
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+      if (inFrame_) {
+         deflateEnd(&z_);
+      }
+#endif
+   }
+
+   /*
+    * Appends the compressed form of data to out, with endFrame also the
+    * end of the frame. Returns false on error.
+    */
+   bool Compress(const char *data, size_t len, bool endFrame, std::string& out) {
+      if (len == 0 && !inFrame_) {
+         return true;
+      }
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+      ZSTD_inBuffer in = {data, len, 0};
+      size_t remaining;
+
+      inFrame_ = true;
+      do {
+         size_t used = out.size();
+
+         out.resize(used + COMPRESS_BUFSIZE);
+         ZSTD_outBuffer dst = {&out[used], COMPRESS_BUFSIZE, 0};
+         remaining = ZSTD_compressStream2(cctx_, &dst, &in,
+                                          endFrame ? ZSTD_e_end : ZSTD_e_continue);
+         out.resize(used + dst.pos);
+         if (ZSTD_isError(remaining)) {
+            return false;
+         }
+      } while (in.pos < in.size || (endFrame && remaining > 0));
+      inFrame_ = !endFrame;
+      return true;
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+      if (!inFrame_) {
+         // windowBits 15 + 16 writes a gzip member
+         if (deflateInit2(&z_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                          Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+         }
+         inFrame_ = true;
+      }
+
+      int rc;
+
+      z_.next_in = (Bytef *)data;
+      z_.avail_in = (uInt)len;
+      do {
+         size_t used = out.size();
+
+         out.resize(used + COMPRESS_BUFSIZE);
+         z_.next_out = (Bytef *)&out[used];
+         z_.avail_out = COMPRESS_BUFSIZE;
+         rc = deflate(&z_, endFrame ? Z_FINISH : Z_NO_FLUSH);
+         out.resize(used + COMPRESS_BUFSIZE - z_.avail_out);
+         if (rc == Z_STREAM_ERROR) {
+            return false;
+         }
+      } while (z_.avail_out == 0 || z_.avail_in > 0);
+
+      if (endFrame) {
+         deflateEnd(&z_);
+         inFrame_ = false;
+         return rc == Z_STREAM_END;
+      }
+      return true;
+#else
+      (void)data;
+      (void)endFrame;
+      (void)out;
+      return false;
+#endif
+   }
+
+   // Appends a frame without data, the compressed form of an empty file
+   bool EmptyFrame(std::string& out) {
+      if (inFrame_) {
+         return Compress(NULL, 0, true, out);
+      }
+      inFrame_ = true;
+#if defined(SNAPDIFF_COMPRESS_ZLIB)
+      if (deflateInit2(&z_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK) {
+         inFrame_ = false;
+         return false;
+      }
+#endif
+      return Compress(NULL, 0, true, out);
+   }
+
+private:
+   bool inFrame_;
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+   ZSTD_CCtx *cctx_;
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+   z_stream   z_;
+#endif
+};
+
+/*
+ * Streaming decompressor of a sequence of frames
+ */
+class FrameDecompressor {
+public:
+   FrameDecompressor()
+      : inFrame_(false)
+   {
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+      dctx_ = ZSTD_createDCtx();
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+      memset(&z_, 0, sizeof z_);
+      initialized_ = inflateInit2(&z_, 15 + 16) == Z_OK;
+#endif
+   }
+
+   ~FrameDecompressor() {
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+      ZSTD_freeDCtx(dctx_);
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+      if (initialized_) {
+         inflateEnd(&z_);
+      }
+#endif
+   }
+
+   // Appends the data decompressed from in to out. Returns false on error.
+   bool Decompress(const char *data, size_t len, std::string& out) {
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+      ZSTD_inBuffer in = {data, len, 0};
+      bool full;
+
+      do {
+         size_t used = out.size();
+
+         out.resize(used + COMPRESS_BUFSIZE);
+         ZSTD_outBuffer dst = {&out[used], COMPRESS_BUFSIZE, 0};
+         size_t rc = ZSTD_decompressStream(dctx_, &dst, &in);
+
+         out.resize(used + dst.pos);
+         if (ZSTD_isError(rc)) {
+            return false;
+         }
+         // 0 once a frame is complete and flushed
+         inFrame_ = rc != 0;
+         // A full buffer may leave output behind
+         full = dst.pos == dst.size;
+      } while (in.pos < in.size || full);
+      return true;
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+      if (!initialized_) {
+         return false;
+      }
+      bool full;
+
+      z_.next_in = (Bytef *)data;
+      z_.avail_in = (uInt)len;
+      do {
+         size_t used = out.size();
+         int rc;
+
+         out.resize(used + COMPRESS_BUFSIZE);
+         z_.next_out = (Bytef *)&out[used];
+         z_.avail_out = COMPRESS_BUFSIZE;
+         rc = inflate(&z_, Z_NO_FLUSH);
+         out.resize(used + COMPRESS_BUFSIZE - z_.avail_out);
+         full = z_.avail_out == 0;
+         if (rc == Z_STREAM_END) {
+            // The next gzip member, if any, follows
+            inflateReset(&z_);
+            inFrame_ = false;
+         } else if (rc == Z_OK) {
+            inFrame_ = true;
+         } else if (rc != Z_BUF_ERROR) {
+            return false;
+         }
+      } while (z_.avail_in > 0 || full);
+      return true;
+#else
+      (void)data;
+      (void)len;
+      (void)out;
+      return false;
+#endif
+   }
+
+   // Whether the data so far ended with a complete frame
+   bool Complete() const {
+      return !inFrame_;
+   }
+
+private:
+   bool inFrame_;
+#if defined(SNAPDIFF_COMPRESS_ZSTD)
+   ZSTD_DCtx *dctx_;
+#elif defined(SNAPDIFF_COMPRESS_ZLIB)
+   bool       initialized_;
+   z_stream   z_;
+#endif
+};
+
+/*
+ * Input file stream decompressing a compressed output file. Read errors
+ * and corrupt or truncated data set badbit. Up to limit bytes of the file
+ * are read from offset on, the whole file by default.
+ */
+class CompressedReader : public std::istream {
+public:
+   explicit CompressedReader(const std::string& fileName,
+                             unsigned long long offset = 0,
+                             unsigned long long limit = ~0ULL)
+      : std::istream(nullptr),
+        buf_(this, limit)
+   {
+      rdbuf(&buf_);
+      if (!buf_.Open(fileName, offset)) {
+         setstate(std::ios::failbit);
+      }
+   }
+
+   bool is_open() const {
+      return buf_.IsOpen();
+   }
+
+private:
+   class DecompressBuf : public std::streambuf {
+   public:
+      DecompressBuf(std::istream *stream, unsigned long long limit)
+         : stream_(stream),
+           fd_(-1),
+           limit_(limit)
+      {}
+
+      ~DecompressBuf() {
+         if (fd_ >= 0) {
+#ifdef _WIN32
+            ::_close(fd_);
+#else
+            ::close(fd_);
+#endif /* _WIN32 */
+         }
+      }
+
+      bool Open(const std::string& fileName, unsigned long long offset) {
+#ifdef _WIN32
+         fd_ = ::_open(fileName.c_str(), _O_RDONLY | _O_BINARY);
+         return fd_ >= 0 &&
+                ::_lseeki64(fd_, (long long)offset, SEEK_SET) == (long long)offset;
+#else
+         fd_ = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+         return fd_ >= 0 && ::lseek(fd_, (off_t)offset, SEEK_SET) == (off_t)offset;
+#endif /* _WIN32 */
+      }
+
+      bool IsOpen() const {
+         return fd_ >= 0;
+      }
+
+   protected:
+      int_type underflow() override {
+         std::vector<char> packed(COMPRESS_BUFSIZE);
+
+         out_.clear();
+         while (out_.empty()) {
+            size_t want = (size_t)std::min<unsigned long long>(packed.size(), limit_);
+#ifdef _WIN32
+            long long nread = want > 0 ? ::_read(fd_, packed.data(), (unsigned)want) : 0;
+#else
+            long long nread = want > 0 ? ::read(fd_, packed.data(), want) : 0;
+#endif /* _WIN32 */
+
+            if (nread < 0 && errno == EINTR) {
+               continue;
+            }
+            if (nread <= 0) {
+               if (nread < 0 || !decompressor_.Complete()) {
+                  stream_->setstate(std::ios::badbit);
+               }
+               return traits_type::eof();
+            }
+            limit_ -= nread;
+            if (!decompressor_.Decompress(packed.data(), nread, out_)) {
+               stream_->setstate(std::ios::badbit);
+               return traits_type::eof();
+            }
+         }
+         setg(&out_[0], &out_[0], &out_[0] + out_.size());
+         return traits_type::to_int_type(out_[0]);
+      }
+
+   private:
+      std::istream      *stream_;
+      int                fd_;
+      unsigned long long limit_;
+      FrameDecompressor  decompressor_;
+      std::string        out_;
+   };
+
+   DecompressBuf buf_;
+};
+
+#endif /* __COMPRESSED_FILE_H__ */
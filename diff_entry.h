@@ -0,0 +1,246 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __DIFF_ENTRY_H__
+#define __DIFF_ENTRY_H__
+
+#include <string.h>
+
+#include "diff_tokenizer.h"
+
+/*
+ * Typed diff entries. The op token of an entry, such as FILE_CMS, maps to
+ * an entry type (FILE) and a bitmask of op bits (C, M and S), so that the
+ * stages test integers instead of searching the op string. The values
+ * match the SNAPDIFF_ENTRY_* and SNAPDIFF_FLAG_* ones of snapshot_diff.h.
+ */
+#define DIFF_TYPE_OTHER      0
+#define DIFF_TYPE_FILE       1
+#define DIFF_TYPE_DIR        2
+#define DIFF_TYPE_SYM        3
+
+#define DIFF_OP_CREATED      0x01   /* C */
+#define DIFF_OP_MODIFIED     0x02   /* M */
+#define DIFF_OP_STAT         0x04   /* S */
+#define DIFF_OP_XATTR        0x08   /* X */
+#define DIFF_OP_CHANGE_MASK  0x0f
+#define DIFF_OP_DELETE       0x10
+#define DIFF_OP_RENAME       0x20
+
+struct DiffOp {
+   unsigned char type = DIFF_TYPE_OTHER;
+   unsigned char ops = 0;
+};
+
+/*
+ * One diff entry, "op path [extra]" as in a serialized diff line, with the
+ * level of its bucket. The tokens point into line, or for a raw line that
+ * was not tab joined into the raw line, which must outlive the entry.
+ * numTokens counts all tokens of the entry, including any beyond extra.
+ */
+struct DiffEntry {
+   int       level = 0;
+   DiffToken line;
+   DiffToken op;
+   DiffToken path;
+   DiffToken extra;
+   int       numTokens = 0;
+   DiffOp    kind;
+
+   bool IsDir() const { return kind.type == DIFF_TYPE_DIR; }
+   bool IsSym() const { return kind.type == DIFF_TYPE_SYM; }
+   bool IsDelete() const { return (kind.ops & DIFF_OP_DELETE) != 0; }
+   bool IsRename() const { return (kind.ops & DIFF_OP_RENAME) != 0; }
+   bool Has(unsigned ops) const { return (kind.ops & ops) != 0; }
+   // A rename with both of its paths
+   bool HasTwoPaths() const { return IsRename() && numTokens > 2; }
+};
+
+/*
+ * Open addressed hash table of the op tokens VDFS writes, FILE, DIR and
+ * SYM each with _DELETE, _RENAME and every combination of C, M, S and X in
+ * that order, built at compile time.
+ */
+#define DIFF_OP_TABLE_SIZE   256    /* power of two, well above the 51 ops */
+#define DIFF_OP_MAX_LEN      12
+
+struct DiffOpSlot {
+   char          name[DIFF_OP_MAX_LEN];
+   unsigned char len;
+   DiffOp        op;
+};
+
+struct DiffOpTable {
+   DiffOpSlot slots[DIFF_OP_TABLE_SIZE];
+};
+
+// FNV-1a
+static constexpr unsigned
+DiffOpHash(const char *data, size_t len)
+{
+   unsigned hash = 2166136261u;
+
+   for (size_t i = 0; i < len; ++i) {
+      hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+   }
+   return hash;
+}
+
+static constexpr void
+AddDiffOp(DiffOpTable& table, const char *type, unsigned char typeCode,
+          const char *suffix, unsigned char ops)
+{
+   char name[DIFF_OP_MAX_LEN] = {};
+   size_t len = 0;
+
+   for (const char *c = type; *c != '\0'; ++c) {
+      name[len++] = *c;
+   }
+   name[len++] = '_';
+   for (const char *c = suffix; *c != '\0'; ++c) {
+      name[len++] = *c;
+   }
+
+   size_t slot = DiffOpHash(name, len) & (DIFF_OP_TABLE_SIZE - 1);
+
+   while (table.slots[slot].len != 0) {
+      slot = (slot + 1) & (DIFF_OP_TABLE_SIZE - 1);
+   }
+   for (size_t i = 0; i < len; ++i) {
+      table.slots[slot].name[i] = name[i];
+   }
+   table.slots[slot].len = (unsigned char)len;
+   table.slots[slot].op.type = typeCode;
+   table.slots[slot].op.ops = ops;
+}
+
+static constexpr DiffOpTable
+MakeDiffOpTable()
+{
+   DiffOpTable table{};
+   const char *types[] = { "FILE", "DIR", "SYM" };
+   const char letters[] = { 'C', 'M', 'S', 'X' };
+
+   for (unsigned char t = 0; t < 3; ++t) {
+      AddDiffOp(table, types[t], DIFF_TYPE_FILE + t, "DELETE", DIFF_OP_DELETE);
+      AddDiffOp(table, types[t], DIFF_TYPE_FILE + t, "RENAME", DIFF_OP_RENAME);
+      for (unsigned char ops = 1; ops <= DIFF_OP_CHANGE_MASK; ++ops) {
+         char suffix[5] = {};
+         size_t len = 0;
+
+         for (int bit = 0; bit < 4; ++bit) {
+            if (ops & (1 << bit)) {
+               suffix[len++] = letters[bit];
+            }
+         }
+         AddDiffOp(table, types[t], DIFF_TYPE_FILE + t, suffix, ops);
+      }
+   }
+   return table;
+}
+
+static constexpr DiffOpTable diffOpTable = MakeDiffOpTable();
+
+/*
+ * Maps an op token that is not in diffOpTable the way the op strings used
+ * to be interpreted: the entry type before the first '_', DELETE, RENAME
+ * or else any of the C, M, S and X letters after it.
+ */
+static inline DiffOp
+ParseUnlistedDiffOp(const DiffToken& token)
+{
+   const char *split = static_cast<const char *>(memchr(token.data, '_', token.len));
+   DiffToken entrytype{token.data, split ? size_t(split - token.data) : token.len};
+   DiffToken optype{split ? split + 1 : token.End(),
+                    split ? size_t(token.End() - split - 1) : 0};
+   DiffOp op;
+
+   op.type = entrytype == "FILE" ? DIFF_TYPE_FILE :
+             entrytype == "DIR" ? DIFF_TYPE_DIR :
+             entrytype == "SYM" ? DIFF_TYPE_SYM : DIFF_TYPE_OTHER;
+   if (optype == "DELETE") {
+      op.ops = DIFF_OP_DELETE;
+   } else if (optype == "RENAME") {
+      op.ops = DIFF_OP_RENAME;
+   } else {
+      const char letters[] = { 'C', 'M', 'S', 'X' };
+
+      for (int bit = 0; bit < 4; ++bit) {
+         if (optype.len > 0 && memchr(optype.data, letters[bit], optype.len) != nullptr) {
+            op.ops |= 1 << bit;
+         }
+      }
+   }
+   return op;
+}
+
+/*
+ * Maps an op token to its entry type and op bits, in one table probe for
+ * the ops VDFS writes.
+ */
+static inline DiffOp
+ParseDiffOp(const DiffToken& token)
+{
+   if (token.len < DIFF_OP_MAX_LEN) {
+      size_t slot = DiffOpHash(token.data, token.len) & (DIFF_OP_TABLE_SIZE - 1);
+
+      for (; diffOpTable.slots[slot].len != 0; slot = (slot + 1) & (DIFF_OP_TABLE_SIZE - 1)) {
+         const DiffOpSlot& entry = diffOpTable.slots[slot];
+
+         if (entry.len == token.len && memcmp(entry.name, token.data, token.len) == 0) {
+            return entry.op;
+         }
+      }
+   }
+   return ParseUnlistedDiffOp(token);
+}
+
+/*
+ * Splits a serialized diff line, or the tab joined entry of a raw line,
+ * into entry and maps its op.
+ */
+static inline void
+ParseDiffEntry(const DiffToken& line, int level, DiffEntry& entry)
+{
+   DiffToken *named[] = { &entry.op, &entry.path, &entry.extra };
+   const char *pos = line.data;
+   const char *end = line.End();
+   DiffToken token;
+
+   entry = DiffEntry();
+   entry.level = level;
+   entry.line = line;
+   while (NextDiffToken(pos, end, token)) {
+      if (entry.numTokens < 3) {
+         *named[entry.numTokens] = token;
+      }
+      ++entry.numTokens;
+   }
+   if (entry.numTokens > 0) {
+      entry.kind = ParseDiffOp(entry.op);
+   }
+}
+
+/*
+ * Fills entry from the fields of a raw snapdiff line, line being its tab
+ * joined entry. The tokens stay those of the raw line.
+ */
+static inline void
+RawDiffEntry(const RawDiffLine& fields, int level, const DiffToken& line,
+             DiffEntry& entry)
+{
+   entry = DiffEntry();
+   entry.level = level;
+   entry.line = line;
+   entry.op = fields.op;
+   entry.path = fields.path;
+   entry.extra = fields.extra;
+   entry.numTokens = fields.numTokens > 2 ? fields.numTokens - 2 : 0;
+   if (entry.numTokens > 0) {
+      entry.kind = ParseDiffOp(entry.op);
+   }
+}
+
+#endif /* __DIFF_ENTRY_H__ */
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __DIFF_TOKENIZER_H__
+#define __DIFF_TOKENIZER_H__
+
+#include <limits.h>
+#include <string.h>
+#include <string>
+
+/*
+ * Non-owning reference to a token inside a diff buffer. The buffer must
+ * outlive the token.
+ */
+struct DiffToken {
+   const char *data = nullptr;
+   size_t      len = 0;
+
+   bool Empty() const { return len == 0; }
+   const char *End() const { return data + len; }
+   std::string Str() const { return std::string(data, len); }
+
+   bool operator==(const char *str) const {
+      return strlen(str) == len && memcmp(data, str, len) == 0;
+   }
+   bool operator!=(const char *str) const { return !(*this == str); }
+};
+
+/*
+ * Whitespace as seen by operator>>, which the diff files used to be
+ * tokenized with.
+ */
+static inline bool
+IsDiffSpace(char c)
+{
+   return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+          c == '\r';
+}
+
+/*
+ * Returns the next line of [pos, end) without its '\n' and advances pos
+ * past it. The last line does not need to be terminated.
+ */
+static inline bool
+NextDiffLine(const char *&pos, const char *end, DiffToken& line)
+{
+   if (pos >= end) {
+      return false;
+   }
+
+   const char *eol = static_cast<const char *>(memchr(pos, '\n', end - pos));
+
+   line.data = pos;
+   if (eol == nullptr) {
+      line.len = end - pos;
+      pos = end;
+   } else {
+      line.len = eol - pos;
+      pos = eol + 1;
+   }
+   return true;
+}
+
+/*
+ * Returns the next whitespace separated token of [pos, end) and advances
+ * pos past it.
+ */
+static inline bool
+NextDiffToken(const char *&pos, const char *end, DiffToken& token)
+{
+   while (pos < end && IsDiffSpace(*pos)) {
+      ++pos;
+   }
+   if (pos == end) {
+      return false;
+   }
+
+   token.data = pos;
+   while (pos < end && !IsDiffSpace(*pos)) {
+      ++pos;
+   }
+   token.len = pos - token.data;
+   return true;
+}
+
+/*
+ * Parses a decimal integer with optional sign, the whole token has to be
+ * numeric and its value within +-LLONG_MAX.
+ */
+static inline bool
+ParseDiffInt(const DiffToken& token, long long& val)
+{
+   const char *pos = token.data;
+   const char *end = token.End();
+   bool negative = false;
+
+   if (pos < end && (*pos == '-' || *pos == '+')) {
+      negative = *pos++ == '-';
+   }
+   if (pos == end) {
+      return false;
+   }
+
+   long long result = 0;
+   for (; pos < end; ++pos) {
+      unsigned digit = static_cast<unsigned char>(*pos) - '0';
+      if (digit > 9 || result > (LLONG_MAX - digit) / 10) {
+         return false;
+      }
+      result = result * 10 + digit;
+   }
+   val = negative ? -result : result;
+   return true;
+}
+
+/*
+ * Fields of a raw snapdiff line: "level objId op path [extra]". entry spans
+ * from op to the last token, i.e. the part of the line that is kept in the
+ * bucketized output. entryIsTabJoined is set if its tokens are separated
+ * by single tabs, meaning entry can be written out as is.
+ */
+struct RawDiffLine {
+   DiffToken level;
+   DiffToken objId;
+   DiffToken op;
+   DiffToken path;
+   DiffToken extra;
+   DiffToken entry;
+   bool      entryIsTabJoined;
+   int       numTokens;
+};
+
+static inline void
+SplitRawDiffLine(const DiffToken& line, RawDiffLine& fields)
+{
+   DiffToken *named[] = { &fields.level, &fields.objId, &fields.op,
+                          &fields.path, &fields.extra };
+   const char *pos = line.data;
+   const char *end = line.End();
+   DiffToken token;
+
+   fields = RawDiffLine();
+   fields.entryIsTabJoined = true;
+
+   while (NextDiffToken(pos, end, token)) {
+      if (fields.numTokens < 5) {
+         *named[fields.numTokens] = token;
+      }
+      if (fields.numTokens == 2) {
+         fields.entry = token;
+      } else if (fields.numTokens > 2) {
+         if (token.data - fields.entry.End() != 1 || token.data[-1] != '\t') {
+            fields.entryIsTabJoined = false;
+         }
+         fields.entry.len = token.End() - fields.entry.data;
+      }
+      ++fields.numTokens;
+   }
+}
+
+/*
+ * Appends the tokens of span joined by single tabs to out.
+ */
+static inline void
+AppendTabJoined(const DiffToken& span, std::string& out)
+{
+   const char *pos = span.data;
+   const char *end = span.End();
+   DiffToken token;
+   bool first = true;
+
+   while (NextDiffToken(pos, end, token)) {
+      if (!first) {
+         out += '\t';
+      }
+      out.append(token.data, token.len);
+      first = false;
+   }
+}
+
+/*
+ * Fields of a serialized diff line: "op path [extra]".
+ */
+struct SerialDiffLine {
+   DiffToken op;
+   DiffToken path;
+   DiffToken extra;
+   int       numTokens;
+};
+
+static inline void
+SplitSerialDiffLine(const DiffToken& line, SerialDiffLine& fields)
+{
+   DiffToken *named[] = { &fields.op, &fields.path, &fields.extra };
+   const char *pos = line.data;
+   const char *end = line.End();
+   DiffToken token;
+
+   fields = SerialDiffLine();
+
+   while (NextDiffToken(pos, end, token)) {
+      if (fields.numTokens < 3) {
+         *named[fields.numTokens] = token;
+      }
+      ++fields.numTokens;
+   }
+}
+
+#endif /* __DIFF_TOKENIZER_H__ */
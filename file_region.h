@@ -0,0 +1,157 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __FILE_REGION_H__
+#define __FILE_REGION_H__
+
+/*
+ * Positional output for POSIX systems. Windows writes the text outputs in
+ * text mode through BufferedWriter, where byte offsets cannot be known up
+ * front.
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+#define REGION_COPY_BUFSIZE (1<<20)
+
+/*
+ * Creates or truncates fileName and sizes it to size bytes, reserving the
+ * blocks where the file system supports it, so that regions of it can be
+ * written concurrently.
+ */
+static inline bool
+PresizeFile(const std::string& fileName,
+            unsigned long long size)
+{
+   int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+   bool ok;
+
+   if (fd < 0) {
+      return false;
+   }
+#ifdef __linux__
+   // Unlike posix_fallocate, never falls back to writing zeros
+   if (size > 0) {
+      fallocate(fd, 0, 0, (off_t)size);
+   }
+#endif
+   ok = ftruncate(fd, (off_t)size) == 0;
+   return close(fd) == 0 && ok;
+}
+
+/*
+ * Writes a region of an existing file, from offset on, through a
+ * descriptor of its own, so that several regions of one file can be
+ * written at once from different threads.
+ */
+class FileRegionWriter {
+public:
+   FileRegionWriter()
+      : fd_(-1),
+        copyRangeFailed_(false)
+   {}
+
+   ~FileRegionWriter() {
+      Close();
+   }
+
+   bool Open(const std::string& fileName, unsigned long long offset) {
+      Close();
+      fd_ = open(fileName.c_str(), O_WRONLY | O_CLOEXEC);
+      if (fd_ < 0) {
+         return false;
+      }
+      if (lseek(fd_, (off_t)offset, SEEK_SET) != (off_t)offset) {
+         Close();
+         return false;
+      }
+      return true;
+   }
+
+   bool Write(const char *data, size_t len) {
+      while (len > 0) {
+         ssize_t written = write(fd_, data, len);
+
+         if (written < 0) {
+            if (errno == EINTR) {
+               continue;
+            }
+            return false;
+         }
+         data += written;
+         len -= written;
+      }
+      return true;
+   }
+
+   /*
+    * Appends the first len bytes of fileName to the region, copied within
+    * the kernel where copy_file_range is supported.
+    */
+   bool CopyFrom(const std::string& fileName, unsigned long long len) {
+      int in = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+      bool ok = in >= 0 && CopyFd(in, len);
+
+      if (in >= 0) {
+         close(in);
+      }
+      return ok;
+   }
+
+   bool Close() {
+      if (fd_ < 0) {
+         return true;
+      }
+      bool ok = close(fd_) == 0;
+      fd_ = -1;
+      return ok;
+   }
+
+private:
+   bool CopyFd(int in, unsigned long long len) {
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+      while (len > 0 && !copyRangeFailed_) {
+         ssize_t copied = copy_file_range(in, NULL, fd_, NULL, len, 0);
+
+         if (copied < 0 && errno == EINTR) {
+            continue;
+         }
+         if (copied <= 0) {
+            // Not supported between these files, copy the rest by hand
+            copyRangeFailed_ = true;
+            break;
+         }
+         len -= copied;
+      }
+#endif
+      std::vector<char> buf(len > 0 ? REGION_COPY_BUFSIZE : 0);
+
+      while (len > 0) {
+         size_t chunk = (size_t)std::min<unsigned long long>(len, buf.size());
+         ssize_t nread = read(in, buf.data(), chunk);
+
+         if (nread < 0 && errno == EINTR) {
+            continue;
+         }
+         if (nread <= 0 || !Write(buf.data(), nread)) {
+            return false;
+         }
+         len -= nread;
+      }
+      return true;
+   }
+
+   int  fd_;
+   bool copyRangeFailed_;
+};
+
+#endif /* __FILE_REGION_H__ */
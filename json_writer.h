@@ -6,108 +6,183 @@
 #ifndef __JSON_WRITER_H__
 #define __JSON_WRITER_H__
 
-#include <map>
-#include <vector>
-#include <sstream>
-#include <iostream>
-#include <memory>
+#include <ostream>
+#include <string.h>
+#include <string>
 
-class JsonObject {
+#define JSON_MAX_DEPTH 32
+
+/*
+ * Streaming json writer: values are written to the output stream as they
+ * are added, nothing is kept besides the nesting state, so writing a value
+ * never allocates. The layout is one member or element per line:
+ *
+ *    [
+ *    {
+ *    "key" : value,
+ *    ...
+ *    }
+ *    ]
+ *
+ * or, if compact, everything on one line without any whitespace, as used
+ * for the records of NDJSON files. Strings are escaped as required by
+ * RFC 8259, bytes >= 0x80 are passed through as UTF-8.
+ */
+class JsonWriter {
 public:
-   virtual ~JsonObject() {}
-   virtual std::ostream& Dump(std::ostream& s) = 0;
-   inline std::ostream& DumpStr(std::ostream& s, const std::string& str) {
-      s << "\"" << str << "\"";
-      return s;
+   explicit JsonWriter(std::ostream& out, bool compact = false)
+      : out_(out),
+        compact_(compact),
+        depth_(0),
+        afterKey_(false)
+   {}
+
+   void BeginObject() {
+      Begin('{');
    }
-};
 
-typedef std::unique_ptr<JsonObject> JsonObjectPtr;
+   void EndObject() {
+      End('}');
+   }
 
-class JsonNumber : public JsonObject {
-public:
-   JsonNumber(long long val)
-      : val_(val)
-   {}
+   void BeginArray() {
+      Begin('[');
+   }
 
-   std::ostream& Dump(std::ostream& s) {
-      s << val_;
-      return s;
+   void EndArray() {
+      End(']');
    }
 
-private:
-   long long val_;
-};
+   void Key(const char *key) {
+      Key(key, strlen(key));
+   }
 
-class JsonBool : public JsonObject {
-public:
-   JsonBool(bool val)
-      : val_(val)
-   {}
+   void Key(const char *key, size_t len) {
+      Separator();
+      WriteString(key, len);
+      if (compact_) {
+         out_.put(':');
+      } else {
+         out_.write(" : ", 3);
+      }
+      afterKey_ = true;
+   }
 
-   std::ostream& Dump(std::ostream& s) {
-      s << (val_ ? "true" : "false");
-      return s;
+   void String(const char *val) {
+      String(val, strlen(val));
    }
 
-private:
-   bool val_;
-};
+   void String(const std::string& val) {
+      String(val.data(), val.size());
+   }
 
-class JsonString : public JsonObject {
-public:
-   JsonString(const std::string& val)
-      : val_(val)
-   {}
+   void String(const char *val, size_t len) {
+      Separator();
+      WriteString(val, len);
+   }
+
+   void Number(long long val) {
+      char buf[24];
+      char *end = buf + sizeof buf;
+      char *pos = end;
+      unsigned long long mag = val < 0 ? 0ULL - (unsigned long long)val : val;
+
+      Separator();
+      do {
+         *--pos = '0' + mag % 10;
+         mag /= 10;
+      } while (mag != 0);
+      if (val < 0) {
+         *--pos = '-';
+      }
+      out_.write(pos, end - pos);
+   }
 
-   std::ostream& Dump(std::ostream& s) {
-      return DumpStr(s, val_);
+   void Bool(bool val) {
+      Separator();
+      if (val) {
+         out_.write("true", 4);
+      } else {
+         out_.write("false", 5);
+      }
    }
 
 private:
-   std::string val_;
-};
+   void Begin(char open) {
+      Separator();
+      out_.put(open);
+      if (!compact_) {
+         out_.put('\n');
+      }
+      if (depth_ < JSON_MAX_DEPTH) {
+         first_[depth_] = true;
+      }
+      ++depth_;
+   }
 
-class JsonMap : public JsonObject, std::map<std::string, JsonObjectPtr> {
-public:
-   template <class T>
-   bool Add(std::string const& key, T const val) {
-      if (std::is_convertible<T, JsonObject *>::value) {
-         this->insert(std::make_pair(key, JsonObjectPtr(val)));
-      } else {
-         return false;
+   void End(char close) {
+      --depth_;
+      if (!compact_) {
+         out_.put('\n');
       }
-      return true;
+      out_.put(close);
    }
 
-   std::ostream& Dump(std::ostream& s) {
-      s << "{\n";
-      for (const auto& e: *this) {
-         // Json doesn't allow trailing comma, so only
-         // append comma to previous line if we are appending
-         if (*this->begin() != e) s << "," << std::endl;
-         DumpStr(s, e.first) << " : ";
-         e.second->Dump(s);
+   // Emits the separator between members or elements of the open container
+   void Separator() {
+      if (afterKey_) {
+         afterKey_ = false;
+         return;
+      }
+      if (depth_ == 0 || depth_ > JSON_MAX_DEPTH) {
+         return;
+      }
+      if (first_[depth_ - 1]) {
+         first_[depth_ - 1] = false;
+      } else if (compact_) {
+         out_.put(',');
+      } else {
+         out_.write(",\n", 2);
       }
-      s << "\n}";
-      return s;
    }
-};
 
-class JsonArray : public JsonObject, std::vector<JsonObjectPtr> {
-public:
-   using std::vector<JsonObjectPtr>::push_back;
-   using std::vector<JsonObjectPtr>::size;
-
-   std::ostream& Dump(std::ostream& s) {
-      s << "[\n";
-      for (const auto& e: *this) {
-         if (*this->begin() != e) s << "," << std::endl;
-         e->Dump(s);
+   void WriteString(const char *str, size_t len) {
+      static const char hex[] = "0123456789abcdef";
+      const char *end = str + len;
+      const char *run = str;
+
+      out_.put('"');
+      for (const char *pos = str; pos < end; ++pos) {
+         unsigned char c = *pos;
+         if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+         }
+
+         out_.write(run, pos - run);
+         run = pos + 1;
+         switch (c) {
+         case '"':  out_.write("\\\"", 2); break;
+         case '\\': out_.write("\\\\", 2); break;
+         case '\b': out_.write("\\b", 2); break;
+         case '\f': out_.write("\\f", 2); break;
+         case '\n': out_.write("\\n", 2); break;
+         case '\r': out_.write("\\r", 2); break;
+         case '\t': out_.write("\\t", 2); break;
+         default: {
+            char esc[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            out_.write(esc, sizeof esc);
+         }
+         }
       }
-      s << "\n]";
-      return s;
+      out_.write(run, end - run);
+      out_.put('"');
    }
+
+   std::ostream& out_;
+   bool          compact_;
+   bool          first_[JSON_MAX_DEPTH];
+   int           depth_;
+   bool          afterKey_;
 };
 
 #endif /* __JSON_WRITER_H__ */
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <atomic>
+#include <chrono>
+#include <time.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif /* _WIN32 */
+
+#define LATENCY_NUM_BOUNDS 16
+
+/*
+ * Upper bounds of the latency histogram buckets in microseconds, from
+ * local disk to slow NFS round trips. The last bucket takes the rest.
+ */
+static const long long latencyBoundsUs[LATENCY_NUM_BOUNDS] = {
+   100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+   50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+/*
+ * Latency histogram with fixed buckets, recorded into from any thread
+ * without locking.
+ */
+class LatencyHistogram {
+public:
+   LatencyHistogram()
+      : sumUs_(0)
+   {
+      for (auto& count : counts_) {
+         count = 0;
+      }
+   }
+
+   void Record(std::chrono::steady_clock::duration elapsed) {
+      long long us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+      int bucket = 0;
+
+      while (bucket < LATENCY_NUM_BOUNDS && us > latencyBoundsUs[bucket]) {
+         ++bucket;
+      }
+      ++counts_[bucket];
+      sumUs_ += us;
+   }
+
+   // Samples in bucket, LATENCY_NUM_BOUNDS is the one above the last bound
+   unsigned long long Count(int bucket) const {
+      return counts_[bucket];
+   }
+
+   unsigned long long TotalCount() const {
+      unsigned long long total = 0;
+
+      for (const auto& count : counts_) {
+         total += count;
+      }
+      return total;
+   }
+
+   unsigned long long SumUs() const {
+      return sumUs_;
+   }
+
+private:
+   std::atomic<unsigned long long> counts_[LATENCY_NUM_BOUNDS + 1];
+   std::atomic<unsigned long long> sumUs_;
+};
+
+/*
+ * Times a scope into histogram, if set.
+ */
+class LatencyTimer {
+public:
+   explicit LatencyTimer(LatencyHistogram *histogram)
+      : histogram_(histogram),
+        start_(std::chrono::steady_clock::now())
+   {}
+
+   ~LatencyTimer() {
+      if (histogram_ != nullptr) {
+         histogram_->Record(std::chrono::steady_clock::now() - start_);
+      }
+   }
+
+private:
+   LatencyHistogram                     *histogram_;
+   std::chrono::steady_clock::time_point start_;
+};
+
+/*
+ * CPU time used by all threads of the process so far, in microseconds
+ */
+static inline long long
+ProcessCpuUs()
+{
+#ifdef _WIN32
+   FILETIME creation, exit, kernel, user;
+
+   if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+      return 0;
+   }
+   // FILETIMEs count 100ns units
+   return (((long long)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+           ((long long)user.dwHighDateTime << 32 | user.dwLowDateTime)) / 10;
+#else
+   struct timespec ts;
+
+   if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+      return 0;
+   }
+   return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif /* _WIN32 */
+}
+
+/*
+ * Wall and CPU time of a processing stage
+ */
+struct StageTime {
+   const char *name;
+   long long   wallUs;
+   long long   cpuUs;
+};
+
+/*
+ * Times a scope as a stage, appended to stages when it ends. The CPU time
+ * is that of the whole process, including the helper threads of the stage.
+ */
+class StageTimer {
+public:
+   StageTimer(std::vector<StageTime>& stages, const char *name)
+      : stages_(stages),
+        name_(name),
+        start_(std::chrono::steady_clock::now()),
+        cpuStart_(ProcessCpuUs())
+   {}
+
+   ~StageTimer() {
+      std::chrono::steady_clock::duration elapsed =
+         std::chrono::steady_clock::now() - start_;
+
+      stages_.push_back(StageTime{name_,
+         std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(),
+         ProcessCpuUs() - cpuStart_});
+   }
+
+private:
+   std::vector<StageTime>&               stages_;
+   const char                           *name_;
+   std::chrono::steady_clock::time_point start_;
+   long long                             cpuStart_;
+};
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __PATH_FILTER_H__
+#define __PATH_FILTER_H__
+
+#include <string>
+#include <string.h>
+#include <vector>
+
+/*
+ * Include and exclude rules selecting the diff paths to process. A rule is
+ * a path prefix, such as home/alice, or a glob such as home/a*: *, ? and
+ * [...] match within a path component, a ** component matches any number
+ * of components. A rule selects the paths it matches and everything below
+ * them. A path is selected if no exclude rule and, if there are include
+ * rules, some include rule selects it. Directories above included paths
+ * are selected too, so that the directories leading to them are still
+ * created.
+ */
+class PathFilter {
+public:
+   void Include(const std::string& rule) {
+      includes_.push_back(SplitRule(rule));
+   }
+
+   void Exclude(const std::string& rule) {
+      excludes_.push_back(SplitRule(rule));
+   }
+
+   bool Empty() const {
+      return includes_.empty() && excludes_.empty();
+   }
+
+   bool Selects(const char *path, size_t len, bool isDir) const {
+      std::vector<Component> comps;
+      const char *end = path + len;
+
+      while (path < end) {
+         const char *slash = (const char *)memchr(path, '/', end - path);
+         const char *compEnd = slash != NULL ? slash : end;
+
+         if (compEnd > path) {
+            comps.push_back(Component{path, (size_t)(compEnd - path)});
+         }
+         path = compEnd + 1;
+      }
+
+      for (const Rule& rule : excludes_) {
+         if (MatchRule(rule, 0, comps, 0, false)) {
+            return false;
+         }
+      }
+      if (includes_.empty()) {
+         return true;
+      }
+      for (const Rule& rule : includes_) {
+         if (MatchRule(rule, 0, comps, 0, isDir)) {
+            return true;
+         }
+      }
+      return false;
+   }
+
+private:
+   typedef std::vector<std::string> Rule;
+
+   struct Component {
+      const char *data;
+      size_t      len;
+   };
+
+   static Rule SplitRule(const std::string& rule) {
+      Rule comps;
+      size_t pos = 0;
+
+      while (pos <= rule.size()) {
+         size_t slash = rule.find('/', pos);
+         size_t compEnd = slash != std::string::npos ? slash : rule.size();
+
+         if (compEnd > pos && rule.compare(pos, compEnd - pos, ".") != 0) {
+            comps.push_back(rule.substr(pos, compEnd - pos));
+         }
+         pos = compEnd + 1;
+      }
+      return comps;
+   }
+
+   // Length of the [...] class at pattern, 0 if it is not one
+   static size_t ClassLen(const char *pattern, const char *patEnd) {
+      const char *pos = pattern + 1;
+
+      if (pos < patEnd && (*pos == '!' || *pos == '^')) {
+         ++pos;
+      }
+      if (pos < patEnd && *pos == ']') {
+         ++pos;
+      }
+      while (pos < patEnd && *pos != ']') {
+         ++pos;
+      }
+      return pos < patEnd ? pos - pattern + 1 : 0;
+   }
+
+   static bool MatchClass(const char *cls, size_t len, char c) {
+      const char *pos = cls + 1;
+      const char *end = cls + len - 1;
+      bool negate = *pos == '!' || *pos == '^';
+      bool found = false;
+
+      if (negate) {
+         ++pos;
+      }
+      while (pos < end) {
+         if (pos + 2 < end && pos[1] == '-') {
+            found = found || (c >= pos[0] && c <= pos[2]);
+            pos += 3;
+         } else {
+            found = found || c == *pos++;
+         }
+      }
+      return found != negate;
+   }
+
+   // Matches a glob against one path component
+   static bool MatchComponent(const std::string& pattern, const Component& comp) {
+      const char *pat = pattern.data();
+      const char *patEnd = pat + pattern.size();
+      const char *str = comp.data;
+      const char *strEnd = comp.data + comp.len;
+      const char *starPat = NULL;
+      const char *starStr = NULL;
+
+      while (str < strEnd) {
+         size_t clsLen = pat < patEnd && *pat == '[' ? ClassLen(pat, patEnd) : 0;
+
+         if (pat < patEnd && *pat == '*') {
+            starPat = ++pat;
+            starStr = str;
+         } else if (pat < patEnd && (*pat == '?' ||
+                                     (clsLen > 0 && MatchClass(pat, clsLen, *str)) ||
+                                     (clsLen == 0 && *pat == *str))) {
+            pat += clsLen > 0 ? clsLen : 1;
+            ++str;
+         } else if (starPat != NULL) {
+            // Let the last * take one more character
+            pat = starPat;
+            str = ++starStr;
+         } else {
+            return false;
+         }
+      }
+      while (pat < patEnd && *pat == '*') {
+         ++pat;
+      }
+      return pat == patEnd;
+   }
+
+   /*
+    * Matches rule from component ri on against the path from component ci
+    * on. Paths below a match match too, and with ancestor paths above a
+    * possible match.
+    */
+   static bool MatchRule(const Rule& rule, size_t ri,
+                         const std::vector<Component>& comps, size_t ci,
+                         bool ancestor) {
+      if (ri == rule.size()) {
+         return true;
+      }
+      if (ci == comps.size()) {
+         if (ancestor) {
+            return true;
+         }
+         for (; ri < rule.size(); ++ri) {
+            if (rule[ri] != "**") {
+               return false;
+            }
+         }
+         return true;
+      }
+      if (rule[ri] == "**") {
+         return MatchRule(rule, ri + 1, comps, ci, ancestor) ||
+                MatchRule(rule, ri, comps, ci + 1, ancestor);
+      }
+      return MatchComponent(rule[ri], comps[ci]) &&
+             MatchRule(rule, ri + 1, comps, ci + 1, ancestor);
+   }
+
+   std::vector<Rule> includes_;
+   std::vector<Rule> excludes_;
+};
+
+#endif /* __PATH_FILTER_H__ */
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __PATH_TRIE_H__
+#define __PATH_TRIE_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/*
+ * Interned paths for indexes over a whole diff. A path is a node holding
+ * its last '/' separated component and its parent node, so paths sharing
+ * a prefix share the nodes of it, and each component is stored once. The
+ * full path is only built, by AppendPath(), when it is written out.
+ * Parent, ancestor and subtree queries follow the node links.
+ *
+ * Nodes map one to one to the prefixes a path has at each '/': "a/b" is
+ * the node b under the node a, "a" is the node a under the root, and empty
+ * components, as in "/a" or "a//b", are nodes of their own. The root
+ * stands for no path at all.
+ */
+typedef uint32_t PathNode;
+
+#define PATH_ROOT            ((PathNode)0)
+#define PATH_NONE            ((PathNode)~0U)
+#define PATH_TRIE_MIN_SLOTS  1024   /* power of two */
+
+class PathTrie {
+public:
+   PathTrie() {
+      nodes_.push_back(Node{0, PATH_NONE, 0});
+      slots_.assign(PATH_TRIE_MIN_SLOTS, PATH_NONE);
+   }
+
+   /*
+    * Calls f(name, len) for the components of path, in order, until f
+    * returns false. Returns false if f did.
+    */
+   template <class F>
+   static bool ForEachComponent(const char *path, size_t len, F f) {
+      const char *end = path + len;
+
+      for (;;) {
+         const char *slash = static_cast<const char *>(memchr(path, '/', end - path));
+         const char *nameEnd = slash != nullptr ? slash : end;
+
+         if (!f(path, (size_t)(nameEnd - path))) {
+            return false;
+         }
+         if (slash == nullptr) {
+            return true;
+         }
+         path = slash + 1;
+      }
+   }
+
+   // The child of parent named name, PATH_NONE if there is none
+   PathNode Child(PathNode parent, const char *name, size_t len) const {
+      size_t mask = slots_.size() - 1;
+
+      for (size_t slot = Hash(parent, name, len) & mask; slots_[slot] != PATH_NONE;
+           slot = (slot + 1) & mask) {
+         const Node& node = nodes_[slots_[slot]];
+
+         if (node.parent == parent && node.nameLen == len &&
+             memcmp(&names_[node.nameOffset], name, len) == 0) {
+            return slots_[slot];
+         }
+      }
+      return PATH_NONE;
+   }
+
+   // The node of path, added with its missing ancestors
+   PathNode Intern(const char *path, size_t len) {
+      PathNode node = PATH_ROOT;
+
+      ForEachComponent(path, len, [this, &node](const char *name, size_t nameLen) {
+         node = AddChild(node, name, nameLen);
+         return true;
+      });
+      return node;
+   }
+
+   // The node of path, PATH_NONE if it was never interned
+   PathNode Find(const char *path, size_t len) const {
+      PathNode node = PATH_ROOT;
+
+      ForEachComponent(path, len, [this, &node](const char *name, size_t nameLen) {
+         node = Child(node, name, nameLen);
+         return node != PATH_NONE;
+      });
+      return node;
+   }
+
+   // PATH_NONE for the root
+   PathNode Parent(PathNode node) const {
+      return nodes_[node].parent;
+   }
+
+   // Whether node is ancestor or below it
+   bool IsUnder(PathNode node, PathNode ancestor) const {
+      for (; node != PATH_NONE; node = Parent(node)) {
+         if (node == ancestor) {
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // Appends the path of node to out
+   void AppendPath(PathNode node, std::string& out) const {
+      size_t len = 0;
+
+      for (PathNode n = node; n != PATH_ROOT; n = Parent(n)) {
+         len += nodes_[n].nameLen + (Parent(n) != PATH_ROOT ? 1 : 0);
+      }
+
+      size_t pos = out.size() + len;
+
+      out.resize(pos);
+      for (PathNode n = node; n != PATH_ROOT; n = Parent(n)) {
+         pos -= nodes_[n].nameLen;
+         memcpy(&out[pos], &names_[nodes_[n].nameOffset], nodes_[n].nameLen);
+         if (Parent(n) != PATH_ROOT) {
+            out[--pos] = '/';
+         }
+      }
+   }
+
+   // Nodes, including the root
+   size_t NumNodes() const {
+      return nodes_.size();
+   }
+
+   // Bytes held by the trie
+   size_t MemoryBytes() const {
+      return nodes_.capacity() * sizeof(Node) + names_.capacity() +
+             slots_.capacity() * sizeof(PathNode);
+   }
+
+private:
+   struct Node {
+      uint64_t nameOffset;   // in names_
+      PathNode parent;
+      uint32_t nameLen;
+   };
+
+   static size_t Hash(PathNode parent, const char *name, size_t len) {
+      // FNV-1a over the parent and the name
+      uint64_t hash = 14695981039346656037ULL;
+
+      for (int i = 0; i < 4; ++i) {
+         hash = (hash ^ ((parent >> (8 * i)) & 0xff)) * 1099511628211ULL;
+      }
+      for (size_t i = 0; i < len; ++i) {
+         hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+      }
+      return (size_t)(hash ^ (hash >> 32));
+   }
+
+   PathNode AddChild(PathNode parent, const char *name, size_t len) {
+      PathNode node = Child(parent, name, len);
+
+      if (node != PATH_NONE) {
+         return node;
+      }
+      // At most half of the slots are used
+      if (2 * (nodes_.size() + 1) > slots_.size()) {
+         Rehash(2 * slots_.size());
+      }
+      node = (PathNode)nodes_.size();
+      nodes_.push_back(Node{names_.size(), parent, (uint32_t)len});
+      names_.append(name, len);
+      Insert(node);
+      return node;
+   }
+
+   void Insert(PathNode node) {
+      const Node& n = nodes_[node];
+      size_t mask = slots_.size() - 1;
+      size_t slot = Hash(n.parent, &names_[n.nameOffset], n.nameLen) & mask;
+
+      while (slots_[slot] != PATH_NONE) {
+         slot = (slot + 1) & mask;
+      }
+      slots_[slot] = node;
+   }
+
+   void Rehash(size_t numSlots) {
+      slots_.assign(numSlots, PATH_NONE);
+      for (PathNode node = 1; node < nodes_.size(); ++node) {
+         Insert(node);
+      }
+   }
+
+   std::vector<Node>     nodes_;
+   std::string           names_;
+   std::vector<PathNode> slots_;   // node ids by child hash, open addressed
+};
+
+#endif /* __PATH_TRIE_H__ */
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __RECORD_ARENA_H__
+#define __RECORD_ARENA_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+#define ARENA_MIN_BLOCK  (4<<10)
+#define ARENA_MAX_BLOCK  (1<<20)
+
+/*
+ * Append-only store of newline terminated records packed into blocks.
+ * Blocks grow geometrically up to ARENA_MAX_BLOCK, nothing is ever moved
+ * once stored and a record never spans two blocks, so every block holds
+ * whole lines that can be written out or tokenized in place.
+ */
+class RecordArena {
+public:
+   RecordArena()
+      : size_(0)
+   {}
+
+   void Append(const char *data, size_t len) {
+      if (blocks_.empty() || blocks_.back().Free() < len + 1) {
+         size_t cap = blocks_.empty() ? ARENA_MIN_BLOCK :
+                      std::min(blocks_.back().cap * 2, (size_t)ARENA_MAX_BLOCK);
+         blocks_.emplace_back(std::max(cap, len + 1));
+      }
+
+      Block& block = blocks_.back();
+      memcpy(block.data.get() + block.used, data, len);
+      block.data[block.used + len] = '\n';
+      block.used += len + 1;
+      size_ += len + 1;
+   }
+
+   // Appends a run of complete '\n' terminated records, kept in one block
+   void AppendRecords(const char *data, size_t len) {
+      if (len == 0) {
+         return;
+      }
+      if (blocks_.empty() || blocks_.back().Free() < len) {
+         size_t cap = blocks_.empty() ? ARENA_MIN_BLOCK :
+                      std::min(blocks_.back().cap * 2, (size_t)ARENA_MAX_BLOCK);
+         blocks_.emplace_back(std::max(cap, len));
+      }
+
+      Block& block = blocks_.back();
+      memcpy(block.data.get() + block.used, data, len);
+      block.used += len;
+      size_ += len;
+   }
+
+   // Bytes stored, including the record terminators
+   size_t Size() const {
+      return size_;
+   }
+
+   // Calls f(data, len) for the packed records of each block, in order
+   template <class F>
+   bool ForEachBlock(F f) const {
+      for (const Block& block : blocks_) {
+         if (!f(block.data.get(), block.used)) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   void Clear() {
+      std::vector<Block>().swap(blocks_);
+      size_ = 0;
+   }
+
+private:
+   struct Block {
+      explicit Block(size_t cap)
+         : data(new char[cap]),
+           used(0),
+           cap(cap)
+      {}
+
+      size_t Free() const { return cap - used; }
+
+      std::unique_ptr<char[]> data;
+      size_t                  used;
+      size_t                  cap;
+   };
+
+   std::vector<Block> blocks_;
+   size_t             size_;
+};
+
+/*
+ * Allocation counters of scratch arenas, shared by the arenas of several
+ * threads: the blocks they took from the heap, the bytes of those, and
+ * the allocations they served from them.
+ */
+struct ArenaCounters {
+   std::atomic<unsigned long long> blocks{0};
+   std::atomic<unsigned long long> blockBytes{0};
+   std::atomic<unsigned long long> allocs{0};
+};
+
+/*
+ * Bump allocator owning the records and path bytes of one unit of work,
+ * such as a json chunk or a batch of entries, so that these cost a few
+ * block allocations per unit instead of heap allocations per entry.
+ * Everything is released at once by Reset(), which keeps the largest
+ * block for the next unit, or when the arena goes away. Only trivially
+ * destructible objects are stored, none of them is ever destroyed.
+ */
+class ScratchArena {
+public:
+   explicit ScratchArena(size_t firstBlock = ARENA_MIN_BLOCK,
+                         ArenaCounters *counters = nullptr)
+      : firstBlock_(std::max(firstBlock, (size_t)ARENA_MIN_BLOCK)),
+        allocs_(0),
+        counters_(counters)
+   {}
+
+   ~ScratchArena() {
+      Count();
+   }
+
+   ScratchArena(ScratchArena&& other)
+      : blocks_(std::move(other.blocks_)),
+        firstBlock_(other.firstBlock_),
+        allocs_(other.allocs_),
+        counters_(other.counters_)
+   {
+      other.blocks_.clear();
+      other.allocs_ = 0;
+   }
+
+   ScratchArena& operator=(ScratchArena&& other) {
+      if (this != &other) {
+         Count();
+         blocks_ = std::move(other.blocks_);
+         firstBlock_ = other.firstBlock_;
+         allocs_ = other.allocs_;
+         counters_ = other.counters_;
+         other.blocks_.clear();
+         other.allocs_ = 0;
+      }
+      return *this;
+   }
+
+   ScratchArena(const ScratchArena&) = delete;
+   ScratchArena& operator=(const ScratchArena&) = delete;
+
+   // len bytes aligned for any object
+   char *Alloc(size_t len) {
+      const size_t align = alignof(std::max_align_t);
+
+      len = (len + align - 1) & ~(align - 1);
+      if (blocks_.empty() || blocks_.back().Free() < len) {
+         size_t cap = blocks_.empty() ? firstBlock_ :
+                      std::min(blocks_.back().cap * 2, (size_t)ARENA_MAX_BLOCK);
+         blocks_.emplace_back(std::max(cap, len));
+         if (counters_ != nullptr) {
+            ++counters_->blocks;
+            counters_->blockBytes += blocks_.back().cap;
+         }
+      }
+
+      Block& block = blocks_.back();
+      char *data = block.data.get() + block.used;
+
+      block.used += len;
+      ++allocs_;
+      return data;
+   }
+
+   // Array of n default constructed objects
+   template <class T>
+   T *AllocArray(size_t n) {
+      static_assert(std::is_trivially_destructible<T>::value,
+                    "arena objects are never destroyed");
+      T *array = reinterpret_cast<T *>(Alloc(n * sizeof(T)));
+
+      for (size_t i = 0; i < n; ++i) {
+         new (&array[i]) T();
+      }
+      return array;
+   }
+
+   // NUL terminated concatenation of a and b
+   const char *Concat(const char *a, size_t aLen, const char *b, size_t bLen) {
+      char *data = Alloc(aLen + bLen + 1);
+
+      memcpy(data, a, aLen);
+      memcpy(data + aLen, b, bLen);
+      data[aLen + bLen] = '\0';
+      return data;
+   }
+
+   // Releases everything allocated, keeping the largest block
+   void Reset() {
+      Count();
+      if (blocks_.size() > 1) {
+         auto largest = std::max_element(blocks_.begin(), blocks_.end(),
+                                         [](const Block& a, const Block& b) {
+                                            return a.cap < b.cap;
+                                         });
+         Block keep = std::move(*largest);
+
+         blocks_.clear();
+         blocks_.push_back(std::move(keep));
+      }
+      if (!blocks_.empty()) {
+         blocks_.back().used = 0;
+      }
+   }
+
+private:
+   struct Block {
+      explicit Block(size_t cap)
+         : data(new char[cap]),
+           used(0),
+           cap(cap)
+      {}
+
+      size_t Free() const { return cap - used; }
+
+      std::unique_ptr<char[]> data;
+      size_t                  used;
+      size_t                  cap;
+   };
+
+   // Allocations are counted per unit, not each on the shared counters
+   void Count() {
+      if (counters_ != nullptr && allocs_ > 0) {
+         counters_->allocs += allocs_;
+      }
+      allocs_ = 0;
+   }
+
+   std::vector<Block>  blocks_;
+   size_t              firstBlock_;
+   unsigned long long  allocs_;
+   ArenaCounters      *counters_;
+};
+
+#endif /* __RECORD_ARENA_H__ */
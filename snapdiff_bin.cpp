@@ -0,0 +1,371 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /* _WIN32 */
+
+#include "snapdiff_bin.h"
+
+struct SnapDiffBin {
+   const char               *data;
+   uint64_t                  size;
+   const SnapDiffBinTrailer *trailer;
+   const char               *strings;
+   const SnapDiffBinRecord  *records;
+   const SnapDiffBinLevel   *levels;
+#ifdef _WIN32
+   HANDLE                    file;
+   HANDLE                    mapping;
+#endif /* _WIN32 */
+};
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SectionFits --
+ *
+ *      Checks that count items of itemSize starting at offset lie within
+ *      the file
+ *
+ * Results:
+ *      true if the section is within bounds
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+SectionFits(uint64_t fileSize,
+            uint64_t offset,
+            uint64_t count,
+            uint64_t itemSize)
+{
+   if (offset > fileSize || offset % 8 != 0) {
+      return false;
+   }
+   return count <= (fileSize - offset) / itemSize;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ValidateSnapDiffBin --
+ *
+ *      Checks header and trailer of a mapped binary diff and locates its
+ *      sections
+ *
+ * Results:
+ *      true if the file is a binary diff this reader understands. Records
+ *      are checked as they are accessed, keeping the open O(1) in the
+ *      number of records.
+ *
+ * Side effects:
+ *      Sets the section pointers of bin
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+ValidateSnapDiffBin(SnapDiffBin *bin)
+{
+   const SnapDiffBinHeader *header;
+   const SnapDiffBinTrailer *trailer;
+
+   if (bin->size < sizeof *header + sizeof *trailer) {
+      return false;
+   }
+
+   header = (const SnapDiffBinHeader *)bin->data;
+   trailer = (const SnapDiffBinTrailer *)(bin->data + bin->size - sizeof *trailer);
+   if (memcmp(header->magic, SNAPDIFF_BIN_MAGIC, sizeof header->magic) != 0 ||
+       memcmp(trailer->magic, SNAPDIFF_BIN_TRAILER_MAGIC, sizeof trailer->magic) != 0 ||
+       header->version != SNAPDIFF_BIN_VERSION ||
+       trailer->version != SNAPDIFF_BIN_VERSION ||
+       header->recordSize != sizeof(SnapDiffBinRecord)) {
+      return false;
+   }
+
+   if (!SectionFits(bin->size, trailer->stringsOffset, trailer->stringsSize, 1) ||
+       !SectionFits(bin->size, trailer->recordsOffset, trailer->recordCount,
+                    sizeof(SnapDiffBinRecord)) ||
+       !SectionFits(bin->size, trailer->levelsOffset, trailer->levelCount,
+                    sizeof(SnapDiffBinLevel))) {
+      return false;
+   }
+
+   bin->trailer = trailer;
+   bin->strings = bin->data + trailer->stringsOffset;
+   bin->records = (const SnapDiffBinRecord *)(bin->data + trailer->recordsOffset);
+   bin->levels = (const SnapDiffBinLevel *)(bin->data + trailer->levelsOffset);
+
+   for (uint64_t i = 0; i < trailer->levelCount; ++i) {
+      const SnapDiffBinLevel *level = &bin->levels[i];
+
+      if (level->firstRecord > trailer->recordCount ||
+          level->numRecords > trailer->recordCount - level->firstRecord) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapDiffBinOpen --
+ *
+ *      Maps a binary diff file written by GetSnapshotDiffEx
+ *
+ * Results:
+ *      The reader, NULL if the file could not be mapped or is invalid
+ *
+ * Side effects:
+ *      Maps the file
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" SnapDiffBin *
+SnapDiffBinOpen(const char *fileName)
+{
+   SnapDiffBin *bin = new SnapDiffBin();
+
+#ifdef _WIN32
+   LARGE_INTEGER size;
+
+   bin->file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (bin->file == INVALID_HANDLE_VALUE) {
+      delete bin;
+      return NULL;
+   }
+   if (!GetFileSizeEx(bin->file, &size) || size.QuadPart == 0) {
+      CloseHandle(bin->file);
+      delete bin;
+      return NULL;
+   }
+   bin->size = size.QuadPart;
+   bin->mapping = CreateFileMappingA(bin->file, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (bin->mapping != NULL) {
+      bin->data = (const char *)MapViewOfFile(bin->mapping, FILE_MAP_READ, 0, 0, 0);
+   }
+   if (bin->data == NULL) {
+      if (bin->mapping != NULL) {
+         CloseHandle(bin->mapping);
+      }
+      CloseHandle(bin->file);
+      delete bin;
+      return NULL;
+   }
+#else
+   struct stat s;
+   int fd = open(fileName, O_RDONLY);
+
+   if (fd < 0) {
+      delete bin;
+      return NULL;
+   }
+   if (fstat(fd, &s) != 0 || s.st_size == 0) {
+      close(fd);
+      delete bin;
+      return NULL;
+   }
+   bin->size = s.st_size;
+
+   void *data = mmap(NULL, bin->size, PROT_READ, MAP_SHARED, fd, 0);
+
+   close(fd);
+   if (data == MAP_FAILED) {
+      delete bin;
+      return NULL;
+   }
+   bin->data = (const char *)data;
+#endif /* _WIN32 */
+
+   if (!ValidateSnapDiffBin(bin)) {
+      SnapDiffBinClose(bin);
+      return NULL;
+   }
+   return bin;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapDiffBinClose --
+ *
+ *      Unmaps a binary diff file
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Pointers obtained from bin become invalid
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" void
+SnapDiffBinClose(SnapDiffBin *bin)
+{
+   if (bin == NULL) {
+      return;
+   }
+#ifdef _WIN32
+   UnmapViewOfFile(bin->data);
+   CloseHandle(bin->mapping);
+   CloseHandle(bin->file);
+#else
+   munmap((void *)bin->data, bin->size);
+#endif /* _WIN32 */
+   delete bin;
+}
+
+
+extern "C" uint64_t
+SnapDiffBinRecordCount(const SnapDiffBin *bin)
+{
+   return bin->trailer->recordCount;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapDiffBinGetRecord --
+ *
+ *      Returns record number index, in serialized order
+ *
+ * Results:
+ *      The record, NULL if index is out of range or the record points
+ *      outside of the string table
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" const SnapDiffBinRecord *
+SnapDiffBinGetRecord(const SnapDiffBin *bin,
+                     uint64_t           index)
+{
+   const SnapDiffBinRecord *record;
+   uint64_t stringsSize = bin->trailer->stringsSize;
+
+   if (index >= bin->trailer->recordCount) {
+      return NULL;
+   }
+
+   record = &bin->records[index];
+   if (record->lineOffset > stringsSize ||
+       record->lineLen > stringsSize - record->lineOffset ||
+       (uint64_t)record->opOffset + record->opLen > record->lineLen ||
+       (uint64_t)record->pathOffset + record->pathLen > record->lineLen ||
+       (uint64_t)record->extraOffset + record->extraLen > record->lineLen) {
+      return NULL;
+   }
+   return record;
+}
+
+
+extern "C" uint64_t
+SnapDiffBinLevelCount(const SnapDiffBin *bin)
+{
+   return bin->trailer->levelCount;
+}
+
+
+extern "C" const SnapDiffBinLevel *
+SnapDiffBinGetLevel(const SnapDiffBin *bin,
+                    uint64_t           index)
+{
+   return index < bin->trailer->levelCount ? &bin->levels[index] : NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapDiffBinFindLevel --
+ *
+ *      Looks up the records of a level in the level index
+ *
+ * Results:
+ *      The level index entry, NULL if the diff has no such level
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" const SnapDiffBinLevel *
+SnapDiffBinFindLevel(const SnapDiffBin *bin,
+                     int32_t            level)
+{
+   uint64_t lo = 0;
+   uint64_t hi = bin->trailer->levelCount;
+
+   while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+
+      if (bin->levels[mid].level < level) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   if (lo < bin->trailer->levelCount && bin->levels[lo].level == level) {
+      return &bin->levels[lo];
+   }
+   return NULL;
+}
+
+
+extern "C" const char *
+SnapDiffBinLine(const SnapDiffBin       *bin,
+                const SnapDiffBinRecord *record)
+{
+   return bin->strings + record->lineOffset;
+}
+
+
+extern "C" const char *
+SnapDiffBinOp(const SnapDiffBin       *bin,
+              const SnapDiffBinRecord *record)
+{
+   return SnapDiffBinLine(bin, record) + record->opOffset;
+}
+
+
+extern "C" const char *
+SnapDiffBinPath(const SnapDiffBin       *bin,
+                const SnapDiffBinRecord *record)
+{
+   return SnapDiffBinLine(bin, record) + record->pathOffset;
+}
+
+
+extern "C" const char *
+SnapDiffBinExtra(const SnapDiffBin       *bin,
+                 const SnapDiffBinRecord *record)
+{
+   return SnapDiffBinLine(bin, record) + record->extraOffset;
+}
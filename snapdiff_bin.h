@@ -0,0 +1,133 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __SNAPDIFF_BIN_H__
+#define __SNAPDIFF_BIN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * Binary serialized diff, serialized_diff.bin. All fields are little
+ * endian and every section is 8 byte aligned, so the file can be mapped
+ * and its records and level index used in place:
+ *
+ *    SnapDiffBinHeader
+ *    string table     the serialized_diff text, one '\n' terminated line
+ *                     per record, padded to 8 bytes
+ *    records          SnapDiffBinRecord[recordCount], in serialized order
+ *    level index      SnapDiffBinLevel[levelCount], ascending by level
+ *    SnapDiffBinTrailer
+ *
+ * A record locates its line and the op, path and extra fields inside it,
+ * so consumers get at them without parsing the text.
+ */
+#define SNAPDIFF_BIN_MAGIC         "SNAPDIFB"
+#define SNAPDIFF_BIN_TRAILER_MAGIC "SNAPDIFE"
+#define SNAPDIFF_BIN_VERSION       1
+
+/* Entry types, the part of the op before '_', as SNAPDIFF_ENTRY_* */
+#define SNAPDIFF_BIN_ENTRY_OTHER   0
+#define SNAPDIFF_BIN_ENTRY_FILE    1
+#define SNAPDIFF_BIN_ENTRY_DIR     2
+#define SNAPDIFF_BIN_ENTRY_SYM     3
+
+/* Op kinds, the part of the op after '_', as SNAPDIFF_OP_* */
+#define SNAPDIFF_BIN_OP_CHANGE     0   /* combination of the flags below */
+#define SNAPDIFF_BIN_OP_DELETE     1
+#define SNAPDIFF_BIN_OP_RENAME     2
+
+/* Flags of SNAPDIFF_BIN_OP_CHANGE */
+#define SNAPDIFF_BIN_FLAG_CREATED  0x1   /* C */
+#define SNAPDIFF_BIN_FLAG_MODIFIED 0x2   /* M */
+#define SNAPDIFF_BIN_FLAG_STAT     0x4   /* S */
+#define SNAPDIFF_BIN_FLAG_XATTR    0x8   /* X */
+
+typedef struct SnapDiffBinHeader {
+   char     magic[8];             /* SNAPDIFF_BIN_MAGIC */
+   uint32_t version;
+   uint32_t recordSize;           /* sizeof(SnapDiffBinRecord) */
+} SnapDiffBinHeader;
+
+typedef struct SnapDiffBinRecord {
+   uint64_t lineOffset;           /* offset of the line in the string table */
+   uint32_t lineLen;              /* without the '\n' */
+   int32_t  level;
+   uint32_t pathOffset;           /* offsets relative to the line */
+   uint32_t pathLen;
+   uint32_t extraOffset;          /* rename target / symlink target */
+   uint32_t extraLen;             /* 0 if the line has no extra field */
+   uint16_t opOffset;
+   uint16_t opLen;
+   uint8_t  entryType;            /* SNAPDIFF_BIN_ENTRY_* */
+   uint8_t  opKind;               /* SNAPDIFF_BIN_OP_* */
+   uint8_t  opFlags;              /* SNAPDIFF_BIN_FLAG_* */
+   uint8_t  numFields;            /* fields of the line, capped at 255 */
+} SnapDiffBinRecord;
+
+typedef struct SnapDiffBinLevel {
+   int32_t  level;
+   uint32_t reserved;
+   uint64_t firstRecord;
+   uint64_t numRecords;
+} SnapDiffBinLevel;
+
+typedef struct SnapDiffBinTrailer {
+   uint64_t stringsOffset;
+   uint64_t stringsSize;
+   uint64_t recordsOffset;
+   uint64_t recordCount;
+   uint64_t levelsOffset;
+   uint64_t levelCount;
+   uint32_t version;
+   uint32_t reserved;
+   char     magic[8];             /* SNAPDIFF_BIN_TRAILER_MAGIC */
+} SnapDiffBinTrailer;
+
+/*
+ * Reader for serialized_diff.bin. The file is mapped read-only, records,
+ * levels and strings returned point into the mapping and stay valid until
+ * SnapDiffBinClose(). Strings are not NUL terminated.
+ */
+typedef struct SnapDiffBin SnapDiffBin;
+
+SnapDiffBin *SnapDiffBinOpen(const char *fileName);
+
+void SnapDiffBinClose(SnapDiffBin *bin);
+
+uint64_t SnapDiffBinRecordCount(const SnapDiffBin *bin);
+
+const SnapDiffBinRecord *SnapDiffBinGetRecord(const SnapDiffBin *bin,
+                                              uint64_t           index);
+
+uint64_t SnapDiffBinLevelCount(const SnapDiffBin *bin);
+
+const SnapDiffBinLevel *SnapDiffBinGetLevel(const SnapDiffBin *bin,
+                                            uint64_t           index);
+
+const SnapDiffBinLevel *SnapDiffBinFindLevel(const SnapDiffBin *bin,
+                                             int32_t            level);
+
+const char *SnapDiffBinLine(const SnapDiffBin       *bin,
+                            const SnapDiffBinRecord *record);
+
+const char *SnapDiffBinOp(const SnapDiffBin       *bin,
+                          const SnapDiffBinRecord *record);
+
+const char *SnapDiffBinPath(const SnapDiffBin       *bin,
+                            const SnapDiffBinRecord *record);
+
+const char *SnapDiffBinExtra(const SnapDiffBin       *bin,
+                             const SnapDiffBinRecord *record);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __SNAPDIFF_BIN_H__ */
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <iostream>
+#include <stdlib.h>
+
+#include "snapdiff_bin.h"
+
+using namespace std;
+
+/*
+ * Prints the diff lines of a serialized_diff.bin, all of them as in
+ * serialized_diff or only those of one level.
+ */
+int main(int argc, char** argv)
+{
+   if (argc != 2 && argc != 3) {
+      cerr << "Usage : " << argv[0] << " serialized_diff.bin [level]" << endl;
+      return 1;
+   }
+
+   SnapDiffBin *bin = SnapDiffBinOpen(argv[1]);
+
+   if (bin == NULL) {
+      cerr << "Could not open binary diff: " << argv[1] << endl;
+      return 1;
+   }
+
+   uint64_t first = 0;
+   uint64_t count = SnapDiffBinRecordCount(bin);
+
+   if (argc == 3) {
+      const SnapDiffBinLevel *level = SnapDiffBinFindLevel(bin, atoi(argv[2]));
+
+      count = 0;
+      if (level != NULL) {
+         first = level->firstRecord;
+         count = level->numRecords;
+      }
+   }
+
+   for (uint64_t i = first; i < first + count; ++i) {
+      const SnapDiffBinRecord *record = SnapDiffBinGetRecord(bin, i);
+
+      if (record == NULL) {
+         cerr << "Invalid record " << i << " in " << argv[1] << endl;
+         SnapDiffBinClose(bin);
+         return 1;
+      }
+      cout.write(SnapDiffBinLine(bin, record), record->lineLen) << '\n';
+   }
+
+   SnapDiffBinClose(bin);
+   return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __SNAPDIFF_FILE_H__
+#define __SNAPDIFF_FILE_H__
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif /* _WIN32 */
+
+/*
+ * Snapdiff page opened for reading. Pages are read sequentially in large
+ * blocks straight into the caller's buffer; Seek lets a reader continue
+ * behind the data it already has after reopening a page.
+ */
+class SnapDiffFile {
+public:
+   virtual ~SnapDiffFile() {}
+
+   /*
+    * Reads up to len bytes into buf. Returns the number of bytes read, 0 at
+    * the end of the page, -1 with errno set on error.
+    */
+   virtual long long Read(char *buf, size_t len) = 0;
+
+   virtual bool Seek(unsigned long long offset) = 0;
+
+   // Size of the page if known up front, -1 otherwise
+   virtual long long Size() = 0;
+};
+
+/*
+ * SnapDiffFile on a file descriptor. The snapdiff is read in binary mode,
+ * the tokenizer skips the '\r' of CRLF line ends.
+ */
+class FdSnapDiffFile : public SnapDiffFile {
+public:
+   explicit FdSnapDiffFile(int fd)
+      : fd_(fd)
+   {}
+
+   ~FdSnapDiffFile() override {
+#ifdef _WIN32
+      _close(fd_);
+#else
+      close(fd_);
+#endif /* _WIN32 */
+   }
+
+   long long Read(char *buf, size_t len) override {
+#ifdef _WIN32
+      // _read takes an unsigned int count
+      return _read(fd_, buf, (unsigned)std::min(len, (size_t)1 << 30));
+#else
+      ssize_t nread;
+
+      do {
+         nread = read(fd_, buf, len);
+      } while (nread < 0 && errno == EINTR);
+      return nread;
+#endif /* _WIN32 */
+   }
+
+   bool Seek(unsigned long long offset) override {
+#ifdef _WIN32
+      return _lseeki64(fd_, (long long)offset, SEEK_SET) == (long long)offset;
+#else
+      return lseek(fd_, (off_t)offset, SEEK_SET) == (off_t)offset;
+#endif /* _WIN32 */
+   }
+
+   long long Size() override {
+#ifdef _WIN32
+      struct _stat64 s;
+
+      if (_fstat64(fd_, &s) != 0) {
+         return -1;
+      }
+#else
+      struct stat s;
+
+      if (fstat(fd_, &s) != 0) {
+         return -1;
+      }
+#endif /* _WIN32 */
+      // Pages generated on the fly may report no size
+      return s.st_size > 0 ? (long long)s.st_size : -1;
+   }
+
+private:
+   int fd_;
+};
+
+/*
+ * Opens the snapdiff page fileName. The kernel is told that the page is
+ * read sequentially, so that NFS clients read ahead aggressively.
+ * Returns NULL with errno set if the page could not be opened.
+ */
+static inline std::unique_ptr<SnapDiffFile>
+OpenFdSnapDiffFile(const std::string& fileName)
+{
+#ifdef _WIN32
+   int fd = _open(fileName.c_str(), _O_RDONLY | _O_BINARY);
+#else
+   int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+#endif /* _WIN32 */
+
+   if (fd < 0) {
+      return nullptr;
+   }
+#ifdef POSIX_FADV_SEQUENTIAL
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+   return std::unique_ptr<SnapDiffFile>(new FdSnapDiffFile(fd));
+}
+
+#endif /* __SNAPDIFF_FILE_H__ */
@@ -7,13 +7,22 @@
 #error Unsupported platform
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <dirent.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <sys/stat.h>
+#include <thread>
 #include <time.h>
+#include <unordered_map>
 #include <vector>
 #include <errno.h>
 #include <string.h>
@@ -27,17 +36,440 @@ const std::string separator("/");
 #endif /* _WIN32 */
 
 #include "snapshot_diff.h"
+#include "buffered_writer.h"
+#ifndef _WIN32
+#include "file_region.h"
+#endif /* _WIN32 */
+#include "diff_entry.h"
 #include "json_writer.h"
+#include "metrics.h"
+#include "path_filter.h"
+#include "path_trie.h"
+#include "record_arena.h"
+#include "snapdiff_bin.h"
+#include "snapdiff_file.h"
+#include "stat_engine.h"
+#include "work_queue.h"
 
 #define BUFSIZE (16<<10)
+#define MIN_READ_BLOCK_SIZE (16<<10)
+#define DEFAULT_READ_BLOCK_SIZE (4<<20)
 #define MAX_RETRIES 10
+#define DEFAULT_PREFETCH_PAGES 4
+#define DEFAULT_BUCKET_MEMORY_LIMIT (256ULL<<20)
+#define DEFAULT_JSON_THREADS 4
+#define DEFAULT_BUCKET_THREADS 4
+#define DEFAULT_JSON_CHUNK_SIZE 1000
+#define DEFAULT_STAT_THREADS 16
+#define STAT_IN_FLIGHT_PER_THREAD 4
+#define ENTRY_BATCH_SIZE 1000
+#define DEFAULT_SHARDS 16
+#define MAX_SHARDS 256
+
+// Staging directory VDFS renames entries through when ordering requires
+#define VDFS_STAGING_DIR ".vdfs"
+// Level of the renames VDFS does not stage, raw level 0
+#define DIRECT_RENAME_LEVEL 513
 
 using namespace std;
 
 #define LOG_INFO   logFile << GetTime() << " INFO: "
 #define LOG_ERROR  logFile << GetTime() << " ERROR: "
 
-typedef map <int, fstream*> BucketFileMap;
+/*
+ * Number of diff entries by op, as in the diff, and by level. Ops are few,
+ * so they are kept in a short list searched linearly. filtered counts the
+ * entries dropped by the path filter, which are not in the others.
+ */
+struct EntryCounts {
+   unsigned long long                      total = 0;
+   unsigned long long                      filtered = 0;
+   vector<pair<string, unsigned long long>> byOp;
+   map<int, unsigned long long>            byLevel;
+};
+
+/*
+ * Metrics of a diff run, written to metrics.json and metrics.prom in the
+ * result directory. The atomic counters are also updated from the reader
+ * and stat threads.
+ */
+struct DiffMetrics {
+   vector<StageTime>               stages;
+   atomic<unsigned long long>      pagesRead{0};
+   atomic<unsigned long long>      bytesRead{0};
+   atomic<unsigned long long>      openRetries{0};
+   atomic<unsigned long long>      readRetries{0};
+   map<string, unsigned long long> bytesWritten;
+   EntryCounts                     entries;
+   LatencyHistogram                pageOpens;
+   LatencyHistogram                stats;
+   ArenaCounters                   arenas;
+};
+
+/*
+ * Diffs of one level, kept in memory until the bucket store exceeds its
+ * memory limit. Spilled diffs are appended to spillFile, which is the
+ * parallel_diff/<level> output itself when that is requested.
+ */
+struct DiffBucket {
+   RecordArena        records;
+   string             spillFile;
+   bool               spilled = false;
+   unsigned long long spilledBytes = 0;
+};
+
+/*
+ * Level buckets of a diff. bucketsDir is the parallel_diff directory, or
+ * empty if it is not an output, in which case buckets spill to temporary
+ * files in spillDir.
+ */
+struct BucketStore {
+   map<int, DiffBucket> buckets;
+   string               bucketsDir;
+   string               spillDir;
+   bool                 spillDirCreated = false;
+   size_t               memBytes = 0;
+   size_t               memLimit = 0;
+   EntryCounts          counts;
+   PathFilter           filter;   // entries it does not select are dropped
+   bool                 compress = false;   // of raw pages and bucket files
+   ArenaCounters       *arenaCounters = nullptr;   // of the page arenas
+};
+
+/*
+ * Diff entries of one snapdiff page by level, as runs of '\n' terminated
+ * lines in arena, which owns all bytes of the page and is released with
+ * it. A level only seen in the EOB/EOF line has an empty run.
+ */
+struct PageFragments {
+   bool                ok = false;
+   string              log;
+   map<int, DiffToken> levels;
+   EntryCounts         counts;
+   ScratchArena        arena;
+};
+
+/*
+ * Bucketization of pages on worker threads: pages are split into
+ * PageFragments in any order and merged into the store strictly in page
+ * order, which leaves every bucket exactly as sequential bucketization
+ * does. workers is declared last so it is joined first.
+ */
+struct PageBucketizer {
+   PageBucketizer(BucketStore& store, unsigned numThreads)
+      : store(store), nextPage(0), numPages(0),
+        workers(new WorkerPool(numThreads, 2 * numThreads))
+   {}
+
+   BucketStore&            store;
+   mutex                   doneMutex;
+   condition_variable      pageDone;
+   map<int, PageFragments> done;
+   int                     nextPage;
+   int                     numPages;
+   unique_ptr<WorkerPool>  workers;
+};
+
+// Called for every complete snapdiff page, which it may move from
+typedef function<bool(string& page, int pageNum)> PageHandler;
+
+/*
+ * Position of the sequential snapdiff read: the cookie of the next page to
+ * open and the read retries spent so far. blockSize is the largest read
+ * issued, lowered whenever a read fails. Open latencies, retries and bytes
+ * read are counted in metrics, if set.
+ */
+struct RawDiffReader {
+   string       snapDir;
+   string       snap1;
+   string       snap2;
+   string       startPoint = "0";
+   bool         eof = false;
+   int          numRetryReads = 0;
+   size_t       blockSize = DEFAULT_READ_BLOCK_SIZE;
+   DiffMetrics *metrics = nullptr;
+};
+
+/*
+ * A snapdiff page as read from the snapdiff stream. complete is set if the
+ * page is terminated by EOB/EOF, nextCookie is the cookie to continue the
+ * diff from after it and log holds the messages logged while reading it.
+ */
+struct RawDiffPage {
+   string data;
+   string nextCookie;
+   string log;
+   bool   complete = false;
+   bool   failed = false;
+};
+
+/*
+ * Progress of a resumable diff, kept in <resultDir>/checkpoint: the number
+ * of snapdiff pages saved in raw/, the cookie of the page following them
+ * and the stages finished. id identifies the diff and the options it is
+ * run with, a checkpoint is only resumed by the same diff.
+ */
+#define CHECKPOINT_VERSION       1
+#define CHECKPOINT_STAGE_RAW     "raw"
+#define CHECKPOINT_STAGE_SERIAL  "serialized"
+#define CHECKPOINT_STAGE_JSON    "json"
+
+struct DiffCheckpoint {
+   string      fileName;
+   string      id;
+   int         pages = 0;
+   string      cookie = "0";
+   set<string> stages;
+};
+
+/*
+ * A rename staged through the .vdfs directory: from -> .vdfs/<n> at
+ * srcLevel and .vdfs/<n> -> to at dstLevel, as found in srcLine and
+ * dstLine. A chain that does not consist of exactly these two renames is
+ * pinned and left alone. Entries related to from or to, i.e. on the paths
+ * themselves, their ancestors or below them, narrow the levels the chain
+ * can be collapsed to to (lo, hi); deps are the relations to the halves
+ * of other chains, whose levels change as those are collapsed. level is
+ * the level of the collapsed rename, -1 if not collapsed.
+ */
+struct StagedRename {
+   struct Dep {
+      int  side;     // 0 if related to from, 1 if to
+      int  chain;
+      int  half;     // 0 if the source half of chain, 1 the destination
+   };
+
+   string      op;
+   string      from;
+   string      to;
+   string      srcLine;
+   string      dstLine;
+   int         srcLevel = -1;
+   int         dstLevel = -1;
+   int         numSrc = 0;
+   int         numDst = 0;
+   bool        pinned = false;
+   int         lo = 0;
+   int         hi = 0;
+   vector<Dep> deps;
+   int         level = -1;
+};
+
+/*
+ * An entry touching the .vdfs staging directory, which a path filter lets
+ * through as it is parsed, and filtered, the entry it leaves once the
+ * chain of the stage is known: line itself, a rewrite, or empty if the
+ * entry is dropped. See FilterStagedEntries.
+ */
+struct StagedEntry {
+   int    level;
+   string line;
+   string filtered;
+};
+
+/*
+ * NDJSON output: the records of each chunk are formatted separately and
+ * appended in chunk order, chunks finished out of order wait in pending.
+ * The output is serialized_json/diff.ndjson, or with a segment limit
+ * serialized_json/0.ndjson, 1.ndjson, ... each ending before the record
+ * that would take it past segmentLimit bytes. Compressed, the records of
+ * each chunk are a frame of their own.
+ */
+struct NdjsonStream {
+   BufferedWriter     file;
+   bool               compress = false;
+   unsigned long long segmentLimit = 0;
+   unsigned long long segmentBytes = 0;
+   int                segmentCount = 0;
+   int                nextChunk = 0;
+   map<int, string>   pending;
+   mutex              streamMutex;
+};
+
+/*
+ * State of the json generation, diff items are collected into chunks of
+ * jsonChunkSize which are written to serialized_json/0.json, 1.json, ...
+ * or appended to the NDJSON stream, compressed into one frame each if
+ * compress is set. With more than one json thread the chunks are
+ * converted and written by a pool of workers, which keep their log output
+ * in chunkLogs until they are done. All of them share statEngine,
+ * declared first so that it outlives the workers. The scratch arenas of
+ * the chunks count into arenaCounters, if set.
+ */
+struct JsonChunkWriter {
+   JsonChunkWriter(const string& snapDir, const string& jsonDir,
+                   const SnapshotDiffOptions& opts, LatencyHistogram *statLatency,
+                   ArenaCounters *arenaCounters)
+      : snapDir(snapDir), jsonDir(jsonDir), chunkItems(0), jsonFileCount(0),
+        chunkSize(opts.jsonChunkSize > 0 ? opts.jsonChunkSize : DEFAULT_JSON_CHUNK_SIZE),
+        ndjson(opts.ndjson),
+        compress(opts.compress),
+        statEngine(new StatEngine(opts.statThreads,
+                                  STAT_IN_FLIGHT_PER_THREAD * opts.statThreads,
+                                  statLatency)),
+        arenaCounters(arenaCounters),
+        failed(false)
+   {
+      ndjsonStream.segmentLimit = opts.ndjsonSegmentSize;
+      ndjsonStream.compress = opts.compress;
+      if (opts.jsonThreads > 1) {
+         workers.reset(new WorkerPool(opts.jsonThreads, 2 * opts.jsonThreads));
+      }
+   }
+
+   string                 snapDir;
+   string                 jsonDir;
+   string                 chunk;
+   unsigned               chunkItems;
+   int                    jsonFileCount;
+   unsigned               chunkSize;
+   bool                   ndjson;
+   bool                   compress;
+   NdjsonStream           ndjsonStream;
+   unique_ptr<StatEngine> statEngine;
+   ArenaCounters         *arenaCounters;
+   unique_ptr<WorkerPool> workers;
+   mutex                  resultMutex;
+   map<int, string>       chunkLogs;
+   bool                   failed;
+};
+
+/*
+ * State of the serialized_diff.bin output, see snapdiff_bin.h
+ */
+struct BinaryDiffWriter {
+   string                   fileName;
+   string                   recordsFileName;
+   BufferedWriter           file;
+   BufferedWriter           records;
+   uint64_t                 stringsSize = 0;
+   uint64_t                 recordCount = 0;
+   vector<SnapDiffBinLevel> levels;
+};
+
+/*
+ * State of the dependency_dag output. Entries are numbered in serialized
+ * order. Paths are interned in paths, onPath holds by path node the
+ * entries of the last level that touched the path. An entry supersedes
+ * those on its path and below it, which it depends on, so only a frontier
+ * is kept: the nodes below a directory still holding entries are linked
+ * into the children lists of their parents, flagged in linked, and an
+ * entry on a node clears the onPath and children lists of everything
+ * below it. Each entry id is thus held once, by its own node, and the
+ * index grows with the paths and the unsuperseded entries, not with their
+ * depth; an entry on a directory depends on the nearest entries below it
+ * only. The entries of the level being written are only added once it is
+ * complete, as entries of one level never depend on each other.
+ */
+struct DiffDagWriter {
+   string                                    fileName;
+   BufferedWriter                            file;
+   int                                       level = 0;
+   unsigned long long                        nextId = 0;
+   PathTrie                                  paths;
+   vector<vector<unsigned long long>>        onPath;
+   vector<vector<PathNode>>                  children;
+   vector<unsigned char>                     linked;
+   vector<pair<PathNode, unsigned long long>> levelPaths;
+   vector<unsigned long long>                deps;
+   vector<PathNode>                          walk;
+};
+
+/*
+ * One directory of the shards output, with its serialized diff and the
+ * parallel_diff file of the level written last
+ */
+struct DiffShard {
+   string             dir;
+   BufferedWriter     serialFile{WRITER_SMALL_BUFSIZE};
+   BufferedWriter     levelFile{WRITER_SMALL_BUFSIZE};
+   int                level = -1;
+   unsigned long long entries = 0;
+};
+
+/*
+ * State of the shards output. An entry goes to the shard its first depth
+ * path components hash to. Entries no single shard can apply, renames
+ * between shards and directories above the shard depth, go to the cross
+ * shard, which is applied after all others, as does every later entry on,
+ * above or below a path the cross shard touched. Those paths are interned
+ * in crossPaths, crossFlags tells by node which of them and of their
+ * ancestors the cross shard touched; the paths of the level being written
+ * are only flagged once it is complete, as entries of one level never
+ * depend on each other.
+ */
+#define CROSS_PATH      0x1
+#define CROSS_ANCESTOR  0x2
+
+struct DiffShardWriter {
+   unsigned                      depth = 1;
+   vector<unique_ptr<DiffShard>> shards;    // the cross shard last
+   int                           level = 0;
+   PathTrie                      crossPaths;
+   vector<unsigned char>         crossFlags;
+   vector<PathNode>              levelPaths;
+};
+
+/*
+ * Frame of one level in a compressed serialized diff: its byte range in
+ * the file
+ */
+struct LevelFrame {
+   int                level;
+   unsigned long long offset;
+   unsigned long long length;
+};
+
+// serialized_diff.bin encodes ops like SnapshotDiffEntry
+static_assert(SNAPDIFF_BIN_ENTRY_SYM == SNAPDIFF_ENTRY_SYM &&
+              SNAPDIFF_BIN_OP_RENAME == SNAPDIFF_OP_RENAME &&
+              SNAPDIFF_BIN_FLAG_XATTR == SNAPDIFF_FLAG_XATTR,
+              "binary diff op encoding differs from snapshot_diff.h");
+
+// DiffEntry types and change bits are those of SnapshotDiffEntry
+static_assert(DIFF_TYPE_FILE == SNAPDIFF_ENTRY_FILE &&
+              DIFF_TYPE_DIR == SNAPDIFF_ENTRY_DIR &&
+              DIFF_TYPE_SYM == SNAPDIFF_ENTRY_SYM &&
+              DIFF_OP_CREATED == SNAPDIFF_FLAG_CREATED &&
+              DIFF_OP_MODIFIED == SNAPDIFF_FLAG_MODIFIED &&
+              DIFF_OP_STAT == SNAPDIFF_FLAG_STAT &&
+              DIFF_OP_XATTR == SNAPDIFF_FLAG_XATTR,
+              "diff entry op encoding differs from snapshot_diff.h");
+
+/*
+ * Delivery of typed entries to the callback of GetSnapshotDiffStream. With
+ * withStat, entries are collected into batches of ENTRY_BATCH_SIZE that
+ * are stat'ed together before they are delivered in order. The entries
+ * and stat paths of a batch live in arena until it is delivered.
+ */
+struct EntrySink {
+   EntrySink(const SnapshotDiffSink& sink, const string& snapDir,
+             unsigned statThreads, LatencyHistogram *statLatency,
+             ArenaCounters *arenaCounters)
+      : sink(sink), snapDir(snapDir), batchDelivery(0),
+        arena(ARENA_MIN_BLOCK, arenaCounters), aborted(false)
+   {
+      if (sink.withStat) {
+         statEngine.reset(new StatEngine(statThreads,
+                                         STAT_IN_FLIGHT_PER_THREAD * statThreads,
+                                         statLatency));
+      }
+   }
+
+   const SnapshotDiffSink& sink;
+   string                  snapDir;
+   unique_ptr<StatEngine>  statEngine;
+   string                  batch;
+   vector<int>             batchLevels;
+   unsigned                batchDelivery;
+   ScratchArena            arena;
+   string                  scratch;
+   bool                    aborted;
+};
+
+static bool AppendJsonDiffItem(JsonChunkWriter& jsonWriter,
+                               const DiffEntry& entry,
+                               ostream&         logFile);
 
 /*
  *------------------------------------------------------------------------
@@ -168,65 +600,40 @@ MkDir(const string& dirPath)
 /*
  *------------------------------------------------------------------------
  *
- * OpenStreamUnreliable --
+ * RmDir --
  *
- *     Open snapdiff stream based on given file name. There is a chance
- *     of snapdiff open failing due to buffer size issues. We can retry
- *     opening if this is the case.
+ *      Executes the system appropriate version of rmdir
  *
  * Results:
- *     0 on successful open, 1 on failure (exceeds maximum retry)
+ *      The return value of rmdir or _rmdir
  *
  * Side effects:
- *      snapDiffFile will contain file stream of snapdiff
+ *      None.
  *
  *------------------------------------------------------------------------
  */
 
 int
-OpenStreamUnreliable(ifstream &snapDiffFile,
-                     const string snapDiffFileName,
-                     ofstream& logFile)
+RmDir(const string& dirPath)
 {
-   int numRetries = 0;
-
-   LOG_INFO << "Opening snapdiff stream: " + snapDiffFileName << endl;
-
-   do {
-      snapDiffFile.open(snapDiffFileName.c_str(), std::ifstream::in);
-
-      if (!snapDiffFile.is_open()) {
-         LOG_ERROR << "Snapshot diff not opened: " + snapDiffFileName << ", retrying...(" << numRetries << ")" << endl;
-         LOG_ERROR << "Operation returned " << strerror(errno) << endl;
-         if (errno != ENOENT) {
-            break;
-         }
-      } else {
-         break;
-      }
-   } while (numRetries++ < MAX_RETRIES);
-
-   if (!snapDiffFile.is_open()) {
-      LOG_ERROR << "Could not open snapshot diff: " + snapDiffFileName << endl;
-      LOG_ERROR << "Error: " << strerror(errno) << endl;
-      return 1;
-   }
-
-   return 0;
+#ifdef _WIN32
+   return _rmdir(dirPath.c_str());
+#elif __linux__
+   return rmdir(dirPath.c_str());
+#endif
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * ReadRawDiff --
+ * RemoveDir --
  *
- *      Reads all diff chunk/pages between two snapshots and places them in the
- *      raw directory. Diff pages are named into file 0, 1, 2, ... etc.
+ *      Removes a directory of output files, such as parallel_diff or
+ *      shards, with the files and directories in it
  *
  * Results:
- *      On success: the number of diff pages read
- *      On failure: -1
+ *      true if the directory is gone or never existed, false otherwise
  *
  * Side effects:
  *      None.
@@ -234,248 +641,238 @@ OpenStreamUnreliable(ifstream &snapDiffFile,
  *------------------------------------------------------------------------
  */
 
-int
-ReadRawDiff(const string& snapDir,
-            const string& snap1,
-            const string& snap2,
-            const string& rawDir,
-            ofstream&     logFile)
+static bool
+RemoveDir(const string& dirPath)
 {
-   bool eof = false;
-   int readNum = 0;
-   string startPoint = "0";
-   string buf;
-   buf.resize(BUFSIZE);
-   int numRetryReads = 0;
-
-   while (!eof) {
-      string diffLine;
-
-#ifdef _WIN32
-      const string diffFileName = snapDir + ":snapdiff." + snap1 + "^"
-         + snap2 + "^" + startPoint;
-#elif __linux__
-      const string diffFileName = snapDir + separator + snap1 + "^"
-         + snap2 + "^" + startPoint;
-#endif
-
-      ifstream snapDiffFile;
-
-      if (OpenStreamUnreliable(snapDiffFile, diffFileName, logFile) == 1) {
-         return -1;
-      }
-
-      // Store snapshot diff data on local system.
-      auto localFileName = rawDir + separator + to_string(readNum);
-
-      fstream localFile{localFileName,
-         fstream::in | fstream::out | fstream::trunc};
-      if (!localFile.is_open()) {
-         LOG_ERROR << "Could not open file: " + localFileName << endl;
-         return -1;
-      }
-
-      LOG_INFO << "Saving raw chunk in file: " + localFileName << endl;
-      LOG_INFO << "Reading snapdiff: " + diffFileName << endl;
-
-      int nread;
-      bool statusBad;
-
-      do {
-         snapDiffFile.read(&buf[0], BUFSIZE);
-         if ((statusBad = snapDiffFile.bad())) {
-            break;
-         }
-         nread = snapDiffFile.gcount();
-         localFile.write(buf.c_str(), nread);
-      } while(nread > 0);
+   DIR *dir = opendir(dirPath.c_str());
+   struct dirent *dp;
 
-      snapDiffFile.close();
+   if (dir == NULL) {
+      return !IsDir(dirPath);
+   }
 
-      /** There is a chance of snapdiff read failing due to buffer size
-      issues. We can retry open and read if this is the case. **/
-      if (statusBad) {
-         if (numRetryReads == MAX_RETRIES) {
-            LOG_ERROR << "Read snapdiff failed: exceeded maximum retries." << endl;
-            return -1;
-         };
-         LOG_ERROR << "Reading snapdiff stream returned bad: " << diffFileName
-               << ", reopening and retrying...(" << numRetryReads << ")" << endl;
+   while ((dp = readdir(dir)) != NULL) {
+      string name = dp->d_name;
 
-         ++numRetryReads;
+      if (name == "." || name == "..") {
          continue;
       }
-
-      localFile.seekg(0, fstream::beg);
-
-      while (getline(localFile, diffLine, '\n')) {
-         istringstream lineStream{diffLine};
-         string s;
-         string currCookie;
-
-         for (int i = 0; i < 3; ++i) {
-            currCookie = s;
-            lineStream >> s;
-         }
-
-         if (s == "EOB") {
-            localFile.close();
-            ++readNum;
-         } else if (s == "EOF") {
-            localFile.close();
-            ++readNum;
-            eof = true;
-         } else {
-            startPoint = currCookie;
-         }
-      }
-
-      if (!localFile.eof()) {
-         LOG_ERROR << "Error reading file: " + localFileName << endl;
-         return -1;
+      if (IsDir(dirPath + separator + name)) {
+         RemoveDir(dirPath + separator + name);
+      } else {
+         remove((dirPath + separator + name).c_str());
       }
    }
+   closedir(dir);
 
-   return readNum;
+   return RmDir(dirPath) == 0;
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * BucketizeDiff --
+ * ReplaceFile --
  *
- *      Creates buckets folder inside result directory and organizes raw diffs
- *      into buckets
+ *      Renames a completely written temporary file over fileName, so that
+ *      readers see either the old or the new contents
  *
  * Results:
- *      Return true if successful, false otherwise
+ *      Returns true if successful, false otherwise
  *
  * Side effects:
- *      Buckets contains open fstream pointers to a file for each bucket
+ *      None.
  *
  *------------------------------------------------------------------------
  */
 
 static bool
-BucketizeDiff(BucketFileMap& buckets,
-              const string&  rawDir,
-              int            readNum,
-              const string&  resultDir,
-              ofstream&      logFile)
+ReplaceFile(const string& tmpFileName,
+            const string& fileName,
+            ostream&      logFile)
 {
-   string bucketsDir = resultDir + "/parallel_diff";
-   int status = MkDir(bucketsDir.c_str());
-
-   if (status != 0) {
-      LOG_ERROR << "Unable to create directory: " + bucketsDir << endl;
+#ifdef _WIN32
+   // rename() does not replace an existing file on Windows
+   remove(fileName.c_str());
+#endif
+   if (rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+      LOG_ERROR << "Could not rename " + tmpFileName + " to " + fileName
+                << ": " << strerror(errno) << endl;
       return false;
    }
+   return true;
+}
 
-   for (int fileNum = 0; fileNum < readNum; ++fileNum) {
-      string curFileName = rawDir + separator + to_string(fileNum);
-      ifstream curFile{curFileName};
-      string diffLine;
-
-      if (!curFile.is_open()) {
-         LOG_ERROR << "Could not open file: " + curFileName << endl;
-         return false;
-      }
 
-      LOG_INFO << "Bucketizing diff from raw file: " + curFileName << endl;
+/*
+ *------------------------------------------------------------------------
+ *
+ * OutputFileName --
+ *
+ *      Name of an output file, with the suffix of the codec if compressed
+ *
+ * Results:
+ *      The file name
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
 
-      while (getline(curFile, diffLine, '\n')) {
-         istringstream lineStream{diffLine};
-         string s;
-         int level;
+static string
+OutputFileName(const string& fileName,
+               bool          compress)
+{
+   return compress ? fileName + COMPRESSED_SUFFIX : fileName;
+}
 
-         // Normalize level to positive value
-         lineStream >> s;
-         level = stoi(s) + 513;
-         // Seek past level and objId (omit these from final output)
-         lineStream >> s;
 
-         if (!buckets.count(level)) {
-            auto bucketName = bucketsDir + separator + to_string(level);
-            auto openFlags = fstream::in | fstream::out | fstream::trunc;
-            auto curBucketFile = std::make_unique<fstream>(bucketName, openFlags);
+/*
+ *------------------------------------------------------------------------
+ *
+ * OpenInputFile --
+ *
+ *      Opens an output file for reading it back, decompressing it if its
+ *      name carries the suffix of the codec
+ *
+ * Results:
+ *      The input stream, NULL if the file could not be opened
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
 
-            if (!curBucketFile->is_open()) {
-               LOG_ERROR << "Could not open file: " + bucketName << endl;
-               return false;
-            }
+static unique_ptr<istream>
+OpenInputFile(const string& fileName)
+{
+   static const size_t suffixLen = sizeof(COMPRESSED_SUFFIX) - 1;
+   unique_ptr<istream> file;
 
-            LOG_INFO << "Writing to bucket file: " + bucketName << endl;
+   if (compressionSupported && fileName.size() > suffixLen &&
+       fileName.compare(fileName.size() - suffixLen, suffixLen, COMPRESSED_SUFFIX) == 0) {
+      unique_ptr<CompressedReader> reader{new CompressedReader(fileName)};
 
-            buckets[level] = curBucketFile.release();
-         }
+      if (reader->is_open()) {
+         file = std::move(reader);
+      }
+   } else {
+      unique_ptr<ifstream> reader{new ifstream(fileName)};
 
-         // Write remainder of line to bucket file, omit EOB and EOF
-         ostringstream outputLine;
-         lineStream >> s;
-         outputLine << s;
+      if (reader->is_open()) {
+         file = std::move(reader);
+      }
+   }
+   return file;
+}
 
-         while (lineStream >> s) {
-            outputLine << "\t" << s;
-         }
 
-         auto str = outputLine.str();
-         if (str != "EOB" && str != "EOF") {
-            *buckets[level] << str << endl;
-         } else {
-            // Ignore any data after EOB/EOF.
-            curFile.seekg(0, fstream::end);
-         }
-      }
+/*
+ *------------------------------------------------------------------------
+ *
+ * CheckpointId --
+ *
+ *      Identifies a diff and the options affecting its outputs, so that a
+ *      checkpoint is not resumed by a different one
+ *
+ * Results:
+ *      The id, one line
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
 
-      if (!curFile.eof()) {
-         LOG_ERROR << "Error reading file: " + curFileName << endl;
-      }
+static string
+CheckpointId(const string&              snapDir,
+             const string&              snap1,
+             const string&              snap2,
+             const SnapshotDiffOptions& opts)
+{
+   ostringstream id;
+
+   id << snapDir << '^' << snap1 << '^' << snap2
+      << " streaming=" << opts.streaming
+      << " outputs=" << opts.outputs
+      << " jsonChunkSize=" << opts.jsonChunkSize
+      << " ndjson=" << opts.ndjson
+      << " ndjsonSegmentSize=" << opts.ndjsonSegmentSize
+      << " compactRenames=" << opts.compactRenames
+      << " numShards=" << opts.numShards
+      << " shardDepth=" << opts.shardDepth
+      << " compress=" << opts.compress;
+   for (const char *const *rule = opts.includePaths; rule != NULL && *rule != NULL; ++rule) {
+      id << " include=" << *rule;
    }
-   return true;
+   for (const char *const *rule = opts.excludePaths; rule != NULL && *rule != NULL; ++rule) {
+      id << " exclude=" << *rule;
+   }
+   return id.str();
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * SerializeBuckets --
+ * LoadCheckpoint --
+ *
+ *      Reads the checkpoint of an interrupted diff. The file holds one
+ *      "key value" pair per line:
  *
- *      Places diffs in topological order into a single file
+ *         version 1
+ *         id <snapDir>^<snap1>^<snap2> <options>
+ *         pages <pages saved in raw/>
+ *         cookie <cookie of the next page>
+ *         stage <finished stage>         (repeated)
  *
  * Results:
  *      Returns true if successful, false otherwise
  *
  * Side effects:
- *      All file pointers in Buckets will be closed, freed, and deleted
+ *      None.
  *
  *------------------------------------------------------------------------
  */
 
 static bool
-SerializeBuckets(BucketFileMap *buckets,
-                 const string&  resultDir,
-                 ofstream&      logFile)
+LoadCheckpoint(DiffCheckpoint& checkpoint,
+               ostream&        logFile)
 {
-   string serialDiffFileName = resultDir + separator + "serialized_diff";
-   ofstream SerialDiffFile{serialDiffFileName};
+   ifstream file{checkpoint.fileName};
+   string line;
+   int version = 0;
 
-   if (!SerialDiffFile.is_open()) {
-      LOG_ERROR << "Could not open file: " + serialDiffFileName << endl;
+   if (!file.is_open()) {
+      LOG_ERROR << "Could not open file: " + checkpoint.fileName << endl;
       return false;
    }
 
-   LOG_INFO << "Writing to serialized diff file: " + serialDiffFileName << endl;
-
-   for (auto itr = buckets->begin(); itr != buckets->end(); ++itr) {
-      itr->second->seekg(0, fstream::beg);
-      SerialDiffFile << itr->second->rdbuf();
-      itr->second->close();
-      delete itr->second;
-      itr->second = nullptr;
+   while (getline(file, line)) {
+      size_t sep = line.find(' ');
+      string key = line.substr(0, sep);
+      string value = sep == string::npos ? string() : line.substr(sep + 1);
+
+      if (key == "version") {
+         version = atoi(value.c_str());
+      } else if (key == "id") {
+         checkpoint.id = value;
+      } else if (key == "pages") {
+         checkpoint.pages = atoi(value.c_str());
+      } else if (key == "cookie") {
+         checkpoint.cookie = value;
+      } else if (key == "stage") {
+         checkpoint.stages.insert(value);
+      }
    }
 
-   SerialDiffFile.close();
+   if (version != CHECKPOINT_VERSION || checkpoint.pages < 0 ||
+       checkpoint.cookie.empty()) {
+      LOG_ERROR << "Invalid checkpoint: " + checkpoint.fileName << endl;
+      return false;
+   }
    return true;
 }
 
@@ -483,13 +880,13 @@ SerializeBuckets(BucketFileMap *buckets,
 /*
  *------------------------------------------------------------------------
  *
- * MakeStatsJsonMap --
+ * SaveCheckpoint --
  *
- *      Appends JsonMap with basic stat information for a new fs entry.
+ *      Writes the checkpoint to a temporary file and renames it over the
+ *      previous one, so that an interruption leaves either of them
  *
  * Results:
- *      diffItem contains fields for atime, ctime, mtime, size, and path.
- *      Returns true if success, false otherwise
+ *      Returns true if successful, false otherwise
  *
  * Side effects:
  *      None.
@@ -498,207 +895,4969 @@ SerializeBuckets(BucketFileMap *buckets,
  */
 
 static bool
-MakeStatsJsonMap(JsonMap      *diffItem,
-                 const string& snapDir,
-                 const string& path)
+SaveCheckpoint(const DiffCheckpoint& checkpoint,
+               ostream&              logFile)
 {
-   string absPath = snapDir + "/../../" + path;
-   long long ansec, cnsec, mnsec;
-   time_t asec, csec, msec;
-#ifdef _WIN32
-   struct _stat s;
+   string tmpFileName = checkpoint.fileName + ".tmp";
+   BufferedWriter file{WRITER_SMALL_BUFSIZE};
 
-	if (_stat(absPath.c_str(), &s) == 0) {
-      asec = s.st_atime;
-      csec = s.st_ctime;
-      msec = s.st_mtime;
-   } else {
+   if (!file.Open(tmpFileName)) {
+      LOG_ERROR << "Could not open file: " + tmpFileName << endl;
       return false;
    }
 
-   // Windows doesn't report time in nanoseconds,
-   // so all nsec fields are set to 0 for Windows
-   ansec = 0;
-   cnsec = 0;
-   mnsec = 0;
-#else
-   struct stat s;
+   file << "version " << CHECKPOINT_VERSION << '\n'
+        << "id " << checkpoint.id << '\n'
+        << "pages " << checkpoint.pages << '\n'
+        << "cookie " << checkpoint.cookie << '\n';
+   for (const string& stage : checkpoint.stages) {
+      file << "stage " << stage << '\n';
+   }
 
-   if (lstat(absPath.c_str(), &s) == 0) {
-      ansec = s.st_atim.tv_nsec;
-      asec = s.st_atim.tv_sec;
-      cnsec = s.st_ctim.tv_nsec;
-      csec = s.st_ctim.tv_sec;
-      mnsec = s.st_mtim.tv_nsec;
-      msec = s.st_mtim.tv_sec;
-   } else {
+   if (!file.Close()) {
+      LOG_ERROR << "Error writing file: " + tmpFileName << endl;
       return false;
    }
-#endif /* _WIN32 */
-   auto atime = std::make_unique<JsonMap>();
-   auto ctime = std::make_unique<JsonMap>();
-   auto mtime = std::make_unique<JsonMap>();
-
-   atime->Add("nsec", new JsonNumber(ansec));
-   atime->Add("sec", new JsonNumber(asec));
-   ctime->Add("nsec", new JsonNumber(cnsec));
-   ctime->Add("sec", new JsonNumber(csec));
-   mtime->Add("nsec", new JsonNumber(mnsec));
-   mtime->Add("sec", new JsonNumber(msec));
-
-   diffItem->Add("size", new JsonNumber(s.st_size));
-   diffItem->Add("atime", atime.release());
-   diffItem->Add("ctime", ctime.release());
-   diffItem->Add("mtime", mtime.release());
-   diffItem->Add("path", new JsonString(path));
 
-   return true;
+   return ReplaceFile(tmpFileName, checkpoint.fileName, logFile);
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * GenerateJSON --
+ * FinishStage --
  *
- *      Emits serialized diff in JSON format
+ *      Records a finished stage in the checkpoint, if any
  *
  * Results:
  *      Returns true if successful, false otherwise
  *
  * Side effects:
- *      Emits JSON file
+ *      None.
  *
  *------------------------------------------------------------------------
  */
 
 static bool
-GenerateJSON(const string&  snapDir,
-             const string&  jsonDir,
-             const string&  resultDir,
-             ofstream&      logFile)
+FinishStage(DiffCheckpoint *checkpoint,
+            const char     *stage,
+            ostream&        logFile)
 {
-   string serialFileName = resultDir + separator + "serialized_diff";
-   ifstream serialFile{serialFileName};
-   string diffLine;
-
-   if (!serialFile.is_open()) {
-      LOG_ERROR << "Could not open file: " + serialFileName << endl;
-      return false;
+   if (checkpoint == nullptr) {
+      return true;
    }
+   checkpoint->stages.insert(stage);
+   return SaveCheckpoint(*checkpoint, logFile);
+}
 
-   LOG_INFO << "JSONizing diffs from: " + serialFileName << endl;
-
-   int jsonFileCount = 0;
-   bool done = false;
 
-   while(!done) {
-      JsonArray diffItems;
+/*
+ *------------------------------------------------------------------------
+ *
+ * PrepareResume --
+ *
+ *      Removes the outputs of the stages the checkpoint does not record as
+ *      finished, as they may be incomplete. The raw pages are kept, the
+ *      read continues after the ones recorded.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Output files in resultDir removed
+ *
+ *------------------------------------------------------------------------
+ */
 
-      while (diffItems.size() < 1000) {
-         // When number of json items reaches 1000, write to json file
-         // to prevent file size from becoming too large. Open the next
-         // json file for writing.
-         if (!getline(serialFile, diffLine, '\n')) {
-            done = true;
+static bool
+PrepareResume(const DiffCheckpoint& checkpoint,
+              const string&         resultDir,
+              ostream&              logFile)
+{
+   vector<string> dirs;
+   vector<string> files;
+
+   if (checkpoint.stages.count(CHECKPOINT_STAGE_SERIAL) == 0) {
+      dirs.push_back(resultDir + separator + "parallel_diff");
+      dirs.push_back(resultDir + separator + "bucket_spill");
+      dirs.push_back(resultDir + separator + "shards");
+      files.push_back(resultDir + separator + "serialized_diff");
+      files.push_back(resultDir + separator + "serialized_diff" COMPRESSED_SUFFIX);
+      files.push_back(resultDir + separator + "serialized_diff" COMPRESSED_SUFFIX ".levels");
+      files.push_back(resultDir + separator + "serialized_diff.bin");
+      files.push_back(resultDir + separator + "serialized_diff.bin.records");
+   }
+   if (checkpoint.stages.count(CHECKPOINT_STAGE_JSON) == 0) {
+      dirs.push_back(resultDir + separator + "serialized_json");
+   }
+
+   for (const string& dir : dirs) {
+      if (!RemoveDir(dir)) {
+         LOG_ERROR << "Unable to remove directory: " + dir << endl;
+         return false;
+      }
+   }
+   for (const string& file : files) {
+      remove(file.c_str());
+   }
+
+   LOG_INFO << "Resuming after " << checkpoint.pages << " pages at cookie "
+            << checkpoint.cookie << endl;
+   return true;
+}
+
+
+/*
+ * Opens the snapdiff file of a page. The stage benchmarks in bench/ point
+ * it to a local stand-in for the snapdiff files of VDFS.
+ */
+static unique_ptr<SnapDiffFile> (*snapDiffOpen)(const string&) = OpenFdSnapDiffFile;
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * OpenStreamUnreliable --
+ *
+ *     Open snapdiff stream based on given file name. There is a chance
+ *     of snapdiff open failing due to buffer size issues. We can retry
+ *     opening if this is the case.
+ *
+ * Results:
+ *     0 on successful open, 1 on failure (exceeds maximum retry)
+ *
+ * Side effects:
+ *      snapDiffFile will contain file stream of snapdiff. Open latencies
+ *      and retries are counted in metrics, if set.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+OpenStreamUnreliable(unique_ptr<SnapDiffFile>& snapDiffFile,
+                     const string snapDiffFileName,
+                     DiffMetrics *metrics,
+                     ostream& logFile)
+{
+   int numRetries = 0;
+
+   LOG_INFO << "Opening snapdiff stream: " + snapDiffFileName << endl;
+
+   do {
+      {
+         LatencyTimer timer(metrics != nullptr ? &metrics->pageOpens : nullptr);
+
+         snapDiffFile = snapDiffOpen(snapDiffFileName);
+      }
+
+      if (!snapDiffFile) {
+         LOG_ERROR << "Snapshot diff not opened: " + snapDiffFileName << ", retrying...(" << numRetries << ")" << endl;
+         LOG_ERROR << "Operation returned " << strerror(errno) << endl;
+         if (errno != ENOENT) {
+            break;
+         }
+      } else {
+         break;
+      }
+   } while (numRetries++ < MAX_RETRIES);
+
+   if (metrics != nullptr) {
+      metrics->openRetries += min(numRetries, MAX_RETRIES);
+   }
+
+   if (!snapDiffFile) {
+      LOG_ERROR << "Could not open snapshot diff: " + snapDiffFileName << endl;
+      LOG_ERROR << "Error: " << strerror(errno) << endl;
+      return 1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ParsePageCookie --
+ *
+ *      Scans a snapdiff page for the cookie to resume the diff from and for
+ *      the EOB/EOF marker terminating the page.
+ *
+ * Results:
+ *      true if the page is terminated by EOB or EOF, false otherwise
+ *
+ * Side effects:
+ *      startPoint is set to the cookie of the last entry in the page, eof
+ *      is set if the page is the last page of the diff.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+ParsePageCookie(const string& page,
+                string&       startPoint,
+                bool&         eof)
+{
+   const char *pos = page.data();
+   const char *end = pos + page.size();
+   DiffToken diffLine;
+
+   while (NextDiffLine(pos, end, diffLine)) {
+      RawDiffLine fields;
+
+      SplitRawDiffLine(diffLine, fields);
+      if (fields.numTokens == 0) {
+         continue;
+      }
+
+      // The cookie is the objId of the entry, the marker follows it
+      const DiffToken& marker = fields.numTokens > 2 ? fields.op :
+                                fields.numTokens > 1 ? fields.objId :
+                                                       fields.level;
+      if (marker == "EOB") {
+         return true;
+      } else if (marker == "EOF") {
+         eof = true;
+         return true;
+      } else {
+         startPoint = (fields.numTokens > 1 ? fields.objId : fields.level).Str();
+      }
+   }
+
+   return false;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ReadNextRawPage --
+ *
+ *      Reads the snapdiff page starting at the current cookie of reader and
+ *      advances reader to the next page. Log messages are collected in the
+ *      page so that reading can happen off the logging thread.
+ *
+ *      The page is read straight into page.data, sized up front if the
+ *      page reports its size. Otherwise the blocks start small and double
+ *      while reads fill them, up to reader.blockSize, so small pages do not
+ *      pay for large buffers. A failed read halves reader.blockSize for the
+ *      rest of the diff before the page is reopened, as VDFS fails reads of
+ *      buffers it cannot serve; once at the smallest block size further
+ *      failures are retried up to MAX_RETRIES times.
+ *
+ * Results:
+ *      true if successful, false otherwise
+ *
+ * Side effects:
+ *      reader is advanced past the page
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+ReadNextRawPage(RawDiffReader& reader,
+                RawDiffPage&   page)
+{
+   ostringstream logFile;
+
+   page.data.clear();
+   page.complete = false;
+
+   while (true) {
+#ifdef _WIN32
+      const string diffFileName = reader.snapDir + ":snapdiff." + reader.snap1
+         + "^" + reader.snap2 + "^" + reader.startPoint;
+#elif __linux__
+      const string diffFileName = reader.snapDir + separator + reader.snap1
+         + "^" + reader.snap2 + "^" + reader.startPoint;
+#endif
+
+      unique_ptr<SnapDiffFile> snapDiffFile;
+
+      if (OpenStreamUnreliable(snapDiffFile, diffFileName, reader.metrics,
+                               logFile) == 1) {
+         page.log = logFile.str();
+         return false;
+      }
+
+      /*
+       * After a bad read continue behind the data read so far instead of
+       * reading the whole page again, unless the file cannot seek.
+       */
+      if (!page.data.empty() && !snapDiffFile->Seek(page.data.size())) {
+         LOG_ERROR << "Could not seek snapdiff stream: " << diffFileName
+               << ", reading it from the start" << endl;
+         page.data.clear();
+      }
+
+      if (page.data.empty()) {
+         LOG_INFO << "Reading snapdiff: " + diffFileName << endl;
+      } else {
+         LOG_INFO << "Reading snapdiff: " + diffFileName << " from offset "
+                  << page.data.size() << endl;
+      }
+
+      // One extra block to see the end of the page
+      long long pageSize = snapDiffFile->Size();
+      size_t block = MIN_READ_BLOCK_SIZE;
+
+      if (pageSize > (long long)page.data.size()) {
+         block = pageSize - page.data.size() + MIN_READ_BLOCK_SIZE;
+         page.data.reserve(pageSize + MIN_READ_BLOCK_SIZE);
+      }
+
+      long long nread;
+      int readErr = 0;
+
+      while (true) {
+         size_t len = page.data.size();
+         size_t want = min(block, reader.blockSize);
+
+         page.data.resize(len + want);
+         nread = snapDiffFile->Read(&page.data[len], want);
+         page.data.resize(len + max(nread, 0LL));
+         if (nread <= 0) {
+            readErr = errno;
+            break;
+         }
+         if (reader.metrics != nullptr) {
+            reader.metrics->bytesRead += nread;
+         }
+         if ((size_t)nread == want) {
+            block = want * 2;
+         }
+      }
+
+      snapDiffFile.reset();
+
+      /** There is a chance of snapdiff read failing due to buffer size
+      issues. We can retry open and read if this is the case. **/
+      if (nread < 0) {
+         /*
+          * Retries with smaller blocks are bounded by the halving, only
+          * those at the smallest block size count against MAX_RETRIES.
+          */
+         if (reader.blockSize > MIN_READ_BLOCK_SIZE) {
+            reader.blockSize = max(reader.blockSize / 2, (size_t)MIN_READ_BLOCK_SIZE);
+         } else if (reader.numRetryReads == MAX_RETRIES) {
+            LOG_ERROR << "Read snapdiff failed: exceeded maximum retries." << endl;
+            page.log = logFile.str();
+            return false;
+         } else {
+            ++reader.numRetryReads;
+         }
+         LOG_ERROR << "Reading snapdiff stream returned " << strerror(readErr)
+               << ": " << diffFileName << ", reopening and retrying with "
+               << reader.blockSize << " byte blocks...("
+               << reader.numRetryReads << ")" << endl;
+
+         if (reader.metrics != nullptr) {
+            ++reader.metrics->readRetries;
+         }
+         continue;
+      }
+      break;
+   }
+
+   page.complete = ParsePageCookie(page.data, reader.startPoint, reader.eof);
+   page.nextCookie = reader.startPoint;
+   page.log = logFile.str();
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * PrefetchRawDiff --
+ *
+ *      Reader thread body: reads snapdiff pages ahead of the consumer,
+ *      opening the next page as soon as the cookie of the current one is
+ *      known, until EOF or until the queue is cancelled.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Pages are pushed to pageQueue, which is closed at the end
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+PrefetchRawDiff(RawDiffReader&             reader,
+                BoundedQueue<RawDiffPage>& pageQueue)
+{
+   while (!reader.eof) {
+      RawDiffPage page;
+      bool ok = ReadNextRawPage(reader, page);
+
+      page.failed = !ok;
+      if (!pageQueue.Push(std::move(page)) || !ok) {
+         break;
+      }
+   }
+   pageQueue.Close();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ReadRawDiff --
+ *
+ *      Reads all diff chunk/pages between two snapshots. If rawDir is not
+ *      empty the pages are placed in the raw directory, named into file
+ *      0, 1, 2, ... etc., compressed into one frame each if compress is
+ *      set. Every complete page is also handed to onPage, if set, as soon
+ *      as it has been read, and may be taken over by it. With
+ *      prefetchPages > 0 a reader thread keeps up to that many pages read
+ *      ahead of the processing. Reads are issued in blocks of at most
+ *      readBlockSize bytes. With a checkpoint the read continues after
+ *      the pages it records, and it is updated after every page saved.
+ *
+ * Results:
+ *      On success: the number of diff pages read
+ *      On failure: -1
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+ReadRawDiff(const string&      snapDir,
+            const string&      snap1,
+            const string&      snap2,
+            const string&      rawDir,
+            bool               compress,
+            unsigned           prefetchPages,
+            size_t             readBlockSize,
+            const PageHandler& onPage,
+            DiffCheckpoint    *checkpoint,
+            DiffMetrics       *metrics,
+            ostream&           logFile)
+{
+   RawDiffReader reader{snapDir, snap1, snap2};
+   BoundedQueue<RawDiffPage> pageQueue{prefetchPages};
+   thread prefetcher;
+   int readNum = 0;
+
+   reader.blockSize = max(readBlockSize, (size_t)MIN_READ_BLOCK_SIZE);
+   reader.metrics = metrics;
+   if (checkpoint != nullptr) {
+      reader.startPoint = checkpoint->cookie;
+      readNum = checkpoint->pages;
+   }
+
+   if (prefetchPages > 0) {
+      prefetcher = thread(PrefetchRawDiff, std::ref(reader), std::ref(pageQueue));
+   }
+
+   while (true) {
+      RawDiffPage page;
+
+      if (prefetchPages > 0) {
+         if (!pageQueue.Pop(page)) {
+            break;
+         }
+      } else {
+         if (reader.eof) {
+            break;
+         }
+         page.failed = !ReadNextRawPage(reader, page);
+      }
+
+      logFile << page.log;
+      if (page.failed) {
+         readNum = -1;
+         break;
+      }
+      if (metrics != nullptr) {
+         ++metrics->pagesRead;
+      }
+
+      // Store snapshot diff data on local system.
+      if (!rawDir.empty()) {
+         auto localFileName = OutputFileName(rawDir + separator + to_string(readNum),
+                                             compress);
+         BufferedWriter localFile;
+
+         if (!(compress ? localFile.OpenCompressed(localFileName)
+                        : localFile.Open(localFileName))) {
+            LOG_ERROR << "Could not open file: " + localFileName << endl;
+            readNum = -1;
+            break;
+         }
+
+         LOG_INFO << "Saving raw chunk in file: " + localFileName << endl;
+         localFile.write(page.data.c_str(), page.data.size());
+
+         if (!localFile.Close()) {
+            LOG_ERROR << "Error writing file: " + localFileName << endl;
+            readNum = -1;
             break;
          }
+      }
+
+      if (page.complete) {
+         if (onPage && !onPage(page.data, readNum)) {
+            readNum = -1;
+            break;
+         }
+         ++readNum;
+
+         if (checkpoint != nullptr) {
+            checkpoint->pages = readNum;
+            checkpoint->cookie = page.nextCookie;
+            if (!SaveCheckpoint(*checkpoint, logFile)) {
+               readNum = -1;
+               break;
+            }
+         }
+      }
+   }
+
+   if (prefetcher.joinable()) {
+      pageQueue.Cancel();
+      prefetcher.join();
+   }
+
+   return readNum;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteBucketFile --
+ *
+ *      Appends the in-memory diffs of a bucket to its file in dir, which
+ *      the first write creates, even if there are no diffs to write. With
+ *      compress every append is a frame of its own. The diffs are kept in
+ *      memory.
+ *
+ * Results:
+ *      Return true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+WriteBucketFile(const string& dir,
+                int           level,
+                bool          compress,
+                DiffBucket&   bucket,
+                ostream&      logFile)
+{
+   if (!bucket.spilled) {
+      bucket.spillFile = OutputFileName(dir + separator + to_string(level), compress);
+   }
+
+   BufferedWriter spillFile{WRITER_SMALL_BUFSIZE};
+
+   if (!(compress ? spillFile.OpenCompressed(bucket.spillFile, bucket.spilled)
+                  : spillFile.Open(bucket.spillFile, bucket.spilled))) {
+      LOG_ERROR << "Could not open file: " + bucket.spillFile << endl;
+      return false;
+   }
+
+   if (!bucket.spilled) {
+      LOG_INFO << "Writing to bucket file: " + bucket.spillFile << endl;
+   }
+
+   bucket.records.ForEachBlock([&](const char *data, size_t len) {
+      return bool(spillFile.write(data, len));
+   });
+
+   if (!spillFile.Close()) {
+      LOG_ERROR << "Error writing file: " + bucket.spillFile << endl;
+      return false;
+   }
+
+   bucket.spilled = true;
+   bucket.spilledBytes += bucket.records.Size();
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SpillBucket --
+ *
+ *      Appends the in-memory diffs of a bucket to its file and releases
+ *      them. The first spill of a bucket creates the file, even if there
+ *      are no diffs to write.
+ *
+ * Results:
+ *      Return true if successful, false otherwise
+ *
+ * Side effects:
+ *      May create the spill directory
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+SpillBucket(BucketStore& store,
+            int          level,
+            DiffBucket&  bucket,
+            ostream&     logFile)
+{
+   if (store.bucketsDir.empty() && !store.spillDirCreated) {
+      if (MkDir(store.spillDir.c_str()) != 0) {
+         LOG_ERROR << "Unable to create directory: " + store.spillDir << endl;
+         return false;
+      }
+      store.spillDirCreated = true;
+   }
+
+   if (!WriteBucketFile(store.bucketsDir.empty() ? store.spillDir : store.bucketsDir,
+                        level, store.compress, bucket, logFile)) {
+      return false;
+   }
+
+   store.memBytes -= bucket.records.Size();
+   bucket.records.Clear();
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SpillBuckets --
+ *
+ *      Once the buckets hold more than the memory limit, spills the largest
+ *      ones until at most half of the limit is in use
+ *
+ * Results:
+ *      Return true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+SpillBuckets(BucketStore& store,
+             ostream&     logFile)
+{
+   if (store.memBytes <= store.memLimit) {
+      return true;
+   }
+
+   vector<pair<size_t, int>> bySize;
+
+   for (const auto& bucket : store.buckets) {
+      bySize.emplace_back(bucket.second.records.Size(), bucket.first);
+   }
+   sort(bySize.begin(), bySize.end(), greater<pair<size_t, int>>());
+
+   LOG_INFO << "Bucket memory limit exceeded (" << store.memBytes
+            << " bytes), spilling buckets" << endl;
+
+   for (const auto& entry : bySize) {
+      if (store.memBytes <= store.memLimit / 2 || entry.first == 0) {
+         break;
+      }
+      if (!SpillBucket(store, entry.second, store.buckets[entry.second], logFile)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * StagingName --
+ *
+ *      Returns if path is the .vdfs staging directory or below it. stage
+ *      is set to .vdfs, or to the .vdfs/<n> entry path is in.
+ *
+ * Results:
+ *      true if path is a staging path
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+StagingName(const DiffToken& path,
+            DiffToken&       stage)
+{
+   size_t dirLen = strlen(VDFS_STAGING_DIR);
+
+   if (path.len < dirLen || memcmp(path.data, VDFS_STAGING_DIR, dirLen) != 0 ||
+       (path.len > dirLen && path.data[dirLen] != '/')) {
+      return false;
+   }
+
+   const char *slash = path.len > dirLen + 1 ?
+      (const char *)memchr(path.data + dirLen + 1, '/', path.len - dirLen - 1) :
+      NULL;
+
+   stage.data = path.data;
+   stage.len = slash != NULL ? (size_t)(slash - path.data) : path.len;
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * TouchesStaging --
+ *
+ *      Returns if a diff entry is on the .vdfs staging directory or below
+ *      it, or renames something from or to there
+ *
+ * Results:
+ *      true if the entry touches .vdfs
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+TouchesStaging(const DiffEntry& entry)
+{
+   DiffToken stage;
+
+   return (entry.numTokens > 1 && StagingName(entry.path, stage)) ||
+          (entry.HasTwoPaths() && StagingName(entry.extra, stage));
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * RewriteFilteredRename --
+ *
+ *      Writes to rewritten the entry a rename from -> to with only one end
+ *      selected by a path filter becomes: a delete of from if that is the
+ *      selected end, else a creation of to. The children of a directory
+ *      renamed into the selection are not in the diff, so its creation
+ *      keeps from as extra, DIR_CMS to from, for consumers to copy the
+ *      whole subtree of to from the second snapshot. from is empty if
+ *      unknown.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+RewriteFilteredRename(const DiffEntry& entry,
+                      const DiffToken& from,
+                      const DiffToken& to,
+                      bool             fromSelected,
+                      string&          rewritten)
+{
+   const char *split = (const char *)memchr(entry.op.data, '_', entry.op.len);
+
+   rewritten.assign(entry.op.data, split != NULL ? split - entry.op.data : entry.op.len);
+   if (fromSelected) {
+      rewritten.append("_DELETE\t").append(from.data, from.len);
+   } else {
+      rewritten.append(entry.IsSym() ? "_CS\t" : "_CMS\t").append(to.data, to.len);
+      if (entry.IsDir() && !from.Empty()) {
+         rewritten.append(1, '\t').append(from.data, from.len);
+      }
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * FilterDiffEntry --
+ *
+ *      Applies filter to a diff entry. A rename with only one end
+ *      selected becomes a delete of its source or a creation of its
+ *      target, written to rewritten. Entries touching the .vdfs staging
+ *      directory are kept as they are, the real ends of a staged rename
+ *      are only known once both of its halves are read; they are filtered
+ *      by FilterStagedEntries then.
+ *
+ * Results:
+ *      Returns true if the entry, possibly rewritten, is kept
+ *
+ * Side effects:
+ *      entry may point to rewritten
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+FilterDiffEntry(const PathFilter& filter,
+                DiffEntry&        entry,
+                string&           rewritten)
+{
+   if (entry.numTokens < 2 || TouchesStaging(entry)) {
+      return true;
+   }
+
+   bool fromSelected = filter.Selects(entry.path.data, entry.path.len, entry.IsDir());
+
+   if (!entry.HasTwoPaths()) {
+      return fromSelected;
+   }
+
+   bool toSelected = filter.Selects(entry.extra.data, entry.extra.len, entry.IsDir());
+
+   if (fromSelected == toSelected) {
+      return fromSelected;
+   }
+
+   RewriteFilteredRename(entry, entry.path, entry.extra, fromSelected, rewritten);
+   ParseDiffEntry(DiffToken{rewritten.data(), rewritten.size()}, entry.level, entry);
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * FilterStagedEntries --
+ *
+ *      Applies filter to the entries touching .vdfs that FilterDiffEntry
+ *      let through, setting their filtered entries. A rename staged as
+ *      from -> .vdfs/<n> and .vdfs/<n> -> to is decided by its real ends:
+ *      both halves are kept if from and to are selected, the first becomes
+ *      a delete of from if only from is, the second a creation of to from
+ *      from if only to is. Halves of stages without exactly one of each
+ *      are decided by their own real end alone, the same way. Anything else
+ *      below .vdfs is kept with the stages it is in, .vdfs itself if any
+ *      staged entry is kept.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+FilterStagedEntries(const PathFilter&    filter,
+                    vector<StagedEntry>& staged)
+{
+   // Number of halves of the rename staged through each .vdfs/<n>
+   struct Chain {
+      int  numSrc = 0;
+      int  numDst = 0;
+      bool fromSelected = false;
+      bool toSelected = false;
+      DiffToken from;
+   };
+
+   enum { STAGED_OTHER, STAGED_SRC, STAGED_DST };
+
+   vector<DiffEntry> entries(staged.size());
+   vector<int> roles(staged.size(), STAGED_OTHER);
+   vector<string> stages(staged.size());
+   map<string, Chain> chains;
+   bool keepStagingDir = false;
+
+   auto selects = [&filter](const DiffEntry& entry, const DiffToken& path) {
+      return filter.Selects(path.data, path.len, entry.IsDir());
+   };
+
+   // Find the halves of the staged renames
+   for (size_t i = 0; i < staged.size(); ++i) {
+      DiffEntry& entry = entries[i];
+      DiffToken pathStage;
+      DiffToken extraStage;
+
+      ParseDiffEntry(DiffToken{staged[i].line.data(), staged[i].line.size()},
+                     staged[i].level, entry);
+      if (!entry.HasTwoPaths() || entry.numTokens != 3) {
+         continue;
+      }
+
+      // One end is a .vdfs/<n> itself, the other outside .vdfs
+      bool pathStaged = StagingName(entry.path, pathStage);
+      bool extraStaged = StagingName(entry.extra, extraStage);
+      const DiffToken& stage = pathStaged ? pathStage : extraStage;
+
+      if (pathStaged == extraStaged ||
+          stage.len != (pathStaged ? entry.path : entry.extra).len ||
+          stage.len <= strlen(VDFS_STAGING_DIR)) {
+         continue;
+      }
+
+      Chain& chain = chains[stage.Str()];
+
+      stages[i] = stage.Str();
+      if (pathStaged) {
+         roles[i] = STAGED_DST;
+         ++chain.numDst;
+         chain.toSelected = selects(entry, entry.extra);
+      } else {
+         roles[i] = STAGED_SRC;
+         ++chain.numSrc;
+         chain.fromSelected = selects(entry, entry.path);
+         chain.from = entry.path;
+      }
+   }
+
+   auto keepsStage = [&chains](const string& stage) {
+      auto chain = chains.find(stage);
+
+      return chain != chains.end() && chain->second.numSrc == 1 &&
+             chain->second.numDst == 1 && chain->second.fromSelected &&
+             chain->second.toSelected;
+   };
+
+   for (size_t i = 0; i < staged.size(); ++i) {
+      const DiffEntry& entry = entries[i];
+      StagedEntry& stagedEntry = staged[i];
+
+      stagedEntry.filtered.clear();
+      if (entry.numTokens == 2 && entry.path == VDFS_STAGING_DIR) {
+         continue;
+      }
+
+      if (roles[i] != STAGED_OTHER) {
+         bool fromSide = roles[i] == STAGED_SRC;
+
+         if (keepsStage(stages[i])) {
+            stagedEntry.filtered = stagedEntry.line;
+         } else if (fromSide && selects(entry, entry.path)) {
+            RewriteFilteredRename(entry, entry.path, entry.extra, true,
+                                  stagedEntry.filtered);
+         } else if (!fromSide && selects(entry, entry.extra)) {
+            // Created from the real source of the move, if there is one
+            const Chain& chain = chains[stages[i]];
+
+            RewriteFilteredRename(entry,
+                                  chain.numSrc == 1 ? chain.from : DiffToken(),
+                                  entry.extra, false, stagedEntry.filtered);
+         }
+      } else {
+         // Kept if all of its stages are, and its other path selected
+         bool kept = true;
+
+         for (int p = 0; p < (entry.HasTwoPaths() ? 2 : 1) && kept; ++p) {
+            const DiffToken& path = p == 0 ? entry.path : entry.extra;
+            DiffToken stage;
+
+            kept = StagingName(path, stage) ? keepsStage(stage.Str()) :
+                                              selects(entry, path);
+         }
+         if (kept) {
+            stagedEntry.filtered = stagedEntry.line;
+         }
+      }
+      keepStagingDir = keepStagingDir ||
+                       (!stagedEntry.filtered.empty() &&
+                        stagedEntry.filtered == stagedEntry.line);
+   }
+
+   // .vdfs itself
+   for (size_t i = 0; i < staged.size(); ++i) {
+      if (entries[i].numTokens == 2 && entries[i].path == VDFS_STAGING_DIR &&
+          keepStagingDir) {
+         staged[i].filtered = staged[i].line;
+      }
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ForEachPageEntry --
+ *
+ *      Walks the raw diff lines of one snapdiff page and calls
+ *      onEntry(entry, false) with the entry of each, its line being the
+ *      tab joined line without level and objId and its level normalized.
+ *      The EOB/EOF line ending the page is passed as onEntry(entry, true)
+ *      with just the level set.
+ *      Entries are passed through filter first, those it drops are only
+ *      counted in numFiltered, if set.
+ *
+ * Results:
+ *      Return true if successful, false on an invalid line or if onEntry
+ *      returns false
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+template <class F>
+static bool
+ForEachPageEntry(const string&       page,
+                 const string&       pageName,
+                 const PathFilter&   filter,
+                 F                   onEntry,
+                 unsigned long long *numFiltered,
+                 ostream&            logFile)
+{
+   const char *pos = page.data();
+   const char *end = pos + page.size();
+   DiffToken diffLine;
+   DiffEntry entry;
+   string joined;
+   string rewritten;
+
+   while (NextDiffLine(pos, end, diffLine)) {
+      RawDiffLine fields;
+      long long level;
+
+      SplitRawDiffLine(diffLine, fields);
+      if (fields.numTokens == 0) {
+         continue;
+      }
+
+      // The normalized level has to fit the int of the entry
+      if (!ParseDiffInt(fields.level, level) ||
+          level < numeric_limits<int>::min() ||
+          level > numeric_limits<int>::max() - 513) {
+         LOG_ERROR << "Invalid level in " << pageName << ": "
+                   << diffLine.Str() << endl;
+         return false;
+      }
+
+      // Normalize level to positive value
+      level += 513;
+
+      // Ignore any data after EOB/EOF.
+      if (fields.entry == "EOB" || fields.entry == "EOF") {
+         entry = DiffEntry();
+         entry.level = (int)level;
+         return onEntry(entry, true);
+      }
+
+      // Omit level and objId
+      DiffToken line = fields.entry;
+
+      if (!fields.entryIsTabJoined) {
+         joined.clear();
+         AppendTabJoined(fields.entry, joined);
+         line = DiffToken{joined.data(), joined.size()};
+      }
+      RawDiffEntry(fields, (int)level, line, entry);
+
+      if (!filter.Empty() && !FilterDiffEntry(filter, entry, rewritten)) {
+         if (numFiltered != nullptr) {
+            ++*numFiltered;
+         }
+         continue;
+      }
+
+      if (!onEntry(entry, false)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * CountDiffEntry --
+ *
+ *      Counts a diff entry by its op and its level
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+CountDiffEntry(EntryCounts&     counts,
+               const DiffEntry& entry)
+{
+   const DiffToken& op = entry.op;
+
+   ++counts.total;
+   ++counts.byLevel[entry.level];
+   for (auto& opCount : counts.byOp) {
+      if (opCount.first.size() == op.len &&
+          memcmp(opCount.first.data(), op.data, op.len) == 0) {
+         ++opCount.second;
+         return;
+      }
+   }
+   counts.byOp.emplace_back(op.Str(), 1);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * UncountDiffEntry --
+ *
+ *      Takes a diff entry counted by CountDiffEntry off the counts again
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+UncountDiffEntry(EntryCounts&     counts,
+                 const DiffEntry& entry)
+{
+   const DiffToken& op = entry.op;
+   auto levelCount = counts.byLevel.find(entry.level);
+
+   --counts.total;
+   if (levelCount != counts.byLevel.end() && --levelCount->second == 0) {
+      counts.byLevel.erase(levelCount);
+   }
+   for (auto opCount = counts.byOp.begin(); opCount != counts.byOp.end(); ++opCount) {
+      if (opCount->first.size() == op.len &&
+          memcmp(opCount->first.data(), op.data, op.len) == 0) {
+         if (--opCount->second == 0) {
+            counts.byOp.erase(opCount);
+         }
+         return;
+      }
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * MergeEntryCounts --
+ *
+ *      Adds the counts of from to counts
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+MergeEntryCounts(EntryCounts&       counts,
+                 const EntryCounts& from)
+{
+   counts.total += from.total;
+   counts.filtered += from.filtered;
+   for (const auto& levelCount : from.byLevel) {
+      counts.byLevel[levelCount.first] += levelCount.second;
+   }
+   for (const auto& fromOp : from.byOp) {
+      auto opCount = find_if(counts.byOp.begin(), counts.byOp.end(),
+                             [&fromOp](const pair<string, unsigned long long>& op) {
+                                return op.first == fromOp.first;
+                             });
+
+      if (opCount != counts.byOp.end()) {
+         opCount->second += fromOp.second;
+      } else {
+         counts.byOp.push_back(fromOp);
+      }
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * BucketizePage --
+ *
+ *      Organizes the raw diff lines of one snapdiff page selected by the
+ *      filter of the store into buckets by level. Buckets are created on
+ *      first use and kept in memory, up to the memory limit of the store.
+ *
+ * Results:
+ *      Return true if successful, false otherwise
+ *
+ * Side effects:
+ *      Buckets may be spilled to disk
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+BucketizePage(BucketStore&   store,
+              const string&  page,
+              const string&  pageName,
+              ostream&       logFile)
+{
+   auto addEntry = [&store](const DiffEntry& entry, bool endOfPage) {
+      // The EOB/EOF level still gets its (possibly empty) bucket
+      DiffBucket& bucket = store.buckets[entry.level];
+
+      if (!endOfPage) {
+         bucket.records.Append(entry.line.data, entry.line.len);
+         store.memBytes += entry.line.len + 1;
+         CountDiffEntry(store.counts, entry);
+      }
+      return true;
+   };
+
+   if (!ForEachPageEntry(page, pageName, store.filter, addEntry,
+                         &store.counts.filtered, logFile)) {
+      return false;
+   }
+   return SpillBuckets(store, logFile);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SplitPage --
+ *
+ *      Sorts the entries of one snapdiff page selected by filter into
+ *      page-local fragments by level. The entries are first listed in page
+ *      order, then copied into one run per level, all in the arena of the
+ *      fragments, so that a page costs a few allocations whatever its
+ *      number of entries. Runs on the bucketizer threads.
+ *
+ * Results:
+ *      fragments.ok tells if the page is valid, fragments.log holds the
+ *      log output
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+SplitPage(const string&     page,
+          const string&     pageName,
+          const PathFilter& filter,
+          ArenaCounters    *arenaCounters,
+          PageFragments&    fragments)
+{
+   struct PageEntry {
+      int       level;
+      DiffToken line;
+   };
+
+   ostringstream logFile;
+   size_t maxEntries = count(page.begin(), page.end(), '\n') + 1;
+
+   // Room for the list and the runs, which are no longer than the page
+   fragments.arena = ScratchArena{maxEntries * (sizeof(PageEntry) + 1) + page.size() +
+                                  ARENA_MIN_BLOCK, arenaCounters};
+
+   ScratchArena& arena = fragments.arena;
+   PageEntry *entries = arena.AllocArray<PageEntry>(maxEntries);
+   size_t numEntries = 0;
+
+   auto addEntry = [&](const DiffEntry& entry, bool endOfPage) {
+      DiffToken& run = fragments.levels[entry.level];
+
+      if (!endOfPage) {
+         DiffToken line = entry.line;
+
+         // Joined or rewritten lines are in buffers reused for the next one
+         if (line.data < page.data() || line.End() > page.data() + page.size()) {
+            char *copy = arena.Alloc(line.len);
+
+            memcpy(copy, line.data, line.len);
+            line.data = copy;
+         }
+         entries[numEntries++] = PageEntry{entry.level, line};
+         run.len += line.len + 1;
+         CountDiffEntry(fragments.counts, entry);
+      }
+      return true;
+   };
+
+   fragments.ok = ForEachPageEntry(page, pageName, filter, addEntry,
+                                   &fragments.counts.filtered, logFile);
+   fragments.log = logFile.str();
+   if (!fragments.ok) {
+      return;
+   }
+
+   for (auto& level : fragments.levels) {
+      level.second.data = level.second.len > 0 ? arena.Alloc(level.second.len) : nullptr;
+      level.second.len = 0;
+   }
+   for (size_t i = 0; i < numEntries; ++i) {
+      DiffToken& run = fragments.levels[entries[i].level];
+      char *end = const_cast<char *>(run.End());
+
+      memcpy(end, entries[i].line.data, entries[i].line.len);
+      end[entries[i].line.len] = '\n';
+      run.len += entries[i].line.len + 1;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ReadWholeFile --
+ *
+ *      Reads a local file into data
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+ReadWholeFile(const string& fileName,
+              string&       data,
+              ostream&      logFile)
+{
+   unique_ptr<istream> file = OpenInputFile(fileName);
+   ostringstream contents;
+
+   if (!file) {
+      LOG_ERROR << "Could not open file: " + fileName << endl;
+      return false;
+   }
+
+   // A corrupt compressed file sets badbit on file, not on contents
+   if ((file->peek() != EOF && !(contents << file->rdbuf())) || file->bad()) {
+      LOG_ERROR << "Error reading file: " + fileName << endl;
+      return false;
+   }
+   data = contents.str();
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SubmitPage --
+ *
+ *      Queues the next page for splitting on the bucketizer threads. The
+ *      page is either passed in, or if fileName is set read from that raw
+ *      file by the worker.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May block while the workers are busy
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+SubmitPage(PageBucketizer& bucketizer,
+           const string&   pageName,
+           const string&   fileName,
+           string&&        page)
+{
+   int pageNum = bucketizer.numPages++;
+
+   bucketizer.workers->Submit(
+      [&bucketizer, pageNum, pageName, fileName, page = std::move(page)]() mutable {
+         PageFragments fragments;
+
+         if (fileName.empty()) {
+            SplitPage(page, pageName, bucketizer.store.filter,
+                      bucketizer.store.arenaCounters, fragments);
+         } else {
+            ostringstream logFile;
+
+            LOG_INFO << "Bucketizing diff from raw file: " + fileName << endl;
+            if (ReadWholeFile(fileName, page, logFile)) {
+               SplitPage(page, pageName, bucketizer.store.filter,
+                         bucketizer.store.arenaCounters, fragments);
+            }
+            fragments.log = logFile.str() + fragments.log;
+         }
+
+         lock_guard<mutex> lock(bucketizer.doneMutex);
+         bucketizer.done[pageNum] = std::move(fragments);
+         bucketizer.pageDone.notify_all();
+      });
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * MergePages --
+ *
+ *      Appends the fragments of split pages to the buckets of the store,
+ *      in page order. Stops at the first page that is not split yet
+ *      unless wait is set, then all submitted pages are merged.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Buckets may be spilled to disk
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+MergePages(PageBucketizer& bucketizer,
+           bool            wait,
+           ostream&        logFile)
+{
+   BucketStore& store = bucketizer.store;
+
+   while (bucketizer.nextPage < bucketizer.numPages) {
+      PageFragments fragments;
+
+      {
+         unique_lock<mutex> lock(bucketizer.doneMutex);
+         auto ready = [&bucketizer] {
+            return bucketizer.done.count(bucketizer.nextPage) > 0;
+         };
+
+         if (wait) {
+            bucketizer.pageDone.wait(lock, ready);
+         } else if (!ready()) {
+            return true;
+         }
+         fragments = std::move(bucketizer.done[bucketizer.nextPage]);
+         bucketizer.done.erase(bucketizer.nextPage);
+      }
+      ++bucketizer.nextPage;
+
+      logFile << fragments.log;
+      if (!fragments.ok) {
+         return false;
+      }
+
+      for (const auto& fragment : fragments.levels) {
+         DiffBucket& bucket = store.buckets[fragment.first];
+
+         bucket.records.AppendRecords(fragment.second.data, fragment.second.len);
+         store.memBytes += fragment.second.len;
+      }
+      MergeEntryCounts(store.counts, fragments.counts);
+
+      if (!SpillBuckets(store, logFile)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * BucketizeDiff --
+ *
+ *      Creates buckets folder inside result directory and organizes raw diffs
+ *      into buckets
+ *
+ * Results:
+ *      Return true if successful, false otherwise
+ *
+ * Side effects:
+ *      store contains a bucket for each level
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+BucketizeDiff(BucketStore&   store,
+              const string&  rawDir,
+              int            readNum,
+              unsigned       numThreads,
+              ostream&       logFile)
+{
+   int status = MkDir(store.bucketsDir.c_str());
+
+   if (status != 0) {
+      LOG_ERROR << "Unable to create directory: " + store.bucketsDir << endl;
+      return false;
+   }
+
+   if (numThreads > 1) {
+      PageBucketizer bucketizer{store, numThreads};
+
+      for (int fileNum = 0; fileNum < readNum; ++fileNum) {
+         string curFileName = OutputFileName(rawDir + separator + to_string(fileNum),
+                                             store.compress);
+
+         SubmitPage(bucketizer, curFileName, curFileName, string());
+         if (!MergePages(bucketizer, false, logFile)) {
+            return false;
+         }
+      }
+      return MergePages(bucketizer, true, logFile);
+   }
+
+   for (int fileNum = 0; fileNum < readNum; ++fileNum) {
+      string curFileName = OutputFileName(rawDir + separator + to_string(fileNum),
+                                          store.compress);
+      string page;
+
+      LOG_INFO << "Bucketizing diff from raw file: " + curFileName << endl;
+
+      if (!ReadWholeFile(curFileName, page, logFile) ||
+          !BucketizePage(store, page, curFileName, logFile)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ReplayRawDiff --
+ *
+ *      Hands the pages saved in the raw directory by an interrupted diff
+ *      to onPage again, as ReadRawDiff did when reading them
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+ReplayRawDiff(const string&      rawDir,
+              bool               compress,
+              int                numPages,
+              const PageHandler& onPage,
+              ostream&           logFile)
+{
+   for (int pageNum = 0; pageNum < numPages; ++pageNum) {
+      string fileName = OutputFileName(rawDir + separator + to_string(pageNum), compress);
+      string page;
+
+      LOG_INFO << "Replaying raw file: " + fileName << endl;
+      if (!ReadWholeFile(fileName, page, logFile) || !onPage(page, pageNum)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * DiffItemNeedsStat --
+ *
+ *      Returns if the json diff item of an entry carries stat information,
+ *      which is the case for everything but deletes and renames
+ *
+ * Results:
+ *      true if the entry has to be stat'ed
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+DiffItemNeedsStat(const DiffEntry& entry)
+{
+   if (entry.IsDelete()) {
+      return false;
+   }
+   return entry.IsSym() || !entry.IsRename();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ClassifyDiffOp --
+ *
+ *      Maps the parsed op of an entry to its entry type, op kind and op
+ *      flags, see SNAPDIFF_ENTRY_*, SNAPDIFF_OP_* and SNAPDIFF_FLAG_*
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+ClassifyDiffOp(const DiffEntry& entry,
+               unsigned&        entryType,
+               unsigned&        opKind,
+               unsigned&        opFlags)
+{
+   entryType = entry.kind.type;
+   opFlags = 0;
+   if (entry.IsDelete()) {
+      opKind = SNAPDIFF_OP_DELETE;
+   } else if (entry.IsRename()) {
+      opKind = SNAPDIFF_OP_RENAME;
+   } else {
+      opKind = SNAPDIFF_OP_CHANGE;
+      opFlags = entry.kind.ops & DIFF_OP_CHANGE_MASK;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ForEachBucketLine --
+ *
+ *      Calls onLine(line) for the diffs of a bucket, first the spilled and
+ *      then the in-memory ones
+ *
+ * Results:
+ *      Returns true if successful, false on a read error or if onLine
+ *      returns false
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+template <class F>
+static bool
+ForEachBucketLine(const DiffBucket& bucket,
+                  F                 onLine,
+                  ostream&          logFile)
+{
+   if (bucket.spilled) {
+      unique_ptr<istream> bucketFile = OpenInputFile(bucket.spillFile);
+      string diffLine;
+
+      if (!bucketFile) {
+         LOG_ERROR << "Could not open file: " + bucket.spillFile << endl;
+         return false;
+      }
+      while (getline(*bucketFile, diffLine, '\n')) {
+         if (!onLine(DiffToken{diffLine.data(), diffLine.size()})) {
+            return false;
+         }
+      }
+      if (bucketFile->bad()) {
+         LOG_ERROR << "Error reading file: " + bucket.spillFile << endl;
+         return false;
+      }
+   }
+
+   return bucket.records.ForEachBlock([&onLine](const char *data, size_t len) {
+      const char *pos = data;
+      const char *end = data + len;
+      DiffToken diffLine;
+
+      while (NextDiffLine(pos, end, diffLine)) {
+         if (!onLine(diffLine)) {
+            return false;
+         }
+      }
+      return true;
+   });
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * RemoveBucketLines --
+ *
+ *      Removes one occurrence of each of lines from a bucket. The bucket is
+ *      read back into memory if it was spilled.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      The spill file of the bucket is removed
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+RemoveBucketLines(BucketStore&          store,
+                  DiffBucket&           bucket,
+                  const vector<string>& lines,
+                  ostream&              logFile)
+{
+   unordered_map<string, int> toRemove;
+   RecordArena kept;
+
+   for (const string& line : lines) {
+      ++toRemove[line];
+   }
+
+   auto keepLine = [&](const DiffToken& line) {
+      auto removed = toRemove.find(line.Str());
+
+      if (removed != toRemove.end() && removed->second > 0) {
+         --removed->second;
+      } else {
+         kept.Append(line.data, line.len);
+      }
+      return true;
+   };
+
+   if (!ForEachBucketLine(bucket, keepLine, logFile)) {
+      return false;
+   }
+
+   if (bucket.spilled) {
+      if (remove(bucket.spillFile.c_str()) != 0) {
+         LOG_ERROR << "Could not remove file: " + bucket.spillFile << endl;
+         return false;
+      }
+      bucket.spilled = false;
+      bucket.spilledBytes = 0;
+   }
+   store.memBytes += kept.Size();
+   store.memBytes -= bucket.records.Size();
+   bucket.records = std::move(kept);
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * FilterStagedBuckets --
+ *
+ *      Applies the filter of the store to the entries touching .vdfs, which
+ *      it let through while bucketizing, now that the staged renames are
+ *      complete (see FilterStagedEntries). Dropped and rewritten entries
+ *      are removed from their buckets, rewrites appended to them, and the
+ *      entry counts adjusted.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Buckets left empty are removed
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+FilterStagedBuckets(BucketStore& store,
+                    ostream&     logFile)
+{
+   vector<StagedEntry> staged;
+
+   for (const auto& bucket : store.buckets) {
+      int level = bucket.first;
+
+      auto findStaged = [&staged, level](const DiffToken& line) {
+         DiffEntry entry;
+
+         ParseDiffEntry(line, level, entry);
+         if (TouchesStaging(entry)) {
+            staged.push_back(StagedEntry{level, line.Str(), string()});
+         }
+         return true;
+      };
+
+      if (!ForEachBucketLine(bucket.second, findStaged, logFile)) {
+         return false;
+      }
+   }
+
+   if (staged.empty()) {
+      return true;
+   }
+
+   FilterStagedEntries(store.filter, staged);
+
+   map<int, vector<string>> removeLines;
+   size_t numKept = 0;
+
+   for (const StagedEntry& entry : staged) {
+      if (entry.filtered != entry.line) {
+         removeLines[entry.level].push_back(entry.line);
+      } else {
+         ++numKept;
+      }
+   }
+
+   LOG_INFO << "Keeping " << numKept << " of " << staged.size()
+            << " entries staged through " VDFS_STAGING_DIR " as they are" << endl;
+
+   for (const auto& levelLines : removeLines) {
+      auto bucket = store.buckets.find(levelLines.first);
+
+      if (!RemoveBucketLines(store, bucket->second, levelLines.second, logFile)) {
+         return false;
+      }
+      if (bucket->second.records.Size() == 0) {
+         store.buckets.erase(bucket);
+      }
+   }
+
+   for (const StagedEntry& entry : staged) {
+      DiffEntry counted;
+
+      if (entry.filtered == entry.line) {
+         continue;
+      }
+      ParseDiffEntry(DiffToken{entry.line.data(), entry.line.size()}, entry.level,
+                     counted);
+      UncountDiffEntry(store.counts, counted);
+      if (entry.filtered.empty()) {
+         ++store.counts.filtered;
+         continue;
+      }
+      ParseDiffEntry(DiffToken{entry.filtered.data(), entry.filtered.size()},
+                     entry.level, counted);
+      CountDiffEntry(store.counts, counted);
+      store.buckets[entry.level].records.Append(entry.filtered.data(),
+                                                entry.filtered.size());
+      store.memBytes += entry.filtered.size() + 1;
+   }
+   return SpillBuckets(store, logFile);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * CompactRenameChains --
+ *
+ *      Collapses renames staged through .vdfs, X -> .vdfs/<n> followed by
+ *      .vdfs/<n> -> Y, into direct renames X -> Y where the level ordering
+ *      allows. Every entry related to X, i.e. on X, an ancestor of it or
+ *      below it, that followed the move out of X has to follow the direct
+ *      rename and every one before it has to precede it, likewise for the
+ *      entries related to Y and the move into Y. Chains are collapsed in
+ *      order, each at DIRECT_RENAME_LEVEL if it is within its bounds or
+ *      else at the lowest level possible, the ones collapsed before
+ *      counting with their new levels. When no staged entry is left the
+ *      creation and deletion of .vdfs are dropped, too. The entry counts
+ *      of the store follow the removed and added entries.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Buckets left empty are removed
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+CompactRenameChains(BucketStore& store,
+                    ostream&     logFile)
+{
+   vector<StagedRename> chains;
+   map<string, int> chainByStage;
+   vector<pair<int, string>> stagingDirLines;
+   bool keepStagingDir = false;
+
+   auto chainOf = [&](const DiffToken& stage) -> StagedRename& {
+      auto chain = chainByStage.emplace(stage.Str(), (int)chains.size());
+
+      if (chain.second) {
+         chains.emplace_back();
+      }
+      return chains[chain.first->second];
+   };
+
+   // Find the staged renames and everything else touching .vdfs
+   for (const auto& bucket : store.buckets) {
+      int level = bucket.first;
+
+      auto findStaged = [&](const DiffToken& line) {
+         DiffEntry entry;
+         DiffToken stage;
+
+         ParseDiffEntry(line, level, entry);
+
+         bool pathStaged = StagingName(entry.path, stage);
+         DiffToken extraStage;
+         bool extraStaged = entry.numTokens > 2 &&
+                            StagingName(entry.extra, extraStage);
+
+         if (!pathStaged && !extraStaged) {
+            return true;
+         }
+         if (pathStaged && entry.path == VDFS_STAGING_DIR &&
+             entry.numTokens == 2 && entry.IsDir() &&
+             (entry.kind.ops == DIFF_OP_CREATED || entry.kind.ops == DIFF_OP_DELETE)) {
+            stagingDirLines.emplace_back(level, line.Str());
+            return true;
+         }
+
+         bool rename = entry.IsRename() && entry.numTokens == 3;
+
+         if (rename && !pathStaged && extraStage.len == entry.extra.len &&
+             extraStage.len > strlen(VDFS_STAGING_DIR)) {
+            StagedRename& chain = chainOf(extraStage);
+
+            ++chain.numSrc;
+            chain.pinned = chain.pinned ||
+                           (!chain.op.empty() && entry.op != chain.op.c_str());
+            chain.op = entry.op.Str();
+            chain.from = entry.path.Str();
+            chain.srcLine = line.Str();
+            chain.srcLevel = level;
+         } else if (rename && !extraStaged && stage.len == entry.path.len &&
+                    stage.len > strlen(VDFS_STAGING_DIR)) {
+            StagedRename& chain = chainOf(stage);
+
+            ++chain.numDst;
+            chain.pinned = chain.pinned ||
+                           (!chain.op.empty() && entry.op != chain.op.c_str());
+            chain.op = entry.op.Str();
+            chain.to = entry.extra.Str();
+            chain.dstLine = line.Str();
+            chain.dstLevel = level;
+         } else {
+            // Anything else in .vdfs keeps its stages, and .vdfs with them
+            for (const DiffToken& staged : {stage, extraStage}) {
+               if (staged.len > strlen(VDFS_STAGING_DIR)) {
+                  chainOf(staged).pinned = true;
+               }
+            }
+            keepStagingDir = true;
+         }
+         return true;
+      };
+
+      if (!ForEachBucketLine(bucket.second, findStaged, logFile)) {
+         return false;
+      }
+   }
+
+   if (chains.empty()) {
+      return true;
+   }
+
+   // Index the renamed paths and their ancestors
+   unordered_map<string, vector<pair<int, int>>> renamed;
+   unordered_map<string, vector<pair<int, int>>> ancestors;
+
+   for (int i = 0; i < (int)chains.size(); ++i) {
+      StagedRename& chain = chains[i];
+
+      chain.pinned = chain.pinned || chain.numSrc != 1 || chain.numDst != 1 ||
+                     chain.srcLevel >= chain.dstLevel || chain.from == chain.to ||
+                     chain.to.compare(0, chain.from.size() + 1, chain.from + '/') == 0 ||
+                     chain.from.compare(0, chain.to.size() + 1, chain.to + '/') == 0;
+      if (chain.pinned) {
+         continue;
+      }
+      chain.lo = chain.srcLevel;
+      chain.hi = chain.dstLevel;
+
+      int side = 0;
+
+      for (const string& path : {chain.from, chain.to}) {
+         renamed[path].emplace_back(i, side);
+         for (size_t slash = path.find('/'); slash != string::npos;
+              slash = path.find('/', slash + 1)) {
+            ancestors[path.substr(0, slash)].emplace_back(i, side);
+         }
+         ++side;
+      }
+   }
+
+   // Constraints from the entries related to the renamed paths
+   for (const auto& bucket : store.buckets) {
+      int level = bucket.first;
+      vector<pair<int, int>> related;
+      string prefix;
+
+      auto addRelated = [&](const DiffToken& path) {
+         prefix.assign(path.data, path.len);
+         for (const auto *index : {&renamed, &ancestors}) {
+            auto refs = index->find(prefix);
+
+            if (refs != index->end()) {
+               related.insert(related.end(), refs->second.begin(), refs->second.end());
+            }
+         }
+         for (size_t slash = prefix.find('/'); slash != string::npos;
+              slash = prefix.find('/', slash + 1)) {
+            auto refs = renamed.find(prefix.substr(0, slash));
+
+            if (refs != renamed.end()) {
+               related.insert(related.end(), refs->second.begin(), refs->second.end());
+            }
+         }
+      };
+
+      auto constrain = [&](const DiffToken& line) {
+         DiffEntry entry;
+         DiffToken stage;
+         int halfOf = -1;
+         int half = 0;
+
+         ParseDiffEntry(line, level, entry);
+         related.clear();
+
+         if (!StagingName(entry.path, stage)) {
+            addRelated(entry.path);
+         }
+         if (entry.HasTwoPaths() && !StagingName(entry.extra, stage)) {
+            addRelated(entry.extra);
+         }
+         if (related.empty()) {
+            return true;
+         }
+
+         // The halves of other chains move as those are collapsed
+         if (StagingName(entry.path, stage) || StagingName(entry.extra, stage)) {
+            auto chain = chainByStage.find(stage.Str());
+
+            if (chain != chainByStage.end() && !chains[chain->second].pinned) {
+               halfOf = chain->second;
+               half = entry.path.data == stage.data ? 1 : 0;
+            }
+         }
+
+         for (const auto& ref : related) {
+            StagedRename& chain = chains[ref.first];
+            int halfLevel = ref.second == 0 ? chain.srcLevel : chain.dstLevel;
+
+            if (ref.first == halfOf) {
+               continue;
+            } else if (halfOf >= 0) {
+               chain.deps.push_back(StagedRename::Dep{ref.second, halfOf, half});
+            } else if (level > halfLevel) {
+               chain.hi = min(chain.hi, level);
+            } else {
+               chain.lo = max(chain.lo, level);
+            }
+         }
+         return true;
+      };
+
+      if (!ForEachBucketLine(bucket.second, constrain, logFile)) {
+         return false;
+      }
+   }
+
+   // Collapse in order, against the final levels of the chains before
+   map<int, vector<string>> removeLines;
+   size_t numCollapsed = 0;
+
+   for (StagedRename& chain : chains) {
+      if (chain.pinned) {
+         continue;
+      }
+
+      int lo = chain.lo;
+      int hi = chain.hi;
+
+      for (const StagedRename::Dep& dep : chain.deps) {
+         const StagedRename& other = chains[dep.chain];
+         int level = other.level >= 0 ? other.level :
+                     dep.half == 0 ? other.srcLevel : other.dstLevel;
+
+         if (level > (dep.side == 0 ? chain.srcLevel : chain.dstLevel)) {
+            hi = min(hi, level);
+         } else {
+            lo = max(lo, level);
+         }
+      }
+
+      int level = max(lo + 1, DIRECT_RENAME_LEVEL);
+
+      if (level >= hi) {
+         level = lo + 1;
+      }
+      if (level >= hi) {
+         continue;
+      }
+
+      chain.level = level;
+      removeLines[chain.srcLevel].push_back(chain.srcLine);
+      removeLines[chain.dstLevel].push_back(chain.dstLine);
+      ++numCollapsed;
+   }
+
+   LOG_INFO << "Collapsing " << numCollapsed << " of " << chains.size()
+            << " renames staged through " VDFS_STAGING_DIR << endl;
+
+   if (!keepStagingDir && numCollapsed == chains.size()) {
+      for (const auto& stagingDirLine : stagingDirLines) {
+         removeLines[stagingDirLine.first].push_back(stagingDirLine.second);
+      }
+   }
+
+   for (const auto& levelLines : removeLines) {
+      auto bucket = store.buckets.find(levelLines.first);
+
+      if (!RemoveBucketLines(store, bucket->second, levelLines.second, logFile)) {
+         return false;
+      }
+      if (bucket->second.records.Size() == 0) {
+         store.buckets.erase(bucket);
+      }
+   }
+
+   for (const auto& levelLines : removeLines) {
+      for (const string& line : levelLines.second) {
+         DiffEntry removed;
+
+         ParseDiffEntry(DiffToken{line.data(), line.size()}, levelLines.first,
+                        removed);
+         UncountDiffEntry(store.counts, removed);
+      }
+   }
+
+   for (const StagedRename& chain : chains) {
+      if (chain.level >= 0) {
+         string line = chain.op + '\t' + chain.from + '\t' + chain.to;
+         DiffEntry direct;
+
+         ParseDiffEntry(DiffToken{line.data(), line.size()}, chain.level, direct);
+         CountDiffEntry(store.counts, direct);
+         store.buckets[chain.level].records.Append(line.data(), line.size());
+         store.memBytes += line.size() + 1;
+      }
+   }
+   return SpillBuckets(store, logFile);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * OpenBinaryDiff --
+ *
+ *      Starts serialized_diff.bin. Records go to a temporary file next to
+ *      it until CloseBinaryDiff() appends them behind the string table.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Creates serialized_diff.bin and serialized_diff.bin.records
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+OpenBinaryDiff(BinaryDiffWriter& binWriter,
+               const string&     resultDir,
+               ostream&          logFile)
+{
+   SnapDiffBinHeader header;
+
+   binWriter.fileName = resultDir + separator + "serialized_diff.bin";
+   binWriter.recordsFileName = binWriter.fileName + ".records";
+
+   if (!binWriter.file.OpenBinary(binWriter.fileName)) {
+      LOG_ERROR << "Could not open file: " + binWriter.fileName << endl;
+      return false;
+   }
+   if (!binWriter.records.OpenBinary(binWriter.recordsFileName)) {
+      LOG_ERROR << "Could not open file: " + binWriter.recordsFileName << endl;
+      return false;
+   }
+
+   LOG_INFO << "Writing to binary diff file: " + binWriter.fileName << endl;
+
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, SNAPDIFF_BIN_MAGIC, sizeof header.magic);
+   header.version = SNAPDIFF_BIN_VERSION;
+   header.recordSize = sizeof(SnapDiffBinRecord);
+   binWriter.file.write((const char *)&header, sizeof header);
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * AppendBinaryDiffRecord --
+ *
+ *      Adds one serialized diff entry to the binary diff
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes the line to the string table and its record
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+AppendBinaryDiffRecord(BinaryDiffWriter& binWriter,
+                       const DiffEntry&  entry)
+{
+   const DiffToken& diffLine = entry.line;
+   int level = entry.level;
+   SnapDiffBinRecord record;
+   unsigned entryType;
+   unsigned opKind;
+   unsigned opFlags;
+
+   ClassifyDiffOp(entry, entryType, opKind, opFlags);
+
+   memset(&record, 0, sizeof record);
+   record.lineOffset = binWriter.stringsSize;
+   record.lineLen = diffLine.len;
+   record.level = level;
+   record.opOffset = entry.op.data ? entry.op.data - diffLine.data : 0;
+   record.opLen = entry.op.len;
+   record.pathOffset = entry.path.data ? entry.path.data - diffLine.data : 0;
+   record.pathLen = entry.path.len;
+   record.extraOffset = entry.extra.data ? entry.extra.data - diffLine.data : 0;
+   record.extraLen = entry.extra.len;
+   record.numFields = min(entry.numTokens, 255);
+   record.entryType = entryType;
+   record.opKind = opKind;
+   record.opFlags = opFlags;
+
+   if (binWriter.levels.empty() || binWriter.levels.back().level != level) {
+      SnapDiffBinLevel levelEntry;
+
+      memset(&levelEntry, 0, sizeof levelEntry);
+      levelEntry.level = level;
+      levelEntry.firstRecord = binWriter.recordCount;
+      binWriter.levels.push_back(levelEntry);
+   }
+   ++binWriter.levels.back().numRecords;
+
+   binWriter.file.write(diffLine.data, diffLine.len);
+   binWriter.file.put('\n');
+   binWriter.records.write((const char *)&record, sizeof record);
+   binWriter.stringsSize += diffLine.len + 1;
+   ++binWriter.recordCount;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * CloseBinaryDiff --
+ *
+ *      Completes serialized_diff.bin with the records, the level index and
+ *      the trailer
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Removes the temporary records file
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+CloseBinaryDiff(BinaryDiffWriter& binWriter,
+                ostream&          logFile)
+{
+   static const char padding[8] = { 0 };
+   SnapDiffBinTrailer trailer;
+   bool ok = true;
+
+   memset(&trailer, 0, sizeof trailer);
+   trailer.stringsOffset = sizeof(SnapDiffBinHeader);
+   trailer.stringsSize = binWriter.stringsSize;
+   binWriter.file.write(padding, (8 - binWriter.stringsSize % 8) % 8);
+   trailer.recordsOffset = trailer.stringsOffset + binWriter.stringsSize +
+                           (8 - binWriter.stringsSize % 8) % 8;
+   trailer.recordCount = binWriter.recordCount;
+
+   if (!binWriter.records.Close()) {
+      LOG_ERROR << "Error writing file: " + binWriter.recordsFileName << endl;
+      ok = false;
+   } else {
+      ifstream recordsFile{binWriter.recordsFileName, ios::binary};
+      string buf;
+
+      buf.resize(WRITER_BUFSIZE);
+      while (recordsFile.read(&buf[0], buf.size()) || recordsFile.gcount() > 0) {
+         binWriter.file.write(buf.data(), recordsFile.gcount());
+      }
+      if (!recordsFile.eof()) {
+         LOG_ERROR << "Error reading file: " + binWriter.recordsFileName << endl;
+         ok = false;
+      }
+   }
+   if (remove(binWriter.recordsFileName.c_str()) != 0) {
+      LOG_ERROR << "Could not remove file: " + binWriter.recordsFileName << endl;
+   }
+
+   trailer.levelsOffset = trailer.recordsOffset +
+                          binWriter.recordCount * sizeof(SnapDiffBinRecord);
+   trailer.levelCount = binWriter.levels.size();
+   trailer.version = SNAPDIFF_BIN_VERSION;
+   memcpy(trailer.magic, SNAPDIFF_BIN_TRAILER_MAGIC, sizeof trailer.magic);
+
+   if (!binWriter.levels.empty()) {
+      binWriter.file.write((const char *)binWriter.levels.data(),
+                           binWriter.levels.size() * sizeof(SnapDiffBinLevel));
+   }
+   binWriter.file.write((const char *)&trailer, sizeof trailer);
+
+   if (!binWriter.file.Close()) {
+      LOG_ERROR << "Error writing file: " + binWriter.fileName << endl;
+      return false;
+   }
+   return ok;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * OpenDiffDag --
+ *
+ *      Starts the dependency_dag output
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Creates dependency_dag
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+OpenDiffDag(DiffDagWriter& dagWriter,
+            const string&  resultDir,
+            ostream&       logFile)
+{
+   dagWriter.fileName = resultDir + separator + "dependency_dag";
+
+   if (!dagWriter.file.Open(dagWriter.fileName)) {
+      LOG_ERROR << "Could not open file: " + dagWriter.fileName << endl;
+      return false;
+   }
+
+   LOG_INFO << "Writing to dependency dag file: " + dagWriter.fileName << endl;
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ForEachDiffDagNodeBelow --
+ *
+ *      Calls f(node) for the nodes below node still holding entries or
+ *      having such nodes below them, as linked into the children lists
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+template <class F>
+static void
+ForEachDiffDagNodeBelow(DiffDagWriter& dagWriter,
+                        PathNode       node,
+                        F              f)
+{
+   vector<PathNode>& walk = dagWriter.walk;
+
+   // Nodes interned since the last level have nothing below them yet
+   if (node >= dagWriter.children.size()) {
+      return;
+   }
+
+   walk.assign(dagWriter.children[node].begin(), dagWriter.children[node].end());
+   while (!walk.empty()) {
+      PathNode below = walk.back();
+
+      walk.pop_back();
+      walk.insert(walk.end(), dagWriter.children[below].begin(),
+                  dagWriter.children[below].end());
+      f(below);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * CommitDiffDagLevel --
+ *
+ *      Makes the entries of the level written last visible as dependencies
+ *      of the following levels. An entry on a path supersedes the earlier
+ *      ones on it and below it, since it depends on them, so those are
+ *      dropped and the path is linked into the children lists of its
+ *      ancestors instead.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+CommitDiffDagLevel(DiffDagWriter& dagWriter)
+{
+   PathTrie& paths = dagWriter.paths;
+
+   dagWriter.onPath.resize(paths.NumNodes());
+   dagWriter.children.resize(paths.NumNodes());
+   dagWriter.linked.resize(paths.NumNodes());
+
+   auto supersede = [&dagWriter](PathNode node) {
+      dagWriter.onPath[node].clear();
+      vector<PathNode>().swap(dagWriter.children[node]);
+   };
+
+   for (const auto& levelPath : dagWriter.levelPaths) {
+      ForEachDiffDagNodeBelow(dagWriter, levelPath.first, [&](PathNode below) {
+         supersede(below);
+         dagWriter.linked[below] = 0;
+      });
+      supersede(levelPath.first);
+   }
+
+   for (const auto& levelPath : dagWriter.levelPaths) {
+      dagWriter.onPath[levelPath.first].push_back(levelPath.second);
+      for (PathNode node = levelPath.first;
+           node != PATH_ROOT && !dagWriter.linked[node]; node = paths.Parent(node)) {
+         dagWriter.linked[node] = 1;
+         if (paths.Parent(node) != PATH_ROOT) {
+            dagWriter.children[paths.Parent(node)].push_back(node);
+         }
+      }
+   }
+   dagWriter.levelPaths.clear();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * AppendDiffDagEntry --
+ *
+ *      Adds one serialized diff entry to the dependency dag, with the
+ *      entries of lower levels it depends on: the ones on its path and
+ *      rename target, on their ancestors and the nearest ones below them
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+AppendDiffDagEntry(DiffDagWriter&   dagWriter,
+                   const DiffEntry& entry)
+{
+   int level = entry.level;
+   unsigned long long id = dagWriter.nextId++;
+
+   if (level != dagWriter.level) {
+      CommitDiffDagLevel(dagWriter);
+      dagWriter.level = level;
+   }
+
+   dagWriter.deps.clear();
+
+   // Nodes interned since the last level have no entries yet
+   auto addDeps = [&dagWriter](const vector<vector<unsigned long long>>& index,
+                               PathNode node) {
+      if (node < index.size()) {
+         dagWriter.deps.insert(dagWriter.deps.end(), index[node].begin(),
+                               index[node].end());
+      }
+   };
+
+   for (int i = 0; i < (entry.IsRename() ? 2 : 1) && i + 1 < entry.numTokens; ++i) {
+      const DiffToken& path = i == 0 ? entry.path : entry.extra;
+      PathNode node = dagWriter.paths.Intern(path.data, path.len);
+
+      addDeps(dagWriter.onPath, node);
+      ForEachDiffDagNodeBelow(dagWriter, node, [&](PathNode below) {
+         addDeps(dagWriter.onPath, below);
+      });
+      for (PathNode ancestor = dagWriter.paths.Parent(node); ancestor != PATH_ROOT;
+           ancestor = dagWriter.paths.Parent(ancestor)) {
+         addDeps(dagWriter.onPath, ancestor);
+      }
+      dagWriter.levelPaths.emplace_back(node, id);
+   }
+
+   sort(dagWriter.deps.begin(), dagWriter.deps.end());
+   dagWriter.deps.erase(unique(dagWriter.deps.begin(), dagWriter.deps.end()),
+                        dagWriter.deps.end());
+
+   dagWriter.file << id << '\t' << level << '\t';
+   if (dagWriter.deps.empty()) {
+      dagWriter.file << '-';
+   }
+   for (size_t i = 0; i < dagWriter.deps.size(); ++i) {
+      dagWriter.file << (i > 0 ? "," : "") << dagWriter.deps[i];
+   }
+   dagWriter.file << '\t';
+   dagWriter.file.write(entry.line.data, entry.line.len);
+   dagWriter.file << '\n';
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * CloseDiffDag --
+ *
+ *      Completes the dependency_dag output
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+CloseDiffDag(DiffDagWriter& dagWriter,
+             ostream&       logFile)
+{
+   if (!dagWriter.file.Close()) {
+      LOG_ERROR << "Error writing file: " + dagWriter.fileName << endl;
+      return false;
+   }
+   LOG_INFO << "Dependency dag indexed " << dagWriter.paths.NumNodes() - 1
+            << " path nodes in " << dagWriter.paths.MemoryBytes() << " bytes" << endl;
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * OpenDiffShards --
+ *
+ *      Starts the shards output: numShards shard directories and the
+ *      cross shard, each with a serialized diff and a parallel_diff
+ *      directory
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Creates the shards directory
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+OpenDiffShards(DiffShardWriter& shardWriter,
+               const string&    resultDir,
+               unsigned         numShards,
+               unsigned         shardDepth,
+               ostream&         logFile)
+{
+   string shardsDir = resultDir + separator + "shards";
+
+   numShards = min(max(numShards, 1U), (unsigned)MAX_SHARDS);
+   shardWriter.depth = max(shardDepth, 1U);
+
+   if (MkDir(shardsDir) != 0) {
+      LOG_ERROR << "Unable to create directory: " + shardsDir << endl;
+      return false;
+   }
+
+   for (unsigned i = 0; i <= numShards; ++i) {
+      unique_ptr<DiffShard> shard{new DiffShard};
+      string serialFileName;
+
+      shard->dir = shardsDir + separator + (i < numShards ? to_string(i) : "cross");
+      serialFileName = shard->dir + separator + "serialized_diff";
+      if (MkDir(shard->dir) != 0 ||
+          MkDir(shard->dir + separator + "parallel_diff") != 0) {
+         LOG_ERROR << "Unable to create directory: " + shard->dir << endl;
+         return false;
+      }
+      if (!shard->serialFile.Open(serialFileName)) {
+         LOG_ERROR << "Could not open file: " + serialFileName << endl;
+         return false;
+      }
+      shardWriter.shards.push_back(std::move(shard));
+   }
+
+   LOG_INFO << "Writing " << numShards << " shards of depth " << shardWriter.depth
+            << " to: " + shardsDir << endl;
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ShardOfPath --
+ *
+ *      Picks the shard of an entry on path by the FNV-1a hash of its first
+ *      shardWriter.depth components. A directory with fewer components
+ *      spans several shards.
+ *
+ * Results:
+ *      The shard number, that of the cross shard if the entry spans shards
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static size_t
+ShardOfPath(const DiffShardWriter& shardWriter,
+            const DiffToken&       path,
+            bool                   isDir)
+{
+   size_t numShards = shardWriter.shards.size() - 1;
+   size_t keyLen = path.len;
+   unsigned components = 1;
+   uint32_t hash = 2166136261U;
+
+   for (size_t i = 0; i < path.len; ++i) {
+      if (path.data[i] == '/' && components++ == shardWriter.depth) {
+         keyLen = i;
+         break;
+      }
+   }
+   if (components < shardWriter.depth && isDir) {
+      return numShards;
+   }
+
+   for (size_t i = 0; i < keyLen; ++i) {
+      hash = (hash ^ (unsigned char)path.data[i]) * 16777619U;
+   }
+   return hash % numShards;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * TouchesCrossPath --
+ *
+ *      Checks whether an entry on path has to follow an entry of the cross
+ *      shard of a lower level, which it does if it is on, above or below a
+ *      path one of them touched. Only the path nodes of the prefixes of
+ *      path are looked up, nothing is interned.
+ *
+ * Results:
+ *      Returns true if the entry belongs to the cross shard
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+TouchesCrossPath(const DiffShardWriter& shardWriter,
+                 const DiffToken&       path)
+{
+   const vector<unsigned char>& crossFlags = shardWriter.crossFlags;
+   PathNode node = PATH_ROOT;
+   bool touches = false;
+
+   if (crossFlags.empty()) {
+      return false;
+   }
+
+   PathTrie::ForEachComponent(path.data, path.len, [&](const char *name, size_t len) {
+      node = shardWriter.crossPaths.Child(node, name, len);
+      if (node == PATH_NONE) {
+         return false;
+      }
+
+      // Nodes of the level being written are not flagged yet
+      unsigned char flags = node < crossFlags.size() ? crossFlags[node] : 0;
+      bool onPath = name + len == path.End();
+
+      touches = (flags & CROSS_PATH) != 0 || (onPath && (flags & CROSS_ANCESTOR) != 0);
+      return !touches;
+   });
+   return touches;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * AppendShardEntry --
+ *
+ *      Adds one serialized diff entry to the serialized diff and the
+ *      parallel_diff level file of its shard
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Level files of the shards completed and opened
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+AppendShardEntry(DiffShardWriter& shardWriter,
+                 const DiffEntry& entry,
+                 ostream&         logFile)
+{
+   const DiffToken& diffLine = entry.line;
+   int level = entry.level;
+   size_t cross = shardWriter.shards.size() - 1;
+
+   if (level != shardWriter.level) {
+      const PathTrie& crossPaths = shardWriter.crossPaths;
+
+      shardWriter.crossFlags.resize(crossPaths.NumNodes());
+      for (PathNode node : shardWriter.levelPaths) {
+         shardWriter.crossFlags[node] |= CROSS_PATH;
+         for (node = crossPaths.Parent(node); node != PATH_ROOT;
+              node = crossPaths.Parent(node)) {
+            shardWriter.crossFlags[node] |= CROSS_ANCESTOR;
+         }
+      }
+      shardWriter.levelPaths.clear();
+      shardWriter.level = level;
+   }
+
+   bool isDir = entry.IsDir();
+   int numPaths = entry.HasTwoPaths() ? 2 : 1;
+   size_t shardNum = ShardOfPath(shardWriter, entry.path, isDir);
+
+   if (numPaths == 2 && ShardOfPath(shardWriter, entry.extra, isDir) != shardNum) {
+      shardNum = cross;
+   }
+   for (int i = 0; i < numPaths && shardNum != cross; ++i) {
+      if (TouchesCrossPath(shardWriter, i == 0 ? entry.path : entry.extra)) {
+         shardNum = cross;
+      }
+   }
+   if (shardNum == cross) {
+      for (int i = 0; i < numPaths; ++i) {
+         const DiffToken& path = i == 0 ? entry.path : entry.extra;
+
+         shardWriter.levelPaths.push_back(shardWriter.crossPaths.Intern(path.data,
+                                                                        path.len));
+      }
+   }
+
+   DiffShard& shard = *shardWriter.shards[shardNum];
+
+   if (level != shard.level) {
+      string levelFileName = shard.dir + separator + "parallel_diff" + separator +
+                             to_string(level);
+
+      if (!shard.levelFile.Close()) {
+         LOG_ERROR << "Error writing file: " + shard.dir + separator +
+                      "parallel_diff" + separator + to_string(shard.level) << endl;
+         return false;
+      }
+      if (!shard.levelFile.Open(levelFileName)) {
+         LOG_ERROR << "Could not open file: " + levelFileName << endl;
+         return false;
+      }
+      shard.level = level;
+   }
+
+   shard.serialFile.write(diffLine.data, diffLine.len);
+   shard.serialFile << '\n';
+   shard.levelFile.write(diffLine.data, diffLine.len);
+   shard.levelFile << '\n';
+   ++shard.entries;
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * CloseDiffShards --
+ *
+ *      Completes the shards output
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+CloseDiffShards(DiffShardWriter& shardWriter,
+                ostream&         logFile)
+{
+   unsigned long long entries = 0;
+   bool ok = true;
+
+   for (auto& shard : shardWriter.shards) {
+      if (!shard->levelFile.Close() || !shard->serialFile.Close()) {
+         LOG_ERROR << "Error writing shard: " + shard->dir << endl;
+         ok = false;
+      }
+      entries += shard->entries;
+   }
+
+   if (ok && !shardWriter.shards.empty()) {
+      LOG_INFO << "Sharded " << entries << " entries, "
+               << shardWriter.shards.back()->entries << " of them cross-shard" << endl;
+   }
+   return ok;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * DeliverDiffEntry --
+ *
+ *      Hands one diff entry to the callback of the entry sink
+ *
+ * Results:
+ *      Returns true to go on, false if the callback aborted the diff
+ *
+ * Side effects:
+ *      Calls the callback
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+DeliverDiffEntry(EntrySink&       entrySink,
+                 unsigned         delivery,
+                 const DiffEntry& diffEntry,
+                 const PathStat  *st,
+                 ostream&         logFile)
+{
+   SnapshotDiffEntry entry;
+   string& scratch = entrySink.scratch;
+
+   // NUL terminated copies of op, path and extra
+   scratch.assign(diffEntry.op.data, diffEntry.op.len).push_back('\0');
+   scratch.append(diffEntry.path.data, diffEntry.path.len).push_back('\0');
+   scratch.append(diffEntry.extra.data, diffEntry.extra.len).push_back('\0');
+
+   memset(&entry, 0, sizeof entry);
+   entry.delivery = delivery;
+   entry.level = diffEntry.level;
+   ClassifyDiffOp(diffEntry, entry.entryType, entry.opKind, entry.opFlags);
+   entry.op = scratch.data();
+   entry.path = entry.op + diffEntry.op.len + 1;
+   entry.extra = entry.path + diffEntry.path.len + 1;
+
+   if (st != nullptr && st->ok) {
+      entry.hasStat = true;
+      entry.size = st->size;
+      entry.atimeSec = st->asec;
+      entry.atimeNsec = st->ansec;
+      entry.ctimeSec = st->csec;
+      entry.ctimeNsec = st->cnsec;
+      entry.mtimeSec = st->msec;
+      entry.mtimeNsec = st->mnsec;
+   }
+
+   if (entrySink.sink.callback(&entry, entrySink.sink.ctx) != 0) {
+      LOG_ERROR << "Diff aborted by entry callback at: " + diffEntry.line.Str() << endl;
+      entrySink.aborted = true;
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * FlushDiffEntries --
+ *
+ *      Stats the batched entries of the entry sink and delivers them
+ *
+ * Results:
+ *      Returns true to go on, false if the callback aborted the diff
+ *
+ * Side effects:
+ *      Calls the callback, the batch and its arena are emptied
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+FlushDiffEntries(EntrySink& entrySink,
+                 ostream&   logFile)
+{
+   const char *pos = entrySink.batch.data();
+   const char *end = pos + entrySink.batch.size();
+   DiffToken diffLine;
+   size_t numEntries = 0;
+   DiffEntry *entries = entrySink.arena.AllocArray<DiffEntry>(entrySink.batchLevels.size());
+   string statPrefix = entrySink.snapDir + "/../../";
+   vector<int> statIndex;
+   vector<const char *> statPaths;
+
+   statIndex.reserve(entrySink.batchLevels.size());
+   statPaths.reserve(entrySink.batchLevels.size());
+   while (NextDiffLine(pos, end, diffLine)) {
+      DiffEntry& entry = entries[numEntries];
+
+      ParseDiffEntry(diffLine, entrySink.batchLevels[numEntries++], entry);
+      if (entry.numTokens >= 2 && entry.kind.type != DIFF_TYPE_OTHER &&
+          DiffItemNeedsStat(entry)) {
+         statIndex.push_back(statPaths.size());
+         statPaths.push_back(entrySink.arena.Concat(statPrefix.data(), statPrefix.size(),
+                                                    entry.path.data, entry.path.len));
+      } else {
+         statIndex.push_back(-1);
+      }
+   }
+
+   vector<PathStat> stats;
+   bool ok = true;
+
+   entrySink.statEngine->Stat(statPaths, stats);
+   for (size_t i = 0; ok && i < numEntries; ++i) {
+      ok = DeliverDiffEntry(entrySink, entrySink.batchDelivery, entries[i],
+                            statIndex[i] >= 0 ? &stats[statIndex[i]] : nullptr,
+                            logFile);
+   }
+
+   entrySink.batch.clear();
+   entrySink.batchLevels.clear();
+   entrySink.arena.Reset();
+   return ok;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * AppendDiffEntry --
+ *
+ *      Passes one diff entry on to the entry sink, directly or, if it is to
+ *      be stat'ed, through the current batch
+ *
+ * Results:
+ *      Returns true to go on, false if the callback aborted the diff
+ *
+ * Side effects:
+ *      May call the callback
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+AppendDiffEntry(EntrySink&       entrySink,
+                unsigned         delivery,
+                const DiffEntry& entry,
+                ostream&         logFile)
+{
+   if (!entrySink.sink.withStat) {
+      return DeliverDiffEntry(entrySink, delivery, entry, nullptr, logFile);
+   }
+
+   if (!entrySink.batchLevels.empty() && entrySink.batchDelivery != delivery &&
+       !FlushDiffEntries(entrySink, logFile)) {
+      return false;
+   }
+
+   entrySink.batchDelivery = delivery;
+   entrySink.batch.append(entry.line.data, entry.line.len).push_back('\n');
+   entrySink.batchLevels.push_back(entry.level);
+   if (entrySink.batchLevels.size() >= ENTRY_BATCH_SIZE) {
+      return FlushDiffEntries(entrySink, logFile);
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * FinishDiffEntries --
+ *
+ *      Delivers the entries still batched in the entry sink
+ *
+ * Results:
+ *      Returns true to go on, false if the callback aborted the diff
+ *
+ * Side effects:
+ *      May call the callback
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+FinishDiffEntries(EntrySink& entrySink,
+                  ostream&   logFile)
+{
+   if (entrySink.batchLevels.empty()) {
+      return true;
+   }
+   return FlushDiffEntries(entrySink, logFile);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * DeliverStagedEntries --
+ *
+ *      Delivers the entries touching .vdfs held back while the pages were
+ *      read, as filter leaves them once the staged renames are complete
+ *      (see FilterStagedEntries)
+ *
+ * Results:
+ *      Returns true to go on, false if the callback aborted the diff
+ *
+ * Side effects:
+ *      May call the callback
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+DeliverStagedEntries(EntrySink&           entrySink,
+                     const PathFilter&    filter,
+                     vector<StagedEntry>& staged,
+                     ostream&             logFile)
+{
+   FilterStagedEntries(filter, staged);
+   for (const StagedEntry& stagedEntry : staged) {
+      DiffEntry entry;
+
+      if (stagedEntry.filtered.empty()) {
+         continue;
+      }
+      ParseDiffEntry(DiffToken{stagedEntry.filtered.data(), stagedEntry.filtered.size()},
+                     stagedEntry.level, entry);
+      if (!AppendDiffEntry(entrySink, SNAPDIFF_DELIVER_AS_READ, entry, logFile)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SerializeBucket --
+ *
+ *      Appends the diffs of one bucket, first the spilled and then the
+ *      in-memory ones, to the serialized diff and hands them to jsonWriter,
+ *      if set. The in-memory diffs are then completed in parallel_diff, if
+ *      that is an output.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      The bucket is released, temporary spill files are removed
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+SerializeBucket(BucketStore&      store,
+                int               level,
+                DiffBucket&       bucket,
+                BufferedWriter   *serialDiffFile,
+                JsonChunkWriter  *jsonWriter,
+                BinaryDiffWriter *binWriter,
+                DiffDagWriter    *dagWriter,
+                DiffShardWriter  *shardWriter,
+                EntrySink        *entrySink,
+                ostream&          logFile)
+{
+   bool perLine = jsonWriter != nullptr || binWriter != nullptr ||
+                  dagWriter != nullptr || shardWriter != nullptr ||
+                  entrySink != nullptr;
+
+   /*
+    * Hands one line to the outputs that take the diff line by line. It is
+    * parsed once, the outputs share its entry.
+    */
+   auto addLine = [&](const DiffToken& diffLine) {
+      DiffEntry entry;
+
+      ParseDiffEntry(diffLine, level, entry);
+      if (binWriter != nullptr) {
+         AppendBinaryDiffRecord(*binWriter, entry);
+      }
+      if (dagWriter != nullptr) {
+         AppendDiffDagEntry(*dagWriter, entry);
+      }
+      if (shardWriter != nullptr && !AppendShardEntry(*shardWriter, entry, logFile)) {
+         return false;
+      }
+      if (jsonWriter != nullptr && !AppendJsonDiffItem(*jsonWriter, entry, logFile)) {
+         return false;
+      }
+      return entrySink == nullptr ||
+             AppendDiffEntry(*entrySink, SNAPDIFF_DELIVER_SERIALIZED, entry, logFile);
+   };
+
+   if (bucket.spilled && (serialDiffFile != nullptr || perLine)) {
+      unique_ptr<istream> bucketFile = OpenInputFile(bucket.spillFile);
+
+      if (!bucketFile) {
+         LOG_ERROR << "Could not open file: " + bucket.spillFile << endl;
+         return false;
+      }
+
+      if (!perLine) {
+         string buf;
+         buf.resize(BUFSIZE);
+
+         while (bucketFile->read(&buf[0], BUFSIZE) || bucketFile->gcount() > 0) {
+            serialDiffFile->write(buf.data(), bucketFile->gcount());
+         }
+      } else {
+         string diffLine;
+
+         while (getline(*bucketFile, diffLine, '\n')) {
+            if (serialDiffFile != nullptr) {
+               *serialDiffFile << diffLine << '\n';
+            }
+            if (!addLine(DiffToken{diffLine.data(), diffLine.size()})) {
+               return false;
+            }
+         }
+      }
+
+      if (bucketFile->bad()) {
+         LOG_ERROR << "Error reading file: " + bucket.spillFile << endl;
+         return false;
+      }
+   }
+
+   bool ok = bucket.records.ForEachBlock([&](const char *data, size_t len) {
+      const char *pos = data;
+      const char *end = data + len;
+      DiffToken diffLine;
+
+      if (serialDiffFile != nullptr) {
+         serialDiffFile->write(data, len);
+      }
+      while (perLine && NextDiffLine(pos, end, diffLine)) {
+         if (!addLine(diffLine)) {
+            return false;
+         }
+      }
+      return true;
+   });
+
+   if (!ok) {
+      return false;
+   }
+
+   if (!store.bucketsDir.empty()) {
+      return SpillBucket(store, level, bucket, logFile);
+   }
+
+   store.memBytes -= bucket.records.Size();
+   bucket.records.Clear();
+   if (bucket.spilled && remove(bucket.spillFile.c_str()) != 0) {
+      LOG_ERROR << "Could not remove file: " + bucket.spillFile << endl;
+   }
+   return true;
+}
+
+
+#ifndef _WIN32
+/*
+ *------------------------------------------------------------------------
+ *
+ * SerializeBucketsAt --
+ *
+ *      Writes the serialized diff without streaming it through one
+ *      writer: the offset of every bucket in serialDiffFileName follows
+ *      from the sizes of the buckets, so the file is sized up front and
+ *      the buckets are written into their regions on numThreads threads,
+ *      spilled diffs copied within the kernel where possible. The
+ *      in-memory diffs are then completed in parallel_diff, if that is an
+ *      output, on the same threads.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      The buckets are released, temporary spill files are removed
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+SerializeBucketsAt(BucketStore&  store,
+                   const string& serialDiffFileName,
+                   unsigned      numThreads,
+                   ostream&      logFile)
+{
+   struct BucketCopy {
+      int                level;
+      DiffBucket        *bucket;
+      unsigned long long offset;
+      bool               ok;
+      string             log;
+   };
+   vector<BucketCopy> copies;
+   unsigned long long size = 0;
+
+   for (auto& levelBucket : store.buckets) {
+      DiffBucket& bucket = levelBucket.second;
+
+      copies.push_back(BucketCopy{levelBucket.first, &bucket, size, false, string()});
+      size += bucket.spilledBytes + bucket.records.Size();
+   }
+
+   if (!PresizeFile(serialDiffFileName, size)) {
+      LOG_ERROR << "Could not create file: " + serialDiffFileName << endl;
+      return false;
+   }
+
+   auto copyBucket = [&store, &serialDiffFileName](BucketCopy& copy) {
+      ostringstream logFile;
+      DiffBucket& bucket = *copy.bucket;
+      FileRegionWriter region;
+
+      copy.ok = region.Open(serialDiffFileName, copy.offset) &&
+                (!bucket.spilled || region.CopyFrom(bucket.spillFile, bucket.spilledBytes)) &&
+                bucket.records.ForEachBlock([&region](const char *data, size_t len) {
+                   return region.Write(data, len);
+                }) &&
+                region.Close();
+      if (!copy.ok) {
+         LOG_ERROR << "Error writing file: " + serialDiffFileName << endl;
+      } else if (!store.bucketsDir.empty()) {
+         copy.ok = WriteBucketFile(store.bucketsDir, copy.level, store.compress, bucket,
+                                   logFile);
+      } else if (bucket.spilled && remove(bucket.spillFile.c_str()) != 0) {
+         LOG_ERROR << "Could not remove file: " + bucket.spillFile << endl;
+      }
+      copy.log = logFile.str();
+   };
+
+   if (numThreads > 1 && copies.size() > 1) {
+      WorkerPool workers{min(numThreads, (unsigned)copies.size()), copies.size()};
+
+      for (BucketCopy& copy : copies) {
+         workers.Submit([&copyBucket, &copy] { copyBucket(copy); });
+      }
+      workers.Wait();
+   } else {
+      for (BucketCopy& copy : copies) {
+         copyBucket(copy);
+      }
+   }
+
+   bool ok = true;
+
+   for (BucketCopy& copy : copies) {
+      logFile << copy.log;
+      ok = ok && copy.ok;
+      store.memBytes -= copy.bucket->records.Size();
+      copy.bucket->records.Clear();
+   }
+   return ok;
+}
+#endif /* _WIN32 */
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteLevelIndex --
+ *
+ *      Writes the index of the levels of a compressed serialized diff, one
+ *      "level offset length" line per level giving the byte range of its
+ *      frame, so that a level can be decompressed on its own, see
+ *      SnapDiffReaderOpenLevel
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Creates fileName
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+WriteLevelIndex(const vector<LevelFrame>& frames,
+                const string&             fileName,
+                ostream&                  logFile)
+{
+   BufferedWriter file{WRITER_SMALL_BUFSIZE};
+
+   if (!file.Open(fileName)) {
+      LOG_ERROR << "Could not open file: " + fileName << endl;
+      return false;
+   }
+   for (const LevelFrame& frame : frames) {
+      file << frame.level << ' ' << frame.offset << ' ' << frame.length << '\n';
+   }
+   if (!file.Close()) {
+      LOG_ERROR << "Error writing file: " + fileName << endl;
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SerializeBuckets --
+ *
+ *      Places diffs in topological order into a single file, if
+ *      writeBinary into serialized_diff.bin, if writeDag into
+ *      dependency_dag and with numShards into that many shards of
+ *      shardDepth path components. If jsonWriter or entrySink are
+ *      set every diff is also handed to them while serializing, so the
+ *      serialized diff does not have to be read back. If nothing takes
+ *      the diffs line by line, the buckets are copied into the serialized
+ *      diff on numThreads threads, see SerializeBucketsAt. With
+ *      store.compress the serialized diff is compressed one frame per
+ *      level, see WriteLevelIndex.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      parallel_diff completed, if it is an output. All buckets will be
+ *      freed and deleted.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+SerializeBuckets(BucketStore&     store,
+                 const string&    resultDir,
+                 bool             writeSerial,
+                 bool             writeBinary,
+                 bool             writeDag,
+                 unsigned         numShards,
+                 unsigned         shardDepth,
+                 JsonChunkWriter *jsonWriter,
+                 EntrySink       *entrySink,
+                 unsigned         numThreads,
+                 ostream&         logFile)
+{
+   string serialDiffFileName = OutputFileName(resultDir + separator + "serialized_diff",
+                                              store.compress);
+   BufferedWriter SerialDiffFile;
+   BinaryDiffWriter binWriter;
+   DiffDagWriter dagWriter;
+   DiffShardWriter shardWriter;
+   vector<LevelFrame> frames;
+   bool ok = true;
+
+#ifndef _WIN32
+   if (writeSerial && !writeBinary && !writeDag && numShards == 0 &&
+       jsonWriter == nullptr && entrySink == nullptr && !store.compress) {
+      LOG_INFO << "Writing to serialized diff file: " + serialDiffFileName << endl;
+      ok = SerializeBucketsAt(store, serialDiffFileName, numThreads, logFile);
+      store.buckets.clear();
+
+      if (store.spillDirCreated && RmDir(store.spillDir) != 0) {
+         LOG_ERROR << "Could not remove directory: " + store.spillDir << endl;
+      }
+      return ok;
+   }
+#endif /* _WIN32 */
+
+   if (writeSerial) {
+      if (!(store.compress ? SerialDiffFile.OpenCompressed(serialDiffFileName)
+                           : SerialDiffFile.Open(serialDiffFileName))) {
+         LOG_ERROR << "Could not open file: " + serialDiffFileName << endl;
+         return false;
+      }
+
+      LOG_INFO << "Writing to serialized diff file: " + serialDiffFileName << endl;
+   }
+
+   if (writeBinary && !OpenBinaryDiff(binWriter, resultDir, logFile)) {
+      return false;
+   }
+
+   if (writeDag && !OpenDiffDag(dagWriter, resultDir, logFile)) {
+      return false;
+   }
+
+   if (numShards > 0 &&
+       !OpenDiffShards(shardWriter, resultDir, numShards, shardDepth, logFile)) {
+      return false;
+   }
+
+   for (auto itr = store.buckets.begin(); ok && itr != store.buckets.end(); ++itr) {
+      ok = SerializeBucket(store, itr->first, itr->second,
+                           writeSerial ? &SerialDiffFile : nullptr, jsonWriter,
+                           writeBinary ? &binWriter : nullptr,
+                           writeDag ? &dagWriter : nullptr,
+                           numShards > 0 ? &shardWriter : nullptr, entrySink, logFile);
+      if (ok && writeSerial && store.compress) {
+         LevelFrame frame{itr->first, SerialDiffFile.Offset(), 0};
+
+         ok = SerialDiffFile.EndFrame();
+         frame.length = SerialDiffFile.Offset() - frame.offset;
+         frames.push_back(frame);
+      }
+   }
+   store.buckets.clear();
+
+   if (store.spillDirCreated && RmDir(store.spillDir) != 0) {
+      LOG_ERROR << "Could not remove directory: " + store.spillDir << endl;
+   }
+
+   if (writeBinary && !CloseBinaryDiff(binWriter, logFile)) {
+      ok = false;
+   }
+
+   if (writeDag && !CloseDiffDag(dagWriter, logFile)) {
+      ok = false;
+   }
+
+   if (numShards > 0 && !CloseDiffShards(shardWriter, logFile)) {
+      ok = false;
+   }
+
+   if (writeSerial && !SerialDiffFile.Close() && ok) {
+      LOG_ERROR << "Error writing file: " + serialDiffFileName << endl;
+      return false;
+   }
+
+   if (writeSerial && store.compress && ok) {
+      ok = WriteLevelIndex(frames, serialDiffFileName + ".levels", logFile);
+   }
+   return ok;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteJsonTime --
+ *
+ *      Writes a timestamp member of a json diff item
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Adds key : { "nsec" : nsec, "sec" : sec } to the current object
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+WriteJsonTime(JsonWriter& json,
+              const char *key,
+              time_t      sec,
+              long long   nsec)
+{
+   json.Key(key);
+   json.BeginObject();
+   json.Key("nsec");
+   json.Number(nsec);
+   json.Key("sec");
+   json.Number(sec);
+   json.EndObject();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteJsonDiffItem --
+ *
+ *      Writes the json diff item of one serialized diff entry, st is the
+ *      stat information of the entry if DiffItemNeedsStat(). Members are
+ *      written in sorted key order. atime, ctime, mtime, path and size are
+ *      only present if the entry could be stat'ed, renamed_from only on a
+ *      directory renamed into the path filter.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Appends an object to the json array being written
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+WriteJsonDiffItem(JsonWriter&      json,
+                  const DiffEntry& entry,
+                  const PathStat&  st,
+                  ostream&         logFile)
+{
+   const DiffToken& path = entry.path;
+   bool isSymlink = entry.IsSym();
+   const char *objectType = isSymlink ? "symlink" :
+                            entry.kind.type == DIFF_TYPE_FILE ? "file" : "dir";
+
+   json.BeginObject();
+   if (entry.IsDelete()) {
+      json.Key("object_type");
+      json.String(objectType);
+      json.Key("path");
+      json.String(path.data, path.len);
+      json.Key("type");
+      json.String("delete");
+   } else if (!isSymlink && entry.IsRename()) {
+      json.Key("path_new");
+      json.String(entry.extra.data, entry.extra.len);
+      json.Key("path_old");
+      json.String(path.data, path.len);
+      json.Key("type");
+      json.String("rename");
+   } else {
+      bool created = entry.Has(DIFF_OP_CREATED);
+
+      if (!st.ok) {
+         LOG_ERROR << "Could not stat file: " + path.Str() << endl;
+      } else {
+         WriteJsonTime(json, "atime", st.asec, st.ansec);
+      }
+      json.Key("created");
+      json.Bool(created);
+      if (st.ok) {
+         WriteJsonTime(json, "ctime", st.csec, st.cnsec);
+      }
+      if (!isSymlink) {
+         json.Key("modified");
+         json.Bool(entry.Has(DIFF_OP_MODIFIED));
+      }
+      if (st.ok) {
+         WriteJsonTime(json, "mtime", st.msec, st.mnsec);
+         json.Key("path");
+         json.String(path.data, path.len);
+      }
+      if (entry.IsDir() && !entry.extra.Empty()) {
+         // Renamed into the path filter, see RewriteFilteredRename
+         json.Key("renamed_from");
+         json.String(entry.extra.data, entry.extra.len);
+      }
+      if (st.ok) {
+         json.Key("size");
+         json.Number(st.size);
+      }
+      json.Key("stat");
+      json.Bool(entry.Has(DIFF_OP_STAT));
+      if (isSymlink && created) {
+         json.Key("target");
+         json.String(entry.extra.data, entry.extra.len);
+      }
+      json.Key("type");
+      json.String(objectType);
+      if (!isSymlink) {
+         json.Key("xattr");
+         json.Bool(entry.Has(DIFF_OP_XATTR));
+      }
+   }
+   json.EndObject();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteJsonItems --
+ *
+ *      Converts a chunk of serialized diff lines into json. The entries of
+ *      the chunk are stat'ed as one batch on the stat engine before the
+ *      json items are written, either as one json array or, for ndjson,
+ *      as one compact record per line. The parsed entries and their stat
+ *      paths live in one scratch arena sized for the chunk, released
+ *      when the chunk is done.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to out
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+WriteJsonItems(const string&  snapDir,
+               StatEngine&    statEngine,
+               ArenaCounters *arenaCounters,
+               const string&  chunk,
+               bool           ndjson,
+               ostream&       out,
+               ostream&       logFile)
+{
+   const char *pos = chunk.data();
+   const char *end = pos + chunk.size();
+   size_t maxEntries = count(chunk.begin(), chunk.end(), '\n') + 1;
+   string statPrefix = snapDir + "/../../";
+   // Room for all entries and stat paths, the paths are no longer than the chunk
+   ScratchArena arena{(maxEntries + 1) * (sizeof(DiffEntry) + statPrefix.size() +
+                                          alignof(max_align_t)) + chunk.size(),
+                      arenaCounters};
+   DiffEntry *entries = arena.AllocArray<DiffEntry>(maxEntries);
+   size_t numEntries = 0;
+   DiffToken diffLine;
+   vector<int> statIndex;
+   vector<const char *> statPaths;
+
+   statIndex.reserve(maxEntries);
+   statPaths.reserve(maxEntries);
+   while (NextDiffLine(pos, end, diffLine)) {
+      DiffEntry& entry = entries[numEntries];
+
+      // The json items do not carry the level
+      ParseDiffEntry(diffLine, 0, entry);
+      if (entry.numTokens < 2 || entry.kind.type == DIFF_TYPE_OTHER) {
+         continue;
+      }
+      ++numEntries;
+      if (DiffItemNeedsStat(entry)) {
+         statIndex.push_back(statPaths.size());
+         statPaths.push_back(arena.Concat(statPrefix.data(), statPrefix.size(),
+                                          entry.path.data, entry.path.len));
+      } else {
+         statIndex.push_back(-1);
+      }
+   }
+
+   vector<PathStat> stats;
+   const PathStat noStat;
+   JsonWriter json{out, ndjson};
+
+   statEngine.Stat(statPaths, stats);
+
+   if (!ndjson) {
+      json.BeginArray();
+   }
+   for (size_t i = 0; i < numEntries; ++i) {
+      const PathStat& st = statIndex[i] >= 0 ? stats[statIndex[i]] : noStat;
+      WriteJsonDiffItem(json, entries[i], st, logFile);
+      if (ndjson) {
+         out.put('\n');
+      }
+   }
+   if (!ndjson) {
+      json.EndArray();
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteJsonChunk --
+ *
+ *      Converts a chunk of serialized diff lines into a json file,
+ *      compressed with compress. Runs on the json worker threads.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Emits JSON file
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+WriteJsonChunk(const string&  snapDir,
+               StatEngine&    statEngine,
+               ArenaCounters *arenaCounters,
+               const string&  jsonFileName,
+               bool           compress,
+               const string&  chunk,
+               ostream&       logFile)
+{
+   BufferedWriter jsonDiffFile;
+
+   if (!(compress ? jsonDiffFile.OpenCompressed(jsonFileName)
+                  : jsonDiffFile.Open(jsonFileName))) {
+      LOG_ERROR << "Could not open file: " + jsonFileName << endl;
+      return false;
+   }
+
+   LOG_INFO << "Writing to json file: " + jsonFileName << endl;
+   WriteJsonItems(snapDir, statEngine, arenaCounters, chunk, false, jsonDiffFile,
+                  logFile);
+
+   if (!jsonDiffFile.Close()) {
+      LOG_ERROR << "Error writing file: " + jsonFileName << endl;
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * NextNdjsonSegment --
+ *
+ *      Closes the current NDJSON file, if any, and opens the next one
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Creates the NDJSON file
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+NextNdjsonSegment(NdjsonStream& ndjson,
+                  const string& jsonDir,
+                  ostream&      logFile)
+{
+   if (ndjson.file.IsOpen() && !ndjson.file.Close()) {
+      LOG_ERROR << "Error writing ndjson segment " << ndjson.segmentCount - 1 << endl;
+      return false;
+   }
+
+   string fileName = OutputFileName(jsonDir + separator +
+      (ndjson.segmentLimit > 0 ? to_string(ndjson.segmentCount) : string("diff"))
+      + ".ndjson", ndjson.compress);
+
+   if (!(ndjson.compress ? ndjson.file.OpenCompressed(fileName)
+                         : ndjson.file.Open(fileName))) {
+      LOG_ERROR << "Could not open file: " + fileName << endl;
+      return false;
+   }
+   LOG_INFO << "Writing to json file: " + fileName << endl;
+   ndjson.segmentBytes = 0;
+   ++ndjson.segmentCount;
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteNdjsonRecords --
+ *
+ *      Appends the records of one chunk to the NDJSON output, starting a
+ *      new segment before a record that does not fit into the current one.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Writes to the NDJSON files
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+WriteNdjsonRecords(NdjsonStream& ndjson,
+                   const string& jsonDir,
+                   const string& records,
+                   ostream&      logFile)
+{
+   if (ndjson.segmentCount == 0 && !NextNdjsonSegment(ndjson, jsonDir, logFile)) {
+      return false;
+   }
+
+   if (ndjson.segmentLimit == 0) {
+      ndjson.file.write(records.data(), records.size());
+      return ndjson.compress ? ndjson.file.EndFrame() : ndjson.file.good();
+   }
+
+   const char *pos = records.data();
+   const char *end = pos + records.size();
+   DiffToken record;
+
+   while (NextDiffLine(pos, end, record)) {
+      size_t len = record.len + 1;
+
+      if (ndjson.segmentBytes > 0 && ndjson.segmentBytes + len > ndjson.segmentLimit &&
+          !NextNdjsonSegment(ndjson, jsonDir, logFile)) {
+         return false;
+      }
+      ndjson.file.write(record.data, len);
+      ndjson.segmentBytes += len;
+   }
+   return ndjson.compress ? ndjson.file.EndFrame() : ndjson.file.good();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * CommitNdjsonChunk --
+ *
+ *      Hands the formatted records of a chunk to the NDJSON output. They
+ *      are written once all earlier chunks are, along with any later
+ *      chunks that were waiting for this one.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      May write to the NDJSON files
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+CommitNdjsonChunk(JsonChunkWriter& jsonWriter,
+                  int              chunkNum,
+                  string&&         records,
+                  ostream&         logFile)
+{
+   NdjsonStream& ndjson = jsonWriter.ndjsonStream;
+   lock_guard<mutex> lock(ndjson.streamMutex);
+   bool ok = true;
+
+   ndjson.pending[chunkNum] = std::move(records);
+   while (!ndjson.pending.empty() && ndjson.pending.begin()->first == ndjson.nextChunk) {
+      ok = WriteNdjsonRecords(ndjson, jsonWriter.jsonDir, ndjson.pending.begin()->second,
+                              logFile) && ok;
+      ndjson.pending.erase(ndjson.pending.begin());
+      ++ndjson.nextChunk;
+   }
+   return ok;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * ConvertJsonChunk --
+ *
+ *      Converts chunk number chunkNum into its json file or NDJSON records
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Emits JSON file
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+ConvertJsonChunk(JsonChunkWriter& jsonWriter,
+                 int              chunkNum,
+                 const string&    chunk,
+                 ostream&         logFile)
+{
+   if (!jsonWriter.ndjson) {
+      string jsonFileName = OutputFileName(jsonWriter.jsonDir + separator
+         + to_string(chunkNum) + ".json", jsonWriter.compress);
+
+      return WriteJsonChunk(jsonWriter.snapDir, *jsonWriter.statEngine,
+                            jsonWriter.arenaCounters, jsonFileName,
+                            jsonWriter.compress, chunk, logFile);
+   }
+
+   ostringstream records;
+
+   WriteJsonItems(jsonWriter.snapDir, *jsonWriter.statEngine,
+                  jsonWriter.arenaCounters, chunk, true, records, logFile);
+   return CommitNdjsonChunk(jsonWriter, chunkNum, records.str(), logFile);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * FlushJsonChunk --
+ *
+ *      Converts the diff lines collected so far into the next json file or
+ *      NDJSON records, inline or on a json worker thread
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Emits JSON file, jsonWriter starts a new chunk
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+FlushJsonChunk(JsonChunkWriter& jsonWriter,
+               ostream&         logFile)
+{
+   if (jsonWriter.chunkItems > 0) {
+      int chunkNum = jsonWriter.jsonFileCount;
+
+      if (!jsonWriter.workers) {
+         if (!ConvertJsonChunk(jsonWriter, chunkNum, jsonWriter.chunk, logFile)) {
+            return false;
+         }
+      } else {
+         string chunk;
+
+         chunk.swap(jsonWriter.chunk);
+         jsonWriter.workers->Submit([&jsonWriter, chunkNum, chunk] {
+            ostringstream chunkLog;
+            bool ok = ConvertJsonChunk(jsonWriter, chunkNum, chunk, chunkLog);
+
+            lock_guard<mutex> lock(jsonWriter.resultMutex);
+            jsonWriter.chunkLogs[chunkNum] = chunkLog.str();
+            jsonWriter.failed = jsonWriter.failed || !ok;
+         });
+      }
+      jsonWriter.chunk.clear();
+      jsonWriter.chunkItems = 0;
+   }
+
+   ++jsonWriter.jsonFileCount;
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * AppendJsonDiffItem --
+ *
+ *      Adds one serialized diff entry to the current json chunk. When number
+ *      of json items reaches the chunk size, write to json file to prevent
+ *      file size from becoming too large.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      May emit JSON file
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+AppendJsonDiffItem(JsonChunkWriter& jsonWriter,
+                   const DiffEntry& entry,
+                   ostream&         logFile)
+{
+   if (entry.numTokens < 2 || entry.kind.type == DIFF_TYPE_OTHER) {
+      return true;
+   }
+
+   jsonWriter.chunk.append(entry.line.data, entry.line.len).push_back('\n');
+   if (++jsonWriter.chunkItems >= jsonWriter.chunkSize) {
+      return FlushJsonChunk(jsonWriter, logFile);
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * FinishJson --
+ *
+ *      Writes the last json chunk, waits for the json worker threads and
+ *      closes the NDJSON output
+ *
+ * Results:
+ *      Returns true if all json files were written, false otherwise
+ *
+ * Side effects:
+ *      Log output of the worker threads is added to the log in chunk order
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+FinishJson(JsonChunkWriter& jsonWriter,
+           ostream&         logFile)
+{
+   bool ok = FlushJsonChunk(jsonWriter, logFile);
+
+   if (jsonWriter.workers) {
+      jsonWriter.workers->Wait();
+      for (const auto& chunkLog : jsonWriter.chunkLogs) {
+         logFile << chunkLog.second;
+      }
+      jsonWriter.chunkLogs.clear();
+      ok = ok && !jsonWriter.failed;
+   }
+
+   if (jsonWriter.ndjson) {
+      NdjsonStream& ndjson = jsonWriter.ndjsonStream;
+
+      // An empty diff still gets its (empty) NDJSON file
+      if (ndjson.segmentCount == 0) {
+         ok = NextNdjsonSegment(ndjson, jsonWriter.jsonDir, logFile) && ok;
+      }
+      if (ndjson.file.IsOpen() && !ndjson.file.Close()) {
+         LOG_ERROR << "Error writing ndjson segment " << ndjson.segmentCount - 1 << endl;
+         ok = false;
+      }
+   }
+   return ok;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * GenerateJSON --
+ *
+ *      Emits serialized diff in JSON format
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      Emits JSON file
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+GenerateJSON(const string&              snapDir,
+             const string&              jsonDir,
+             const string&              resultDir,
+             const SnapshotDiffOptions& opts,
+             LatencyHistogram          *statLatency,
+             ArenaCounters             *arenaCounters,
+             ostream&                   logFile)
+{
+   string serialFileName = OutputFileName(resultDir + separator + "serialized_diff",
+                                          opts.compress);
+   unique_ptr<istream> serialFile = OpenInputFile(serialFileName);
+   string diffLine;
+   DiffEntry entry;
+
+   if (!serialFile) {
+      LOG_ERROR << "Could not open file: " + serialFileName << endl;
+      return false;
+   }
+
+   LOG_INFO << "JSONizing diffs from: " + serialFileName << endl;
+
+   JsonChunkWriter jsonWriter{snapDir, jsonDir, opts, statLatency, arenaCounters};
+   bool ok = true;
+
+   while (ok && getline(*serialFile, diffLine, '\n')) {
+      ParseDiffEntry(DiffToken{diffLine.data(), diffLine.size()}, 0, entry);
+      ok = AppendJsonDiffItem(jsonWriter, entry, logFile);
+   }
+   if (serialFile->bad()) {
+      LOG_ERROR << "Error reading file: " + serialFileName << endl;
+      ok = false;
+   }
+
+   return FinishJson(jsonWriter, logFile) && ok;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * InitPathFilter --
+ *
+ *      Sets up filter with the include and exclude rules of opts
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+InitPathFilter(PathFilter&                filter,
+               const SnapshotDiffOptions& opts)
+{
+   for (const char *const *rule = opts.includePaths; rule != NULL && *rule != NULL; ++rule) {
+      filter.Include(*rule);
+   }
+   for (const char *const *rule = opts.excludePaths; rule != NULL && *rule != NULL; ++rule) {
+      filter.Exclude(*rule);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * StagedSnapshotDiff --
+ *
+ *      Runs the diff stage by stage, each stage reading back the files
+ *      written by the previous one. With a checkpoint the stages it
+ *      records as finished are skipped. The stages are timed into metrics.
+ *
+ * Results:
+ *      0 if successful, 1 if error occurred
+ *
+ * Side effects:
+ *      raw, parallel_diff, serialized_diff and serialized_json created in
+ *      resultDir
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+StagedSnapshotDiff(const string&              snapDir,
+                   const string&              snap1,
+                   const string&              snap2,
+                   const string&              resultDir,
+                   const SnapshotDiffOptions& opts,
+                   DiffCheckpoint            *checkpoint,
+                   DiffMetrics&               metrics,
+                   BufferedWriter&            logFile)
+{
+   auto finished = [checkpoint](const char *stage) {
+      return checkpoint != nullptr && checkpoint->stages.count(stage) > 0;
+   };
+   string rawDir = resultDir + separator + "raw";
+   int readNum;
+
+   if (!IsDir(rawDir) && MkDir(rawDir.c_str()) != 0) {
+      LOG_ERROR << "Unable to create directory: " + rawDir << endl;
+      return 1;
+   }
+
+   if (finished(CHECKPOINT_STAGE_RAW)) {
+      readNum = checkpoint->pages;
+   } else {
+      StageTimer timer{metrics.stages, "read"};
+
+      LOG_INFO << "Reading raw diffs" << endl;
+      readNum = ReadRawDiff(snapDir, snap1, snap2, rawDir, opts.compress,
+                            opts.prefetchPages, opts.readBlockSize, nullptr,
+                            checkpoint, &metrics, logFile);
+
+      if (readNum < 0 || !FinishStage(checkpoint, CHECKPOINT_STAGE_RAW, logFile)) {
+         LOG_ERROR << "Issue in reading raw diff" << endl;
+         return 1;
+      }
+      logFile.Flush();
+   }
+
+   if (!finished(CHECKPOINT_STAGE_SERIAL)) {
+      BucketStore store;
+
+      store.bucketsDir = resultDir + separator + "parallel_diff";
+      store.memLimit = opts.bucketMemoryLimit;
+      store.compress = opts.compress;
+      store.arenaCounters = &metrics.arenas;
+      InitPathFilter(store.filter, opts);
+
+      LOG_INFO << "Generating bucketized diffs" << endl;
+      {
+         StageTimer timer{metrics.stages, "bucketize"};
+
+         if (!BucketizeDiff(store, rawDir, readNum, opts.bucketThreads, logFile) ||
+             (!store.filter.Empty() && !FilterStagedBuckets(store, logFile))) {
+            LOG_ERROR << "Issue in bucketizing diff" << endl;
+            return 1;
+         }
+      }
+      logFile.Flush();
+
+      if (opts.compactRenames) {
+         StageTimer timer{metrics.stages, "compact"};
+
+         if (!CompactRenameChains(store, logFile)) {
+            LOG_ERROR << "Issue in compacting renames" << endl;
+            return 1;
+         }
+      }
+      metrics.entries = store.counts;
+
+      StageTimer timer{metrics.stages, "serialize"};
+
+      LOG_INFO << "Generating serialized diffs" << endl;
+      if (!SerializeBuckets(store, resultDir, true,
+                            (opts.outputs & SNAPDIFF_OUTPUT_BINARY) != 0,
+                            (opts.outputs & SNAPDIFF_OUTPUT_DAG) != 0,
+                            (opts.outputs & SNAPDIFF_OUTPUT_SHARDS) ? opts.numShards : 0,
+                            opts.shardDepth, nullptr, nullptr, opts.bucketThreads,
+                            logFile) ||
+          !FinishStage(checkpoint, CHECKPOINT_STAGE_SERIAL, logFile)) {
+         LOG_ERROR << "Issue in serializing diff" << endl;
+         return 1;
+      }
+      logFile.Flush();
+   }
+
+   if (finished(CHECKPOINT_STAGE_JSON)) {
+      return 0;
+   }
+
+   string jsonDir = resultDir + separator + "serialized_json";
+   int status = MkDir(jsonDir.c_str());
+
+   if (status != 0) {
+      LOG_ERROR << "Unable to create directory: " + jsonDir << endl;
+      return 1;
+   }
+
+   if (opts.outputs & SNAPDIFF_OUTPUT_JSON) {
+      StageTimer timer{metrics.stages, "json"};
+
+      LOG_INFO << "Generating json file" << endl;
+      if (!GenerateJSON(snapDir, jsonDir, resultDir, opts, &metrics.stats,
+                        &metrics.arenas, logFile)) {
+         LOG_ERROR << "Issue in generalizing json" << endl;
+         return 1;
+      }
+   }
+
+   return FinishStage(checkpoint, CHECKPOINT_STAGE_JSON, logFile) ? 0 : 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * StreamingSnapshotDiff --
+ *
+ *      Runs the diff in a single pass: every snapdiff page is bucketized as
+ *      soon as it has been read, and the buckets are serialized and turned
+ *      into json together. Only the requested outputs are written, none if
+ *      resultDir is empty. Entries are delivered to entrySink, if set, as
+ *      they are read and/or serialized. With a checkpoint the pages saved
+ *      before are replayed from the raw directory and the read continues
+ *      after them. The read and serialize passes are timed into metrics.
+ *
+ * Results:
+ *      0 if successful, 1 if error occurred
+ *
+ * Side effects:
+ *      Requested outputs created in resultDir
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+StreamingSnapshotDiff(const string&              snapDir,
+                      const string&              snap1,
+                      const string&              snap2,
+                      const string&              resultDir,
+                      const SnapshotDiffOptions& opts,
+                      EntrySink                 *entrySink,
+                      DiffCheckpoint            *checkpoint,
+                      DiffMetrics&               metrics,
+                      BufferedWriter&            logFile)
+{
+   auto finished = [checkpoint](const char *stage) {
+      return checkpoint != nullptr && checkpoint->stages.count(stage) > 0;
+   };
+
+   // Serialization and json generation finish together
+   if (finished(CHECKPOINT_STAGE_SERIAL)) {
+      return 0;
+   }
+
+   unsigned outputs = resultDir.empty() ? 0 : opts.outputs;
+   unsigned delivery = entrySink != nullptr ? entrySink->sink.delivery : 0;
+   string rawDir;
+   string bucketsDir;
+   string jsonDir;
+
+   if (outputs & SNAPDIFF_OUTPUT_RAW) {
+      rawDir = resultDir + separator + "raw";
+   }
+   if (outputs & SNAPDIFF_OUTPUT_PARALLEL) {
+      bucketsDir = resultDir + separator + "parallel_diff";
+   }
+   if (outputs & SNAPDIFF_OUTPUT_JSON) {
+      jsonDir = resultDir + separator + "serialized_json";
+   }
+
+   for (const string& dir : {rawDir, bucketsDir, jsonDir}) {
+      if (!dir.empty() && !IsDir(dir) && MkDir(dir.c_str()) != 0) {
+         LOG_ERROR << "Unable to create directory: " + dir << endl;
+         return 1;
+      }
+   }
+
+   BucketStore store;
+   bool bucketize = (outputs & ~SNAPDIFF_OUTPUT_RAW) != 0 ||
+                    (delivery & SNAPDIFF_DELIVER_SERIALIZED) != 0;
+
+   store.bucketsDir = bucketsDir;
+   store.compress = opts.compress;
+   store.arenaCounters = &metrics.arenas;
+   InitPathFilter(store.filter, opts);
+   if (resultDir.empty()) {
+      // Nowhere to spill to
+      store.memLimit = numeric_limits<size_t>::max();
+   } else {
+      store.spillDir = resultDir + separator + "bucket_spill";
+      store.memLimit = opts.bucketMemoryLimit;
+   }
+
+   unique_ptr<PageBucketizer> bucketizer;
+   vector<StagedEntry> stagedAsRead;
+
+   if (bucketize && opts.bucketThreads > 1) {
+      bucketizer.reset(new PageBucketizer(store, opts.bucketThreads));
+   }
+
+   auto processPage = [&](string& page, int pageNum) {
+      string pageName = "page " + to_string(pageNum);
+
+      if (delivery & SNAPDIFF_DELIVER_AS_READ) {
+         auto deliverEntry = [&](const DiffEntry& entry, bool endOfPage) {
+            if (endOfPage) {
+               return true;
+            }
+            // Held until the staged renames are complete
+            if (!store.filter.Empty() && TouchesStaging(entry)) {
+               stagedAsRead.push_back(StagedEntry{entry.level, entry.line.Str(), string()});
+               return true;
+            }
+            return AppendDiffEntry(*entrySink, SNAPDIFF_DELIVER_AS_READ, entry, logFile);
+         };
+
+         if (!ForEachPageEntry(page, pageName, store.filter, deliverEntry, nullptr,
+                               logFile)) {
+            return false;
+         }
+      }
+      if (bucketizer) {
+         SubmitPage(*bucketizer, pageName, string(), std::move(page));
+         return MergePages(*bucketizer, false, logFile);
+      }
+      return !bucketize || BucketizePage(store, page, pageName, logFile);
+   };
+
+   unique_ptr<StageTimer> timer{new StageTimer(metrics.stages, "read")};
+   int readNum = 0;
+
+   if (checkpoint != nullptr && checkpoint->pages > 0 &&
+       (bucketize || (delivery & SNAPDIFF_DELIVER_AS_READ) != 0) &&
+       !ReplayRawDiff(rawDir, opts.compress, checkpoint->pages, processPage, logFile)) {
+      readNum = -1;
+   }
+
+   if (readNum == 0 && !finished(CHECKPOINT_STAGE_RAW)) {
+      LOG_INFO << "Reading and bucketizing raw diffs" << endl;
+      readNum = ReadRawDiff(snapDir, snap1, snap2, rawDir, opts.compress,
+                            opts.prefetchPages, opts.readBlockSize, processPage,
+                            checkpoint, &metrics, logFile);
+   }
+
+   if (readNum >= 0 && bucketizer && !MergePages(*bucketizer, true, logFile)) {
+      readNum = -1;
+   }
+   bucketizer.reset();
+   if (readNum >= 0 && bucketize && !store.filter.Empty() &&
+       !FilterStagedBuckets(store, logFile)) {
+      readNum = -1;
+   }
+   if (readNum >= 0 && !stagedAsRead.empty() &&
+       !DeliverStagedEntries(*entrySink, store.filter, stagedAsRead, logFile)) {
+      readNum = -1;
+   }
+   metrics.entries = store.counts;
+
+   if (readNum < 0 ||
+       (entrySink != nullptr && !FinishDiffEntries(*entrySink, logFile)) ||
+       !FinishStage(checkpoint, CHECKPOINT_STAGE_RAW, logFile)) {
+      LOG_ERROR << "Issue in reading raw diff" << endl;
+      return 1;
+   }
+   logFile.Flush();
+   timer.reset();
+
+   if (!bucketize) {
+      return 0;
+   }
+
+   if (opts.compactRenames) {
+      timer.reset(new StageTimer(metrics.stages, "compact"));
+      if (!CompactRenameChains(store, logFile)) {
+         LOG_ERROR << "Issue in compacting renames" << endl;
+         return 1;
+      }
+      metrics.entries = store.counts;
+   }
+
+   timer.reset(new StageTimer(metrics.stages, "serialize"));
+
+   JsonChunkWriter jsonWriter{snapDir, jsonDir, opts, &metrics.stats, &metrics.arenas};
+   bool genJson = (outputs & SNAPDIFF_OUTPUT_JSON) != 0;
+   EntrySink *serialSink = (delivery & SNAPDIFF_DELIVER_SERIALIZED) ? entrySink : nullptr;
+
+   LOG_INFO << "Generating serialized diffs" << (genJson ? " and json files" : "") << endl;
+   if (!SerializeBuckets(store, resultDir,
+                         (outputs & SNAPDIFF_OUTPUT_SERIALIZED) != 0,
+                         (outputs & SNAPDIFF_OUTPUT_BINARY) != 0,
+                         (outputs & SNAPDIFF_OUTPUT_DAG) != 0,
+                         (outputs & SNAPDIFF_OUTPUT_SHARDS) ? opts.numShards : 0,
+                         opts.shardDepth, genJson ? &jsonWriter : nullptr,
+                         serialSink, opts.bucketThreads, logFile) ||
+       (genJson && !FinishJson(jsonWriter, logFile)) ||
+       (serialSink != nullptr && !FinishDiffEntries(*serialSink, logFile)) ||
+       !FinishStage(checkpoint, CHECKPOINT_STAGE_SERIAL, logFile)) {
+      LOG_ERROR << "Issue in serializing diff" << endl;
+      return 1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapshotDiffOptionsInit --
+ *
+ *      Initializes opts with the behavior of GetSnapshotDiff: staged
+ *      processing with all outputs
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" void
+SnapshotDiffOptionsInit(SnapshotDiffOptions *opts)
+{
+   opts->streaming = false;
+   opts->outputs = SNAPDIFF_OUTPUT_ALL;
+   opts->prefetchPages = DEFAULT_PREFETCH_PAGES;
+   opts->readBlockSize = DEFAULT_READ_BLOCK_SIZE;
+   opts->bucketMemoryLimit = DEFAULT_BUCKET_MEMORY_LIMIT;
+   opts->bucketThreads = DEFAULT_BUCKET_THREADS;
+   opts->jsonThreads = DEFAULT_JSON_THREADS;
+   opts->statThreads = DEFAULT_STAT_THREADS;
+   opts->jsonChunkSize = DEFAULT_JSON_CHUNK_SIZE;
+   opts->ndjson = false;
+   opts->ndjsonSegmentSize = 0;
+   opts->resume = false;
+   opts->compactRenames = false;
+   opts->metricsTextfile = NULL;
+   opts->numShards = DEFAULT_SHARDS;
+   opts->shardDepth = 1;
+   opts->includePaths = NULL;
+   opts->excludePaths = NULL;
+   opts->compress = false;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * GetSnapshotDiff --
+ *
+ *      Reads diff between snap1 and snap2 and outputs ordered/bucketized
+ *      diffs by level
+ *
+ * Results:
+ *      0 if successful, 1 if error occurred
+ *
+ * Side effects:
+ *      diffdir directory created and populated (see README.md)
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" int
+GetSnapshotDiff(const char *snapDir,
+                const char *snap1,
+                const char *snap2,
+                const char *resultDir,
+                bool        genJsonOutput)
+{
+   SnapshotDiffOptions opts;
+
+   SnapshotDiffOptionsInit(&opts);
+   if (!genJsonOutput) {
+      opts.outputs &= ~SNAPDIFF_OUTPUT_JSON;
+   }
+
+   return GetSnapshotDiffEx(snapDir, snap1, snap2, resultDir, &opts);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * OutputBytes --
+ *
+ *      Returns the size of an output: of the file, or of the files in the
+ *      directory
+ *
+ * Results:
+ *      The size in bytes, 0 if the output does not exist
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static unsigned long long
+OutputBytes(const string& path)
+{
+#ifdef _WIN32
+   struct _stat64 s;
+#define STAT_OUTPUT _stat64
+#else
+   struct stat s;
+#define STAT_OUTPUT stat
+#endif
+   unsigned long long bytes = 0;
+   DIR *dir;
+   struct dirent *dp;
+
+   if (!IsDir(path)) {
+      return STAT_OUTPUT(path.c_str(), &s) == 0 ? s.st_size : 0;
+   }
+
+   dir = opendir(path.c_str());
+   while (dir != NULL && (dp = readdir(dir)) != NULL) {
+      if (STAT_OUTPUT((path + separator + dp->d_name).c_str(), &s) == 0 &&
+          (s.st_mode & S_IFREG)) {
+         bytes += s.st_size;
+      }
+   }
+   if (dir != NULL) {
+      closedir(dir);
+   }
+#undef STAT_OUTPUT
+   return bytes;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteLatencyJson --
+ *
+ *      Writes a latency histogram as json object, with the number of
+ *      samples of each bucket keyed by its upper bound in microseconds
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+WriteLatencyJson(JsonWriter&             json,
+                 const LatencyHistogram& histogram)
+{
+   json.BeginObject();
+   json.Key("count");
+   json.Number(histogram.TotalCount());
+   json.Key("sum_us");
+   json.Number(histogram.SumUs());
+   json.Key("buckets");
+   json.BeginObject();
+   for (int bucket = 0; bucket <= LATENCY_NUM_BOUNDS; ++bucket) {
+      json.Key(bucket < LATENCY_NUM_BOUNDS ?
+               to_string(latencyBoundsUs[bucket]).c_str() : "inf");
+      json.Number(histogram.Count(bucket));
+   }
+   json.EndObject();
+   json.EndObject();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteMetricsJson --
+ *
+ *      Writes the metrics of a diff run as json to fileName
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+WriteMetricsJson(const DiffMetrics& metrics,
+                 bool               success,
+                 const string&      fileName,
+                 ostream&           logFile)
+{
+   BufferedWriter file{WRITER_SMALL_BUFSIZE};
+
+   if (!file.Open(fileName)) {
+      LOG_ERROR << "Could not open file: " + fileName << endl;
+      return false;
+   }
+
+   JsonWriter json{file};
+
+   json.BeginObject();
+   json.Key("success");
+   json.Bool(success);
+   json.Key("stages");
+   json.BeginArray();
+   for (const StageTime& stage : metrics.stages) {
+      json.BeginObject();
+      json.Key("name");
+      json.String(stage.name);
+      json.Key("wall_us");
+      json.Number(stage.wallUs);
+      json.Key("cpu_us");
+      json.Number(stage.cpuUs);
+      json.EndObject();
+   }
+   json.EndArray();
+   json.Key("pages_read");
+   json.Number(metrics.pagesRead);
+   json.Key("bytes_read");
+   json.Number(metrics.bytesRead);
+   json.Key("bytes_written");
+   json.BeginObject();
+   for (const auto& output : metrics.bytesWritten) {
+      json.Key(output.first.c_str());
+      json.Number(output.second);
+   }
+   json.EndObject();
+   json.Key("open_retries");
+   json.Number(metrics.openRetries);
+   json.Key("read_retries");
+   json.Number(metrics.readRetries);
+   json.Key("entries");
+   json.Number(metrics.entries.total);
+   json.Key("entries_filtered");
+   json.Number(metrics.entries.filtered);
+   json.Key("entries_by_op");
+   json.BeginObject();
+   for (const auto& op : metrics.entries.byOp) {
+      json.Key(op.first.c_str(), op.first.size());
+      json.Number(op.second);
+   }
+   json.EndObject();
+   json.Key("entries_by_level");
+   json.BeginObject();
+   for (const auto& level : metrics.entries.byLevel) {
+      json.Key(to_string(level.first).c_str());
+      json.Number(level.second);
+   }
+   json.EndObject();
+   json.Key("page_open_latency");
+   WriteLatencyJson(json, metrics.pageOpens);
+   json.Key("stat_latency");
+   WriteLatencyJson(json, metrics.stats);
+   json.Key("arena_blocks");
+   json.Number(metrics.arenas.blocks);
+   json.Key("arena_block_bytes");
+   json.Number(metrics.arenas.blockBytes);
+   json.Key("arena_allocations");
+   json.Number(metrics.arenas.allocs);
+   json.EndObject();
+   file << '\n';
+
+   if (!file.Close()) {
+      LOG_ERROR << "Error writing file: " + fileName << endl;
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * PromLabel --
+ *
+ *      Escapes a Prometheus label value
+ *
+ * Results:
+ *      The escaped value
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
 
-         istringstream lineStream{diffLine};
-         string token;
-         vector<string> diffLineList;
+static string
+PromLabel(const string& value)
+{
+   string escaped;
+
+   for (char c : value) {
+      if (c == '\\' || c == '"') {
+         escaped.push_back('\\');
+         escaped.push_back(c);
+      } else if (c == '\n') {
+         escaped += "\\n";
+      } else {
+         escaped.push_back(c);
+      }
+   }
+   return escaped;
+}
 
-         while (lineStream >> token) {
-            diffLineList.push_back(token);
-         }
 
-         string op = diffLineList[0];
-         string path = diffLineList[1];
-         int split = op.find("_");
-         string entrytype = op.substr(0, split);
-         string optype = op.substr(split + 1, op.length());
-         auto diffItem = std::make_unique<JsonMap>();
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteLatencyProm --
+ *
+ *      Writes a latency histogram as Prometheus histogram in seconds
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
 
-         if (entrytype == "FILE" || entrytype == "DIR") {
-            if (optype == "DELETE") {
-               diffItem->Add("type", new JsonString("delete"));
-               diffItem->Add("object_type", new JsonString(entrytype == "FILE" ? "file" : "dir"));
-               diffItem->Add("path", new JsonString(path));
+static void
+WriteLatencyProm(ostream&                out,
+                 const char             *name,
+                 const char             *help,
+                 const LatencyHistogram& histogram)
+{
+   unsigned long long cumulative = 0;
+
+   out << "# HELP " << name << ' ' << help << '\n'
+       << "# TYPE " << name << " histogram\n";
+   for (int bucket = 0; bucket < LATENCY_NUM_BOUNDS; ++bucket) {
+      cumulative += histogram.Count(bucket);
+      out << name << "_bucket{le=\"" << latencyBoundsUs[bucket] / 1e6 << "\"} "
+          << cumulative << '\n';
+   }
+   out << name << "_bucket{le=\"+Inf\"} " << histogram.TotalCount() << '\n'
+       << name << "_sum " << histogram.SumUs() / 1e6 << '\n'
+       << name << "_count " << histogram.TotalCount() << '\n';
+}
 
-               diffItems.push_back(JsonObjectPtr(diffItem.release()));
-            } else if (optype == "RENAME") {
-               diffItem->Add("type", new JsonString("rename"));
-               diffItem->Add("path_old", new JsonString(path));
-               diffItem->Add("path_new", new JsonString(diffLineList[2]));
 
-               diffItems.push_back(JsonObjectPtr(diffItem.release()));
-            } else {
-               if (MakeStatsJsonMap(diffItem.get(), snapDir, path) == false) {
-                  LOG_ERROR << "Could not stat file: " + path << endl;
-               }
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteMetricsProm --
+ *
+ *      Writes the metrics of a diff run in the Prometheus text format, as
+ *      read by the textfile collector of node_exporter. The file is
+ *      replaced atomically, so the collector never sees a partial file.
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
 
-               diffItem->Add("type", new JsonString(entrytype == "FILE" ? "file" : "dir"));
-               diffItem->Add("created", new JsonBool(optype.find('C') != string::npos ? "true" : "false"));
-               diffItem->Add("modified", new JsonBool(optype.find('M') != string::npos ? "true" : "false"));
-               diffItem->Add("stat", new JsonBool(optype.find('S') != string::npos ? "true" : "false"));
-               diffItem->Add("xattr", new JsonBool(optype.find('X') != string::npos ? "true" : "false"));
+static bool
+WriteMetricsProm(const DiffMetrics& metrics,
+                 const string&      snapDir,
+                 const string&      snap1,
+                 const string&      snap2,
+                 bool               success,
+                 const string&      fileName,
+                 ostream&           logFile)
+{
+   string tmpFileName = fileName + ".tmp";
+   BufferedWriter file{WRITER_SMALL_BUFSIZE};
 
-               diffItems.push_back(JsonObjectPtr(diffItem.release()));
-            }
-         } else if (entrytype == "SYM") {
-            if (optype == "DELETE") {
-               diffItem->Add("type", new JsonString("delete"));
-               diffItem->Add("object_type", new JsonString("symlink"));
-               diffItem->Add("path", new JsonString(diffLineList[1]));
+   if (!file.Open(tmpFileName)) {
+      LOG_ERROR << "Could not open file: " + tmpFileName << endl;
+      return false;
+   }
 
-               diffItems.push_back(JsonObjectPtr(diffItem.release()));
-            } else {
-               if (MakeStatsJsonMap(diffItem.get(), snapDir, path) == false) {
-                  LOG_ERROR << "Could not stat file: " + path << endl;
-               }
+   auto gauge = [&file](const char *name, const char *help) {
+      file << "# HELP " << name << ' ' << help << '\n'
+           << "# TYPE " << name << " gauge\n";
+   };
+
+   gauge("snapdiff_info", "Snapshots of the last snapshot diff");
+   file << "snapdiff_info{snapdir=\"" << PromLabel(snapDir) << "\",snap1=\""
+        << PromLabel(snap1) << "\",snap2=\"" << PromLabel(snap2) << "\"} 1\n";
+   gauge("snapdiff_success", "Whether the last snapshot diff succeeded");
+   file << "snapdiff_success " << (success ? 1 : 0) << '\n';
+   gauge("snapdiff_end_time_seconds", "End time of the last snapshot diff");
+   file << "snapdiff_end_time_seconds " << (long long)time(NULL) << '\n';
+
+   gauge("snapdiff_stage_wall_seconds", "Wall time of a snapshot diff stage");
+   for (const StageTime& stage : metrics.stages) {
+      file << "snapdiff_stage_wall_seconds{stage=\"" << stage.name << "\"} "
+           << stage.wallUs / 1e6 << '\n';
+   }
+   gauge("snapdiff_stage_cpu_seconds", "CPU time of a snapshot diff stage");
+   for (const StageTime& stage : metrics.stages) {
+      file << "snapdiff_stage_cpu_seconds{stage=\"" << stage.name << "\"} "
+           << stage.cpuUs / 1e6 << '\n';
+   }
 
-               diffItem->Add("type", new JsonString("symlink"));
-               if (optype.find('C') != string::npos) {
-                  diffItem->Add("created", new JsonBool(true));
-                  diffItem->Add("target", new JsonString(diffLineList[2]));
-               } else {
-                  diffItem->Add("created", new JsonBool(false));
-               }
-               diffItem->Add("stat", new JsonBool(optype.find('S') != string::npos ? "true" : "false"));
+   gauge("snapdiff_pages_read", "Snapdiff pages read");
+   file << "snapdiff_pages_read " << metrics.pagesRead << '\n';
+   gauge("snapdiff_read_bytes", "Bytes of snapdiff pages read");
+   file << "snapdiff_read_bytes " << metrics.bytesRead << '\n';
+   gauge("snapdiff_written_bytes", "Bytes of an output written");
+   for (const auto& output : metrics.bytesWritten) {
+      file << "snapdiff_written_bytes{output=\"" << output.first << "\"} "
+           << output.second << '\n';
+   }
+   gauge("snapdiff_open_retries", "Snapdiff page opens retried");
+   file << "snapdiff_open_retries " << metrics.openRetries << '\n';
+   gauge("snapdiff_read_retries", "Snapdiff page reads retried");
+   file << "snapdiff_read_retries " << metrics.readRetries << '\n';
+
+   gauge("snapdiff_entries", "Diff entries by op");
+   for (const auto& op : metrics.entries.byOp) {
+      file << "snapdiff_entries{op=\"" << PromLabel(op.first) << "\"} "
+           << op.second << '\n';
+   }
+   gauge("snapdiff_filtered_entries", "Diff entries dropped by the path filter");
+   file << "snapdiff_filtered_entries " << metrics.entries.filtered << '\n';
+   gauge("snapdiff_level_entries", "Diff entries by level");
+   for (const auto& level : metrics.entries.byLevel) {
+      file << "snapdiff_level_entries{level=\"" << level.first << "\"} "
+           << level.second << '\n';
+   }
+   gauge("snapdiff_arena_blocks", "Heap blocks taken by the scratch arenas");
+   file << "snapdiff_arena_blocks " << metrics.arenas.blocks << '\n';
+   gauge("snapdiff_arena_block_bytes", "Bytes of the scratch arena blocks");
+   file << "snapdiff_arena_block_bytes " << metrics.arenas.blockBytes << '\n';
+   gauge("snapdiff_arena_allocations", "Allocations served by the scratch arenas");
+   file << "snapdiff_arena_allocations " << metrics.arenas.allocs << '\n';
+
+   WriteLatencyProm(file, "snapdiff_page_open_seconds",
+                    "Latency of snapdiff page opens", metrics.pageOpens);
+   WriteLatencyProm(file, "snapdiff_stat_seconds",
+                    "Latency of stat calls for the json output", metrics.stats);
+
+   if (!file.Close()) {
+      LOG_ERROR << "Error writing file: " + tmpFileName << endl;
+      return false;
+   }
+   return ReplaceFile(tmpFileName, fileName, logFile);
+}
 
-               diffItems.push_back(JsonObjectPtr(diffItem.release()));
-            }
-         }
-      }
 
-      if (diffItems.size() > 0) {
-         string jsonFileName = jsonDir + separator + to_string(jsonFileCount) + ".json";
-         ofstream jsonDiffFile{jsonFileName};
+/*
+ *------------------------------------------------------------------------
+ *
+ * WriteMetrics --
+ *
+ *      Writes the metrics of a diff run to metrics.json and metrics.prom in
+ *      resultDir, if set, and to the Prometheus textfile of the options,
+ *      if set
+ *
+ * Results:
+ *      Returns true if successful, false otherwise
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
 
-         if (!jsonDiffFile.is_open()) {
-            LOG_ERROR << "Could not open file: " + jsonFileName << endl;
-            return false;
+static bool
+WriteMetrics(DiffMetrics&               metrics,
+             const string&              snapDir,
+             const string&              snap1,
+             const string&              snap2,
+             const char                *resultDir,
+             const SnapshotDiffOptions& opts,
+             bool                       success,
+             ostream&                   logFile)
+{
+   bool ok = true;
+
+   if (resultDir != NULL) {
+      string dir = resultDir;
+
+      for (const char *output : {"raw", "parallel_diff", "serialized_diff",
+                                 "serialized_diff.bin", "serialized_json"}) {
+         string fileName = dir + separator + output;
+
+         if (strcmp(output, "serialized_diff") == 0) {
+            fileName = OutputFileName(fileName, opts.compress);
          }
 
-         LOG_INFO << "Writing to json file: " + jsonFileName << endl;
-         diffItems.Dump(jsonDiffFile);
-         jsonDiffFile.close();
+         unsigned long long bytes = OutputBytes(fileName);
+
+         if (bytes > 0) {
+            metrics.bytesWritten[output] = bytes;
+         }
       }
 
-      ++jsonFileCount;
+      ok = WriteMetricsJson(metrics, success, dir + separator + "metrics.json",
+                            logFile) &&
+           WriteMetricsProm(metrics, snapDir, snap1, snap2, success,
+                            dir + separator + "metrics.prom", logFile);
    }
 
-   return true;
+   if (opts.metricsTextfile != NULL &&
+       !WriteMetricsProm(metrics, snapDir, snap1, snap2, success,
+                         opts.metricsTextfile, logFile)) {
+      ok = false;
+   }
+   return ok;
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * GetSnapshotDiff --
+ * RunSnapshotDiff --
  *
- *      Reads diff between snap1 and snap2 and outputs ordered/bucketized
- *      diffs by level
+ *      Common part of GetSnapshotDiffEx and GetSnapshotDiffStream: checks
+ *      the result directory, if any, opens the log in it and runs the diff
  *
  * Results:
  *      0 if successful, 1 if error occurred
@@ -709,29 +5868,58 @@ GenerateJSON(const string&  snapDir,
  *------------------------------------------------------------------------
  */
 
-extern "C" int
-GetSnapshotDiff(const char *snapDir,
-                const char *snap1,
-                const char *snap2,
-                const char *resultDir,
-                bool        genJsonOutput)
+static int
+RunSnapshotDiff(const char                *snapDir,
+                const char                *snap1,
+                const char                *snap2,
+                const char                *resultDir,
+                const SnapshotDiffOptions *opts,
+                const SnapshotDiffSink    *sink)
 {
-   if (!IsDir(resultDir)) {
-      cerr << "Result directory " << resultDir << " is not a directory." << endl;
-      return 1;
+   string logFileName;
+   BufferedWriter logFile;
+   DiffCheckpoint checkpoint;
+   DiffMetrics metrics;
+   unique_ptr<EntrySink> entrySink;
+   bool resuming = false;
+
+   if (opts->resume) {
+      if (resultDir == NULL) {
+         cerr << "Resuming requires a result directory." << endl;
+         return 1;
+      }
+      if ((opts->streaming || sink != NULL) &&
+          (opts->outputs & SNAPDIFF_OUTPUT_RAW) == 0) {
+         cerr << "Resuming a streaming diff requires the raw output." << endl;
+         return 1;
+      }
+      checkpoint.fileName = resultDir + separator + "checkpoint";
    }
 
-   if (!IsDirEmpty(resultDir)) {
-      cerr << "Result directory " << resultDir << " is not empty." << endl;
+   if (opts->compress && !compressionSupported) {
+      cerr << "Compression is not supported by this build." << endl;
       return 1;
    }
 
-   string logFileName = resultDir + separator + "out.log";
-   ofstream logFile {logFileName.c_str()};
+   if (resultDir != NULL) {
+      if (!IsDir(resultDir)) {
+         cerr << "Result directory " << resultDir << " is not a directory." << endl;
+         return 1;
+      }
 
-   if (!logFile.is_open()) {
-      cerr << "Could not open log file: " << logFileName << endl;
-      return 1;
+      if (!IsDirEmpty(resultDir)) {
+         resuming = opts->resume && ifstream(checkpoint.fileName).is_open();
+         if (!resuming) {
+            cerr << "Result directory " << resultDir << " is not empty." << endl;
+            return 1;
+         }
+      }
+
+      logFileName = resultDir + separator + "out.log";
+      if (!logFile.Open(logFileName, resuming)) {
+         cerr << "Could not open log file: " << logFileName << endl;
+         return 1;
+      }
    }
 
 #ifndef _WIN32
@@ -745,54 +5933,301 @@ GetSnapshotDiff(const char *snapDir,
    LOG_INFO << "snapDir: " << snapDir << endl;
    LOG_INFO << "snap1: " << snap1 << endl;
    LOG_INFO << "snap2: " << snap2 << endl;
-   LOG_INFO << "resultDir: " << resultDir << endl;
+   LOG_INFO << "resultDir: " << (resultDir != NULL ? resultDir : "") << endl;
+   LOG_INFO << "streaming: " << opts->streaming << endl;
+   LOG_INFO << "outputs: 0x" << hex << opts->outputs << dec << endl;
+   LOG_INFO << "prefetchPages: " << opts->prefetchPages << endl;
+   LOG_INFO << "readBlockSize: " << opts->readBlockSize << endl;
+   LOG_INFO << "bucketMemoryLimit: " << opts->bucketMemoryLimit << endl;
+   LOG_INFO << "bucketThreads: " << opts->bucketThreads << endl;
+   LOG_INFO << "jsonThreads: " << opts->jsonThreads << endl;
+   LOG_INFO << "statThreads: " << opts->statThreads << endl;
+   LOG_INFO << "jsonChunkSize: " << opts->jsonChunkSize << endl;
+   LOG_INFO << "ndjson: " << opts->ndjson << endl;
+   LOG_INFO << "ndjsonSegmentSize: " << opts->ndjsonSegmentSize << endl;
+   LOG_INFO << "resume: " << opts->resume << endl;
+   LOG_INFO << "compactRenames: " << opts->compactRenames << endl;
+   LOG_INFO << "numShards: " << opts->numShards << endl;
+   LOG_INFO << "shardDepth: " << opts->shardDepth << endl;
+   LOG_INFO << "compress: " << opts->compress << endl;
+   for (const char *const *rule = opts->includePaths; rule != NULL && *rule != NULL; ++rule) {
+      LOG_INFO << "include: " << *rule << endl;
+   }
+   for (const char *const *rule = opts->excludePaths; rule != NULL && *rule != NULL; ++rule) {
+      LOG_INFO << "exclude: " << *rule << endl;
+   }
+   LOG_INFO << "metricsTextfile: "
+            << (opts->metricsTextfile != NULL ? opts->metricsTextfile : "") << endl;
+   if (sink != NULL) {
+      LOG_INFO << "delivery: 0x" << hex << sink->delivery << dec << endl;
+      LOG_INFO << "withStat: " << sink->withStat << endl;
+      entrySink.reset(new EntrySink(*sink, snapDir, opts->statThreads,
+                                    &metrics.stats, &metrics.arenas));
+   }
 
-   string rawDir = resultDir + separator + "raw";
-   int status = MkDir(rawDir.c_str());
+   if (opts->resume) {
+      string id = CheckpointId(snapDir, snap1, snap2, *opts);
+
+      if (resuming) {
+         if (!LoadCheckpoint(checkpoint, logFile)) {
+            logFile.Close();
+            return 1;
+         }
+         if (checkpoint.id != id) {
+            LOG_ERROR << "Checkpoint is for a different diff: " << checkpoint.id << endl;
+            logFile.Close();
+            return 1;
+         }
+         if (!PrepareResume(checkpoint, resultDir, logFile)) {
+            logFile.Close();
+            return 1;
+         }
+      } else {
+         checkpoint.id = id;
+         if (!SaveCheckpoint(checkpoint, logFile)) {
+            logFile.Close();
+            return 1;
+         }
+      }
+   }
+
+   DiffCheckpoint *progress = opts->resume ? &checkpoint : nullptr;
+   int status;
+
+   if (opts->streaming || entrySink) {
+      status = StreamingSnapshotDiff(snapDir, snap1, snap2,
+                                     resultDir != NULL ? resultDir : "", *opts,
+                                     entrySink.get(), progress, metrics, logFile);
+   } else {
+      status = StagedSnapshotDiff(snapDir, snap1, snap2, resultDir, *opts,
+                                  progress, metrics, logFile);
+   }
+
+   if (!WriteMetrics(metrics, snapDir, snap1, snap2, resultDir, *opts,
+                     status == 0, logFile) && status == 0) {
+      status = 1;
+   }
 
    if (status != 0) {
-      LOG_ERROR << "Unable to create directory: " + rawDir << endl;
-      return 1;
+      logFile.Close();
+      return status;
    }
 
-   LOG_INFO << "Reading raw diffs" << endl;
-   int readNum = ReadRawDiff(snapDir, snap1, snap2, rawDir, logFile);
+   // The diff is complete, nothing to resume anymore
+   if (opts->resume && remove(checkpoint.fileName.c_str()) != 0) {
+      LOG_ERROR << "Could not remove checkpoint: " + checkpoint.fileName << endl;
+   }
 
-   if (readNum < 0) {
-      LOG_ERROR << "Issue in reading raw diff" << endl;
+   LOG_INFO << "Snapshot diff completed successfully" << endl;
+   if (logFile.IsOpen() && !logFile.Close()) {
+      cerr << "Could not write log file: " << logFileName << endl;
       return 1;
    }
+   return 0;
+}
 
-   BucketFileMap buckets;
 
-   LOG_INFO << "Generating bucketized diffs" << endl;
-   if (!BucketizeDiff(buckets, rawDir, readNum, resultDir, logFile)) {
-      LOG_ERROR << "Issue in bucketizing diff" << endl;
-      return 1;
+/*
+ *------------------------------------------------------------------------
+ *
+ * GetSnapshotDiffEx --
+ *
+ *      Reads diff between snap1 and snap2 and outputs ordered/bucketized
+ *      diffs by level, as selected by opts (defaults if NULL)
+ *
+ * Results:
+ *      0 if successful, 1 if error occurred
+ *
+ * Side effects:
+ *      diffdir directory created and populated (see README.md)
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" int
+GetSnapshotDiffEx(const char                *snapDir,
+                  const char                *snap1,
+                  const char                *snap2,
+                  const char                *resultDir,
+                  const SnapshotDiffOptions *opts)
+{
+   SnapshotDiffOptions defaultOpts;
+
+   if (opts == NULL) {
+      SnapshotDiffOptionsInit(&defaultOpts);
+      opts = &defaultOpts;
    }
 
-   LOG_INFO << "Generating serialized diffs" << endl;
-   if (!SerializeBuckets(&buckets, resultDir, logFile)) {
-      LOG_ERROR << "Issue in serializing diff" << endl;
+   return RunSnapshotDiff(snapDir, snap1, snap2, resultDir, opts, NULL);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * GetSnapshotDiffStream --
+ *
+ *      Reads diff between snap1 and snap2 in a single pass and delivers
+ *      its entries to the callback of sink. Outputs are written only if
+ *      resultDir is given.
+ *
+ * Results:
+ *      0 if successful, 1 if error occurred or the callback aborted
+ *
+ * Side effects:
+ *      Calls the callback, resultDir populated if given
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" int
+GetSnapshotDiffStream(const char                *snapDir,
+                      const char                *snap1,
+                      const char                *snap2,
+                      const char                *resultDir,
+                      const SnapshotDiffOptions *opts,
+                      const SnapshotDiffSink    *sink)
+{
+   SnapshotDiffOptions defaultOpts;
+
+   if (sink == NULL || sink->callback == NULL) {
+      cerr << "No entry callback given." << endl;
       return 1;
    }
 
-   string jsonDir = resultDir + separator + "serialized_json";
-   status = MkDir(jsonDir.c_str());
+   if (opts == NULL) {
+      SnapshotDiffOptionsInit(&defaultOpts);
+      opts = &defaultOpts;
+   }
 
-   if (status != 0) {
-      LOG_ERROR << "Unable to create directory: " + jsonDir << endl;
-      return 1;
+   return RunSnapshotDiff(snapDir, snap1, snap2, resultDir, opts, sink);
+}
+
+
+/*
+ * Reader of an output file, see SnapDiffReaderOpen
+ */
+struct SnapDiffReader {
+   unique_ptr<istream> file;
+};
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapDiffReaderOpen --
+ *
+ *      Opens an output file for reading, decompressing it if its name
+ *      carries the suffix of the codec the library was built with
+ *
+ * Results:
+ *      The reader, NULL if the file could not be opened
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" SnapDiffReader *
+SnapDiffReaderOpen(const char *fileName)
+{
+   unique_ptr<istream> file = OpenInputFile(fileName);
+
+   return file ? new SnapDiffReader{std::move(file)} : NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapDiffReaderOpenLevel --
+ *
+ *      Opens the frame of one level of a compressed serialized diff, as
+ *      found in its .levels index (see WriteLevelIndex)
+ *
+ * Results:
+ *      The reader, NULL if the file, its index or the level in it could
+ *      not be found
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" SnapDiffReader *
+SnapDiffReaderOpenLevel(const char *serializedDiff,
+                        int         level)
+{
+   ifstream index{string(serializedDiff) + ".levels"};
+   int frameLevel;
+   unsigned long long offset;
+   unsigned long long length;
+
+   if (!compressionSupported) {
+      return NULL;
    }
+   while (index >> frameLevel >> offset >> length) {
+      if (frameLevel == level) {
+         unique_ptr<CompressedReader> file{
+            new CompressedReader(serializedDiff, offset, length)};
 
-   if (genJsonOutput) {
-      LOG_INFO << "Generating json file" << endl;
-      if (!GenerateJSON(snapDir, jsonDir, resultDir, logFile)) {
-         LOG_ERROR << "Issue in generalizing json" << endl;
-         return 1;
+         return file->is_open() ? new SnapDiffReader{std::move(file)} : NULL;
       }
    }
+   return NULL;
+}
 
-   LOG_INFO << "Snapshot diff completed successfully" << endl;
-   return 0;
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapDiffReaderRead --
+ *
+ *      Reads up to len bytes of the (decompressed) data into buf
+ *
+ * Results:
+ *      The number of bytes read, 0 at the end of the data, -1 on a read
+ *      error or corrupt or truncated compressed data
+ *
+ * Side effects:
+ *      None.
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" long long
+SnapDiffReaderRead(SnapDiffReader *reader,
+                   char           *buf,
+                   size_t          len)
+{
+   reader->file->read(buf, len);
+   if (reader->file->bad()) {
+      return -1;
+   }
+   return reader->file->gcount();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * SnapDiffReaderClose --
+ *
+ *      Closes a reader
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      reader is freed
+ *
+ *------------------------------------------------------------------------
+ */
+
+extern "C" void
+SnapDiffReaderClose(SnapDiffReader *reader)
+{
+   delete reader;
 }
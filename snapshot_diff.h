@@ -6,16 +6,249 @@
 #ifndef __SNAPSHOT_DIFF_H__
 #define __SNAPSHOT_DIFF_H__
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
+/*
+ * Output selection bits for SnapshotDiffOptions.outputs. Without streaming
+ * the raw, parallel and serialized outputs are always produced since the
+ * later stages read them back.
+ */
+#define SNAPDIFF_OUTPUT_RAW        0x1   /* raw/<n> snapdiff pages */
+#define SNAPDIFF_OUTPUT_PARALLEL   0x2   /* parallel_diff/<level> */
+#define SNAPDIFF_OUTPUT_SERIALIZED 0x4   /* serialized_diff */
+#define SNAPDIFF_OUTPUT_JSON       0x8   /* serialized_json/ */
+#define SNAPDIFF_OUTPUT_ALL        0xf   /* all text outputs, the default */
+#define SNAPDIFF_OUTPUT_BINARY     0x10  /* serialized_diff.bin, see snapdiff_bin.h */
+#define SNAPDIFF_OUTPUT_DAG        0x20  /* dependency_dag */
+#define SNAPDIFF_OUTPUT_SHARDS     0x40  /* shards/<n>/, shards/cross/ */
+
+typedef struct SnapshotDiffOptions {
+   /*
+    * Parse every snapdiff page once, as it is read, and feed it straight
+    * through bucketization, serialization and json generation instead of
+    * re-reading the intermediate files of each stage.
+    */
+   bool     streaming;
+   unsigned outputs;      /* SNAPDIFF_OUTPUT_* bits */
+   /*
+    * Number of snapdiff pages a reader thread may read ahead of the
+    * processing, overlapping the page opens with local work. 0 reads
+    * every page inline.
+    */
+   unsigned prefetchPages;
+   /*
+    * Largest read issued on a snapdiff page, in bytes. Reads start small
+    * and grow up to it while they fill their buffers; a failed read halves
+    * it for the rest of the diff. Values below 16 KiB are raised to it.
+    */
+   unsigned readBlockSize;
+   /*
+    * Bytes of diffs kept in memory while bucketizing by level. Beyond it
+    * the largest buckets spill to disk, 0 spills after every page.
+    */
+   unsigned long long bucketMemoryLimit;
+   /*
+    * Threads sorting the entries of the snapdiff pages by level, each page
+    * on one thread. The pages are merged into the buckets in page order,
+    * so the outputs are the same for any count. 1 bucketizes inline. On
+    * Linux as many threads then copy the buckets into serialized_diff at
+    * precomputed offsets, unless it is compressed or its lines are needed
+    * one by one (binary, dag, shards, json in streaming mode or a
+    * serialized sink); 1 copies them inline.
+    */
+   unsigned bucketThreads;
+   /*
+    * Threads converting and writing the serialized_json chunks, each
+    * chunk on one thread. 1 generates json inline.
+    */
+   unsigned jsonThreads;
+   /*
+    * Threads stat'ing new entries for the json output, shared by all json
+    * threads. Each json chunk is stat'ed as one batch. 0 stats inline.
+    */
+   unsigned statThreads;
+   /*
+    * Diff items per serialized_json/<n>.json file, and per unit of work
+    * of the json threads in ndjson mode. 0 uses the default of 1000.
+    */
+   unsigned jsonChunkSize;
+   /*
+    * Write the json output as NDJSON, one record per line, into
+    * serialized_json/diff.ndjson instead of chunked <n>.json files. With
+    * a segment size the records are split at record boundaries into
+    * serialized_json/<n>.ndjson files of at most that many bytes.
+    */
+   bool     ndjson;
+   unsigned long long ndjsonSegmentSize;
+   /*
+    * Keep a checkpoint of the progress in <resultdir>/checkpoint: the raw
+    * pages saved, the cookie to continue from and the stages finished. A
+    * result dir holding a checkpoint of the same diff is not rejected as
+    * non-empty, the diff continues from the checkpoint instead. Streaming
+    * diffs need the raw output for this, the saved pages are replayed.
+    */
+   bool     resume;
+   /*
+    * Also write the metrics.prom metrics of the run to this file, replaced
+    * atomically, for the textfile collector of node_exporter. NULL to
+    * disable.
+    */
+   const char *metricsTextfile;
+   /*
+    * Collapse renames VDFS staged through the temporary .vdfs directory,
+    * X -> .vdfs/<n> and later .vdfs/<n> -> Y, into direct renames X -> Y
+    * wherever the level ordering allows, dropping .vdfs itself once no
+    * staged entry is left.
+    */
+   bool     compactRenames;
+   /*
+    * Number of shards of the shards output, at most 256, and the number of
+    * leading path components that assign an entry to its shard: 1 shards
+    * by top-level subtree. Each shard can be applied on its own, the cross
+    * shard after all of them.
+    */
+   unsigned numShards;
+   unsigned shardDepth;
+   /*
+    * NULL terminated lists of path rules, or NULL. Only entries on paths
+    * selected by an include rule, if there are any, and by no exclude rule
+    * are processed; the others are dropped as the snapdiff pages are
+    * parsed. A rule is a path prefix or a glob, see path_filter.h. Renames
+    * with one end outside the selection become a delete or a creation,
+    * renames staged through .vdfs by the ends of the whole move. The
+    * children of a directory renamed into the selection are not in the
+    * diff: its creation carries the path it was renamed from as extra,
+    * e.g. DIR_CMS to from, and stands for the whole subtree of to in snap2.
+    */
+   const char *const *includePaths;
+   const char *const *excludePaths;
+   /*
+    * Compress raw/, parallel_diff/, serialized_diff and serialized_json/
+    * with the codec the library was built with (make COMPRESS=zstd or
+    * COMPRESS=zlib), adding its suffix (.zst, .gz) to the file names.
+    * serialized_diff holds one frame per level, indexed by
+    * serialized_diff<suffix>.levels, json chunks and ndjson segments are
+    * frames of their own. Fails if the library was built without a codec.
+    */
+   bool     compress;
+} SnapshotDiffOptions;
+
+void SnapshotDiffOptionsInit(SnapshotDiffOptions *opts);
+
 int GetSnapshotDiff(const char *snapdir,
                     const char *snap1,
                     const char *snap2,
                     const char *resultdir,
                     bool        genJsonOutput);
 
+int GetSnapshotDiffEx(const char                *snapdir,
+                      const char                *snap1,
+                      const char                *snap2,
+                      const char                *resultdir,
+                      const SnapshotDiffOptions *opts);
+
+/*
+ * Typed diff entries for GetSnapshotDiffStream. The op of an entry, such
+ * as FILE_CMS, is split into its entry type (FILE) and its op kind, with
+ * the C/M/S/X letters of a change as flags.
+ */
+#define SNAPDIFF_ENTRY_OTHER       0
+#define SNAPDIFF_ENTRY_FILE        1
+#define SNAPDIFF_ENTRY_DIR         2
+#define SNAPDIFF_ENTRY_SYM         3
+
+#define SNAPDIFF_OP_CHANGE         0   /* combination of the flags below */
+#define SNAPDIFF_OP_DELETE         1
+#define SNAPDIFF_OP_RENAME         2
+
+#define SNAPDIFF_FLAG_CREATED      0x1 /* C */
+#define SNAPDIFF_FLAG_MODIFIED     0x2 /* M */
+#define SNAPDIFF_FLAG_STAT         0x4 /* S */
+#define SNAPDIFF_FLAG_XATTR        0x8 /* X */
+
+/*
+ * When entries are delivered: after the whole diff has been read, level by
+ * level in the order of serialized_diff, and/or while the snapdiff pages
+ * are read, in the order they come in.
+ */
+#define SNAPDIFF_DELIVER_SERIALIZED 0x1
+#define SNAPDIFF_DELIVER_AS_READ    0x2
+
+typedef struct SnapshotDiffEntry {
+   unsigned    delivery;       /* SNAPDIFF_DELIVER_* bit of this call */
+   int         level;          /* as in parallel_diff/<level> */
+   unsigned    entryType;      /* SNAPDIFF_ENTRY_* */
+   unsigned    opKind;         /* SNAPDIFF_OP_* */
+   unsigned    opFlags;        /* SNAPDIFF_FLAG_* */
+   const char *op;             /* as in the diff, e.g. FILE_CMS */
+   const char *path;
+   const char *extra;          /* new path of a rename, target of a created
+                                  symlink, old path of a directory renamed
+                                  into includePaths, "" otherwise */
+   /* Attributes of path in the second snapshot, if requested and found */
+   bool        hasStat;
+   long long   size;
+   long long   atimeSec;
+   long long   atimeNsec;
+   long long   ctimeSec;
+   long long   ctimeNsec;
+   long long   mtimeSec;
+   long long   mtimeNsec;
+} SnapshotDiffEntry;
+
+/*
+ * Called for every entry, the entry and its strings are only valid during
+ * the call. A non-zero return aborts the diff.
+ */
+typedef int (*SnapshotDiffEntryCallback)(const SnapshotDiffEntry *entry,
+                                         void                    *ctx);
+
+typedef struct SnapshotDiffSink {
+   SnapshotDiffEntryCallback callback;
+   void                     *ctx;
+   unsigned                  delivery;   /* SNAPDIFF_DELIVER_* bits */
+   /*
+    * Stat the entries that get stat information in the json output, on
+    * the statThreads of the options.
+    */
+   bool                      withStat;
+} SnapshotDiffSink;
+
+/*
+ * Single pass diff delivering the entries to sink. resultdir may be NULL,
+ * then nothing is written to disk and buckets are never spilled. Otherwise
+ * it is handled as by GetSnapshotDiffEx in streaming mode, including the
+ * outputs selected in opts (defaults if NULL).
+ */
+int GetSnapshotDiffStream(const char                *snapdir,
+                          const char                *snap1,
+                          const char                *snap2,
+                          const char                *resultdir,
+                          const SnapshotDiffOptions *opts,
+                          const SnapshotDiffSink    *sink);
+
+/*
+ * Reader of the compressed outputs. SnapDiffReaderOpen reads a whole file,
+ * compressed or not, SnapDiffReaderOpenLevel only the lines of one level
+ * of a compressed serialized_diff, through its .levels index, and NULL if
+ * the file or the level cannot be found. SnapDiffReaderRead fills buf with
+ * up to len bytes of decompressed data, returning their count, 0 at the
+ * end and -1 on errors, corrupt or truncated data.
+ */
+typedef struct SnapDiffReader SnapDiffReader;
+
+SnapDiffReader *SnapDiffReaderOpen(const char *fileName);
+SnapDiffReader *SnapDiffReaderOpenLevel(const char *serializedDiff,
+                                        int         level);
+long long SnapDiffReaderRead(SnapDiffReader *reader,
+                             char           *buf,
+                             size_t          len);
+void SnapDiffReaderClose(SnapDiffReader *reader);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -3,27 +3,230 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <errno.h>
 #include <iostream>
+#include <limits.h>
+#include <stdlib.h>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include "snapshot_diff.h"
 
 using namespace std;
 
+static void
+Usage(const char *prog)
+{
+   cerr << "Usage : " << prog << " [options] snapdir-path snap1 snap2 resultdir-path" << endl;
+   cerr << "Options :" << endl;
+   cerr << "   --streaming        parse each snapdiff page once, as it is read" << endl;
+   cerr << "   --outputs=LIST     comma separated outputs to write, any of" << endl;
+   cerr << "                      raw,parallel,serialized,json,binary,dag,shards" << endl;
+   cerr << "                      (default: raw,parallel,serialized,json)" << endl;
+   cerr << "   --prefetch=N       snapdiff pages to read ahead, 0 to disable" << endl;
+   cerr << "   --read-block=KB    largest read issued on a snapdiff page" << endl;
+   cerr << "   --bucket-memory=MB memory for level buckets before they spill to disk" << endl;
+   cerr << "   --bucket-threads=N threads sorting snapdiff pages by level and writing" << endl;
+   cerr << "                      the level buckets into serialized_diff" << endl;
+   cerr << "   --json-threads=N   threads generating json files" << endl;
+   cerr << "   --stat-threads=N   threads stat'ing entries for json files" << endl;
+   cerr << "   --json-chunk=N     diff items per json file" << endl;
+   cerr << "   --ndjson           write json as NDJSON records into diff.ndjson" << endl;
+   cerr << "   --ndjson-segment=MB split NDJSON into <n>.ndjson files of at most MB" << endl;
+   cerr << "   --resume           checkpoint the progress, continue an interrupted" << endl;
+   cerr << "                      diff in the result dir" << endl;
+   cerr << "   --metrics-textfile=PATH also write the Prometheus metrics to PATH" << endl;
+   cerr << "   --compact-renames  collapse renames staged through .vdfs into direct ones" << endl;
+   cerr << "   --shards=N         also write the diff split into N shards (at most 256)" << endl;
+   cerr << "   --shard-depth=N    path components assigning entries to shards" << endl;
+   cerr << "   --include=RULE     only diff paths matching the prefix or glob RULE" << endl;
+   cerr << "   --exclude=RULE     skip paths matching the prefix or glob RULE" << endl;
+   cerr << "   --compress         compress raw, parallel, serialized and json outputs" << endl;
+}
+
+static bool
+ParseOutputs(const string& list, unsigned *outputs)
+{
+   istringstream listStream{list};
+   string name;
+
+   *outputs = 0;
+   while (getline(listStream, name, ',')) {
+      if (name == "raw") {
+         *outputs |= SNAPDIFF_OUTPUT_RAW;
+      } else if (name == "parallel") {
+         *outputs |= SNAPDIFF_OUTPUT_PARALLEL;
+      } else if (name == "serialized") {
+         *outputs |= SNAPDIFF_OUTPUT_SERIALIZED;
+      } else if (name == "json") {
+         *outputs |= SNAPDIFF_OUTPUT_JSON;
+      } else if (name == "binary") {
+         *outputs |= SNAPDIFF_OUTPUT_BINARY;
+      } else if (name == "dag") {
+         *outputs |= SNAPDIFF_OUTPUT_DAG;
+      } else if (name == "shards") {
+         *outputs |= SNAPDIFF_OUTPUT_SHARDS;
+      } else {
+         return false;
+      }
+   }
+   return true;
+}
+
+static bool
+ParseUnsigned(const string& str, unsigned *val)
+{
+   char *end;
+   unsigned long parsed;
+
+   errno = 0;
+   parsed = strtoul(str.c_str(), &end, 10);
+   if (str.empty() || *end != '\0' || str[0] == '-' || errno == ERANGE ||
+       parsed > UINT_MAX) {
+      return false;
+   }
+   *val = (unsigned)parsed;
+   return true;
+}
+
 int main(int argc, char** argv)
 {
-   if (argc != 5) {
+   SnapshotDiffOptions opts;
+   vector<string> args;
+   vector<const char *> includePaths;
+   vector<const char *> excludePaths;
+
+   SnapshotDiffOptionsInit(&opts);
+
+   for (int i = 1; i < argc; ++i) {
+      string arg = argv[i];
+
+      if (arg == "--streaming") {
+         opts.streaming = true;
+      } else if (arg.compare(0, 10, "--outputs=") == 0) {
+         if (!ParseOutputs(arg.substr(10), &opts.outputs)) {
+            cerr << "Invalid outputs: " << arg.substr(10) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+      } else if (arg.compare(0, 11, "--prefetch=") == 0) {
+         if (!ParseUnsigned(arg.substr(11), &opts.prefetchPages)) {
+            cerr << "Invalid prefetch count: " << arg.substr(11) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+      } else if (arg.compare(0, 13, "--read-block=") == 0) {
+         unsigned kb;
+         if (!ParseUnsigned(arg.substr(13), &kb) || kb == 0 || kb > (1U << 21)) {
+            cerr << "Invalid read block size: " << arg.substr(13) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+         opts.readBlockSize = kb << 10;
+      } else if (arg.compare(0, 16, "--bucket-memory=") == 0) {
+         unsigned mb;
+         if (!ParseUnsigned(arg.substr(16), &mb)) {
+            cerr << "Invalid bucket memory: " << arg.substr(16) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+         opts.bucketMemoryLimit = (unsigned long long)mb << 20;
+      } else if (arg.compare(0, 17, "--bucket-threads=") == 0) {
+         if (!ParseUnsigned(arg.substr(17), &opts.bucketThreads)) {
+            cerr << "Invalid bucket thread count: " << arg.substr(17) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+      } else if (arg.compare(0, 15, "--json-threads=") == 0) {
+         if (!ParseUnsigned(arg.substr(15), &opts.jsonThreads)) {
+            cerr << "Invalid json thread count: " << arg.substr(15) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+      } else if (arg.compare(0, 15, "--stat-threads=") == 0) {
+         if (!ParseUnsigned(arg.substr(15), &opts.statThreads)) {
+            cerr << "Invalid stat thread count: " << arg.substr(15) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+      } else if (arg.compare(0, 13, "--json-chunk=") == 0) {
+         if (!ParseUnsigned(arg.substr(13), &opts.jsonChunkSize) ||
+             opts.jsonChunkSize == 0) {
+            cerr << "Invalid json chunk size: " << arg.substr(13) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+      } else if (arg == "--ndjson") {
+         opts.ndjson = true;
+      } else if (arg.compare(0, 17, "--ndjson-segment=") == 0) {
+         unsigned mb;
+         if (!ParseUnsigned(arg.substr(17), &mb)) {
+            cerr << "Invalid ndjson segment size: " << arg.substr(17) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+         opts.ndjson = true;
+         opts.ndjsonSegmentSize = (unsigned long long)mb << 20;
+      } else if (arg == "--resume") {
+         opts.resume = true;
+      } else if (arg == "--compact-renames") {
+         opts.compactRenames = true;
+      } else if (arg == "--compress") {
+         opts.compress = true;
+      } else if (arg.compare(0, 9, "--shards=") == 0) {
+         if (!ParseUnsigned(arg.substr(9), &opts.numShards) || opts.numShards == 0 ||
+             opts.numShards > 256) {
+            cerr << "Invalid shard count: " << arg.substr(9) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+         opts.outputs |= SNAPDIFF_OUTPUT_SHARDS;
+      } else if (arg.compare(0, 14, "--shard-depth=") == 0) {
+         if (!ParseUnsigned(arg.substr(14), &opts.shardDepth) || opts.shardDepth == 0) {
+            cerr << "Invalid shard depth: " << arg.substr(14) << endl;
+            Usage(argv[0]);
+            return 1;
+         }
+      } else if (arg.compare(0, 19, "--metrics-textfile=") == 0 &&
+                 arg.size() > 19) {
+         opts.metricsTextfile = argv[i] + 19;
+      } else if (arg.compare(0, 10, "--include=") == 0 && arg.size() > 10) {
+         includePaths.push_back(argv[i] + 10);
+      } else if (arg.compare(0, 10, "--exclude=") == 0 && arg.size() > 10) {
+         excludePaths.push_back(argv[i] + 10);
+      } else if (arg.compare(0, 2, "--") == 0) {
+         cerr << "Unknown option: " << arg << endl;
+         Usage(argv[0]);
+         return 1;
+      } else {
+         args.push_back(arg);
+      }
+   }
+
+   if (args.size() != 4) {
       cerr << "Invalid number of args to snapshot-diff" << endl;
-      cerr << "Usage : " << argv[0] << " snapdir-path snap1 snap2 resultdir-path" << endl;
+      Usage(argv[0]);
       return 1;
    }
 
-   if (GetSnapshotDiff(argv[1], argv[2], argv[3], argv[4], true) != 0) {
+   if (!includePaths.empty()) {
+      includePaths.push_back(NULL);
+      opts.includePaths = includePaths.data();
+   }
+   if (!excludePaths.empty()) {
+      excludePaths.push_back(NULL);
+      opts.excludePaths = excludePaths.data();
+   }
+
+   if (GetSnapshotDiffEx(args[0].c_str(), args[1].c_str(), args[2].c_str(),
+                         args[3].c_str(), &opts) != 0) {
       cerr << "Snapshot diff operation failed, please check log file for details" << endl;
       return 1;
    }
 
    cout << "Snapshot diff operation completed sucessfully, result exported to "
-        << string(argv[4]) << endl;
+        << args[3] << endl;
 
    return 0;
 }
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __STAT_ENGINE_H__
+#define __STAT_ENGINE_H__
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "metrics.h"
+#include "work_queue.h"
+
+/*
+ * Stat information reported in the json output for new entries.
+ */
+struct PathStat {
+   bool      ok = false;
+   long long size = 0;
+   time_t    asec = 0;
+   time_t    csec = 0;
+   time_t    msec = 0;
+   long long ansec = 0;
+   long long cnsec = 0;
+   long long mnsec = 0;
+};
+
+/*
+ * lstat()s absPath into st, st.ok tells if it succeeded.
+ */
+static inline void
+StatPath(const char *absPath, PathStat& st)
+{
+#ifdef _WIN32
+   struct _stat s;
+
+   st.ok = _stat(absPath, &s) == 0;
+   if (!st.ok) {
+      return;
+   }
+   st.size = s.st_size;
+   st.asec = s.st_atime;
+   st.csec = s.st_ctime;
+   st.msec = s.st_mtime;
+
+   // Windows doesn't report time in nanoseconds,
+   // so all nsec fields are set to 0 for Windows
+   st.ansec = 0;
+   st.cnsec = 0;
+   st.mnsec = 0;
+#else
+   struct stat s;
+
+   st.ok = lstat(absPath, &s) == 0;
+   if (!st.ok) {
+      return;
+   }
+   st.size = s.st_size;
+   st.ansec = s.st_atim.tv_nsec;
+   st.asec = s.st_atim.tv_sec;
+   st.cnsec = s.st_ctim.tv_nsec;
+   st.csec = s.st_ctim.tv_sec;
+   st.mnsec = s.st_mtim.tv_nsec;
+   st.msec = s.st_mtim.tv_sec;
+#endif /* _WIN32 */
+}
+
+/*
+ * Runs batches of stat calls on a fixed set of threads, so the round trips
+ * of a remote file system overlap. Stat() may be called from several
+ * threads at once; all batches share one request queue, which bounds the
+ * number of lookups in flight to maxInFlight plus the running ones. Each
+ * result is stored at the index of its path, so callers see them in entry
+ * order regardless of completion order. The paths are NUL terminated and
+ * usually live in the scratch arena of the batch. With no threads the
+ * batch is stat'ed inline. The time of each lookup is recorded into
+ * latency, if set.
+ */
+class StatEngine {
+public:
+   StatEngine(unsigned numThreads, size_t maxInFlight,
+              LatencyHistogram *latency = nullptr)
+      : latency_(latency),
+        requests_(maxInFlight)
+   {
+      for (unsigned i = 0; i < numThreads; ++i) {
+         threads_.emplace_back([this] {
+            Request request;
+            while (requests_.Pop(request)) {
+               TimedStat(request.path, *request.stat);
+
+               std::lock_guard<std::mutex> lock(request.batch->mutex);
+               if (--request.batch->pending == 0) {
+                  request.batch->done.notify_all();
+               }
+            }
+         });
+      }
+   }
+
+   ~StatEngine() {
+      requests_.Close();
+      for (auto& thread : threads_) {
+         thread.join();
+      }
+   }
+
+   void Stat(const std::vector<const char *>& paths,
+             std::vector<PathStat>&           stats) {
+      stats.assign(paths.size(), PathStat());
+      if (threads_.empty()) {
+         for (size_t i = 0; i < paths.size(); ++i) {
+            TimedStat(paths[i], stats[i]);
+         }
+         return;
+      }
+
+      Batch batch;
+      batch.pending = paths.size();
+      for (size_t i = 0; i < paths.size(); ++i) {
+         requests_.Push(Request{paths[i], &stats[i], &batch});
+      }
+
+      std::unique_lock<std::mutex> lock(batch.mutex);
+      batch.done.wait(lock, [&batch] { return batch.pending == 0; });
+   }
+
+private:
+   void TimedStat(const char *path, PathStat& st) {
+      LatencyTimer timer(latency_);
+
+      StatPath(path, st);
+   }
+
+   struct Batch {
+      std::mutex              mutex;
+      std::condition_variable done;
+      size_t                  pending;
+   };
+
+   struct Request {
+      const char *path;
+      PathStat   *stat;
+      Batch      *batch;
+   };
+
+   LatencyHistogram        *latency_;
+   BoundedQueue<Request>    requests_;
+   std::vector<std::thread> threads_;
+};
+
+#endif /* __STAT_ENGINE_H__ */
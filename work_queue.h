@@ -0,0 +1,123 @@
+/*
+ * Copyright 2020-2021 VMware, Inc.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __WORK_QUEUE_H__
+#define __WORK_QUEUE_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Bounded FIFO handing work items from producer to consumer threads.
+ * Push blocks while the queue is full, Pop blocks while it is empty.
+ * Close lets consumers drain the remaining items, Cancel drops them and
+ * wakes up everybody.
+ */
+template <class T>
+class BoundedQueue {
+public:
+   explicit BoundedQueue(size_t capacity)
+      : capacity_(capacity > 0 ? capacity : 1),
+        closed_(false),
+        cancelled_(false)
+   {}
+
+   bool Push(T&& item) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notFull_.wait(lock, [this] {
+         return cancelled_ || items_.size() < capacity_;
+      });
+      if (cancelled_ || closed_) {
+         return false;
+      }
+      items_.push_back(std::move(item));
+      notEmpty_.notify_one();
+      return true;
+   }
+
+   bool Pop(T& item) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notEmpty_.wait(lock, [this] {
+         return cancelled_ || closed_ || !items_.empty();
+      });
+      if (cancelled_ || items_.empty()) {
+         return false;
+      }
+      item = std::move(items_.front());
+      items_.pop_front();
+      notFull_.notify_one();
+      return true;
+   }
+
+   void Close() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+      notEmpty_.notify_all();
+   }
+
+   void Cancel() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cancelled_ = true;
+      items_.clear();
+      notEmpty_.notify_all();
+      notFull_.notify_all();
+   }
+
+private:
+   std::mutex              mutex_;
+   std::condition_variable notFull_;
+   std::condition_variable notEmpty_;
+   std::deque<T>           items_;
+   size_t                  capacity_;
+   bool                    closed_;
+   bool                    cancelled_;
+};
+
+/*
+ * Fixed set of threads running submitted jobs in FIFO order. Submit blocks
+ * while queueDepth jobs are waiting, which bounds the memory held by
+ * pending work. Wait runs the remaining jobs and joins the threads.
+ */
+class WorkerPool {
+public:
+   WorkerPool(unsigned numThreads, size_t queueDepth)
+      : jobs_(queueDepth)
+   {
+      for (unsigned i = 0; i < numThreads; ++i) {
+         threads_.emplace_back([this] {
+            std::function<void()> job;
+            while (jobs_.Pop(job)) {
+               job();
+            }
+         });
+      }
+   }
+
+   ~WorkerPool() {
+      Wait();
+   }
+
+   bool Submit(std::function<void()>&& job) {
+      return jobs_.Push(std::move(job));
+   }
+
+   void Wait() {
+      jobs_.Close();
+      for (auto& thread : threads_) {
+         thread.join();
+      }
+      threads_.clear();
+   }
+
+private:
+   BoundedQueue<std::function<void()>> jobs_;
+   std::vector<std::thread>            threads_;
+};
+
+#endif /* __WORK_QUEUE_H__ */